@@ -0,0 +1,158 @@
+/* headless benchmark mode (--bench): loads the level, renders a number of
+ * frames from the camera given with --camera, without a window or an OpenGL
+ * context, and reports the ray throughput and the distribution of frame times.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <imago2.h>
+#include "bench.h"
+#include "game.h"
+#include "rt.h"
+#include "stats.h"
+#include "trace.h"
+
+static int ulong_cmp(const void *a, const void *b);
+static void print_results(unsigned long *frame_usec, struct raystats *rs);
+static int save_frame(const char *fname);
+
+int run_bench(void)
+{
+	int i, res = -1;
+	unsigned long start, *frame_usec;
+	struct raystats rs;
+
+	if(!(frame_usec = malloc(opt.bench * sizeof *frame_usec))) {
+		fprintf(stderr, "run_bench: failed to allocate frame time array\n");
+		return -1;
+	}
+	if(!(tpool = tpool_create(opt.nthreads))) {
+		fprintf(stderr, "failed to create thread pool\n");
+		free(frame_usec);
+		return -1;
+	}
+	if(load_level(&lvl, opt.lvlfile ? opt.lvlfile : "data/test.lvl") == -1) {
+		goto end;
+	}
+	if(fbsize(opt.width, opt.height) == -1) {
+		fprintf(stderr, "run_bench: failed to allocate %dx%d framebuffer\n", opt.width, opt.height);
+		goto end_level;
+	}
+
+	/* dynamic objects stay where they start */
+	update_level(&lvl, 0);
+
+	cgm_midentity(view_xform);
+	cgm_mrotate_x(view_xform, opt.cam_phi);
+	cgm_mrotate_y(view_xform, opt.cam_theta);
+	cgm_mtranslate(view_xform, opt.cam_pos.x, opt.cam_pos.y, opt.cam_pos.z);
+
+	printf("benchmark: %d frames at %dx%d, %s renderer\n", opt.bench, fb.width, fb.height,
+			opt.wavefront ? "wavefront" : "tile");
+
+	if(opt.trace_file && trace_start(opt.trace_file) == -1) {
+		goto end_level;
+	}
+
+	get_ray_stats(&rs);	/* start counting from 0 */
+	for(i=0; i<opt.bench; i++) {
+		start = get_usec();
+		if(opt.wavefront) {
+			render_wavefront(i);
+		} else {
+			render(i);
+		}
+		frame_usec[i] = get_usec() - start;
+
+		if(opt.trace_file) {
+			trace_frame(i);
+		}
+	}
+	get_ray_stats(&rs);
+	trace_stop();
+
+	print_results(frame_usec, &rs);
+
+	if(opt.bench_out && save_frame(opt.bench_out) == -1) {
+		goto end_level;
+	}
+	res = 0;
+
+end_level:
+	destroy_level(&lvl);
+end:
+	tpool_destroy(tpool);
+	free(frame_usec);
+	return res;
+}
+
+static int ulong_cmp(const void *a, const void *b)
+{
+	unsigned long x = *(unsigned long*)a;
+	unsigned long y = *(unsigned long*)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+#define PERCENTILE(p)	(frame_usec[(opt.bench - 1) * (p) / 100] / 1000.0)
+
+static void print_results(unsigned long *frame_usec, struct raystats *rs)
+{
+	int i;
+	unsigned long total = 0, secondary = 0;
+	double sec, nrays;
+
+	for(i=0; i<opt.bench; i++) {
+		total += frame_usec[i];
+	}
+	sec = total / 1000000.0;
+	for(i=1; i<RAYSTATS_DEPTH; i++) {
+		secondary += rs->rays[i];
+	}
+	nrays = (double)rs->rays[0] + secondary + rs->shadow;
+
+	printf("total time: %.3f sec (%.2f fps)\n", sec, opt.bench / sec);
+	printf("rays: %lu primary, %lu secondary, %lu shadow\n", rs->rays[0],
+			secondary, rs->shadow);
+	printf("throughput: %.2f Mrays/s (primary: %.2f Mrays/s)\n", nrays / sec * 1e-6,
+			rs->rays[0] / sec * 1e-6);
+
+	qsort(frame_usec, opt.bench, sizeof *frame_usec, ulong_cmp);
+	printf("frame time (msec): min %.2f, median %.2f, 90%% %.2f, 99%% %.2f, max %.2f\n",
+			PERCENTILE(0), PERCENTILE(50), PERCENTILE(90), PERCENTILE(99), PERCENTILE(100));
+
+	printf("BVH construction: %lu msec\n", lvl.build_msec);
+	print_stats(stdout);
+}
+
+/* accumulated samples, tone mapped like sdr/pixel.glsl does at unit exposure */
+static int save_frame(const char *fname)
+{
+	int i, j;
+	unsigned char *pixels, *dest;
+	float inv_gamma, val;
+	cgm_vec4 *pix = fb.pixels;
+
+	if(!(pixels = malloc(fb.width * fb.height * 3))) {
+		fprintf(stderr, "save_frame: failed to allocate image buffer\n");
+		return -1;
+	}
+	inv_gamma = 1.0f / opt.gamma;
+
+	dest = pixels;
+	for(i=0; i<fb.width * fb.height; i++) {
+		for(j=0; j<3; j++) {
+			val = 1.0f - exp(-cgm_velem(pix, j) / pix->w);
+			val = pow(val, inv_gamma);
+			*dest++ = val > 0.0f ? (int)(val * 255.0f) : 0;
+		}
+		pix++;
+	}
+
+	if(img_save_pixels(fname, pixels, fb.width, fb.height, IMG_FMT_RGB24) == -1) {
+		fprintf(stderr, "save_frame: failed to write %s\n", fname);
+		free(pixels);
+		return -1;
+	}
+	printf("saved last frame: %s\n", fname);
+	free(pixels);
+	return 0;
+}
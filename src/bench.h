@@ -0,0 +1,9 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+/* renders opt.bench frames without a window, reports the results, and cleans
+ * up. Returns -1 on failure.
+ */
+int run_bench(void);
+
+#endif	/* BENCH_H_ */
@@ -1,156 +1,547 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <float.h>
 #include <assert.h>
 #include "bvh.h"
+#include "stats.h"
 
-#define SPLIT_BUCKETS	8
+#define SPLIT_BUCKETS	16
 
-static float eval_split_cost(struct bvhnode *node, float area, float sp, struct triangle **tribuf, int *part);
+/* multi-threaded builds bin nodes with at least PAR_BIN_MIN_FACES faces in
+ * parallel, in chunks of BIN_CHUNK_FACES, and hand out subtrees with at least
+ * TASK_MIN_FACES faces as separate tasks
+ */
+#define PAR_BIN_MIN_FACES	131072
+#define BIN_CHUNK_FACES		32768
+#define TASK_MIN_FACES		4096
+#define NODE_ALIGN		64
+#define BVH_STACK_SIZE	64
+
+/* refits of trees with at least REFIT_PAR_MIN_NODES nodes are split into
+ * subtrees of about REFIT_TASK_NODES nodes, refitted in parallel
+ */
+#define REFIT_PAR_MIN_NODES	32768
+#define REFIT_TASK_NODES	8192
+
+/* occlusion traversal descends into the child with the larger surface area
+ * first, as it's more likely to contain an occluder. Define as 0 to use the
+ * same near-first order as closest-hit queries.
+ */
+#ifndef OCCL_LARGEST_FIRST
+#define OCCL_LARGEST_FIRST	1
+#endif
+
+struct bin {
+	struct aabox aabb;
+	int count;
+};
+
+struct split {
+	int axis, bucket;
+	int nleft;
+};
+
+/* state shared by all tasks of a multi-threaded build */
+struct build_ctx {
+	struct thread_pool *tpool;
+	int error;	/* set by any failing task, accessed atomically */
+
+	struct bvhnode **pending;
+	int num_pending, max_pending;
+};
+
+/* range of flattened nodes making up a complete subtree */
+struct refit_job {
+	struct bvh *bvh;
+	int start, end;
+	float cost;
+};
+
+struct build_job {
+	struct bvhnode *node;
+	struct build_ctx *ctx;
+};
+
+/* a chunk of faces binned by a single task during parallel binning */
+struct bin_job {
+	struct triangle **faces;
+	int num;
+	struct aabox *cbox;		/* centroid bounds of the whole node (input) */
+	struct aabox cbox_part;	/* centroid bounds of this chunk (output) */
+	struct bin bins[3][SPLIT_BUCKETS];
+};
+
+static int build_sah_rec(struct bvhnode *tree, struct build_ctx *ctx);
+static int build_subtree(struct bvhnode *tree, struct build_ctx *ctx);
+static void build_task(void *cls);
+static int build_top(struct bvhnode *tree, struct build_ctx *ctx, int root);
+static int split_node(struct bvhnode *tree, struct aabox *cbox, struct bin bins[3][SPLIT_BUCKETS]);
+static int par_bin_faces(struct triangle **faces, int num, struct thread_pool *tpool,
+		struct aabox *cbox, struct bin bins[3][SPLIT_BUCKETS]);
+static inline void add_centroid(struct aabox *box, struct triangle *tri);
+static void bin_faces(struct triangle **faces, int num, struct aabox *cbox,
+		struct bin bins[3][SPLIT_BUCKETS]);
+static int find_split(struct bvhnode *node, struct bin bins[3][SPLIT_BUCKETS],
+		struct split *split, struct aabox *bbleft, struct aabox *bbright);
+static int partition(struct triangle **faces, int num, struct aabox *cbox, struct split *split);
+static int count_nodes(struct bvhnode *tree, int depth, int *num_faces, int *max_depth);
+static float refit_range(struct bvh *bvh, int start, int end);
+static void refit_task(void *cls, int start, int end);
+static void ray_bvhnode_rec(cgm_ray *ray, struct bvhnode *bn, struct trihit *th);
+static int occluded_bvhnode(cgm_ray *ray, struct bvhnode *bn, float tmax);
+static void flatten_rec(struct bvh *bvh, struct bvhnode *tree, int *nidx, int *fidx);
 
 int build_bvh_sah(struct bvhnode *tree)
 {
-	int i, best, nleft, nright;
-	float sp, sp0, spgap, area, ext[3];
-	float spcost[SPLIT_BUCKETS];
-	int part[SPLIT_BUCKETS];
-	struct triangle **tribuf;
-	struct aabox *aabb = &tree->aabb;
+	int i;
 
 	assert(tree->num_faces > 0);
 
 	if(tree->left || tree->right) return 0;
 
-	/* calculate the bounding box for this node */
-	aabox_init(aabb);
+	/* calculate the bounding box for the root, the rest of the nodes get their
+	 * bounds from the bins of their parent
+	 */
+	aabox_init(&tree->aabb);
 	for(i=0; i<tree->num_faces; i++) {
-		aabox_addface(aabb, tree->faces[i]);
+		aabox_addface(&tree->aabb, tree->faces[i]);
+	}
+	return build_sah_rec(tree, 0);
+}
+
+int build_bvh_sah_mt(struct bvhnode *tree, struct thread_pool *tpool)
+{
+	int i;
+	struct build_ctx ctx;
+
+	assert(tree->num_faces > 0);
+
+	if(!tpool) {
+		return build_bvh_sah(tree);
 	}
+	if(tree->left || tree->right) return 0;
+
+	ctx.tpool = tpool;
+	ctx.error = 0;
+	ctx.pending = 0;
+	ctx.num_pending = ctx.max_pending = 0;
+
+	/* split the top levels of the tree on this thread, binning in parallel.
+	 * Any nodes which are too small for parallel binning are collected, to be
+	 * built as independent tasks afterwards.
+	 */
+	if(build_top(tree, &ctx, 1) == -1) {
+		free(ctx.pending);
+		return -1;
+	}
+
+	tpool_begin_batch(tpool);
+	for(i=0; i<ctx.num_pending; i++) {
+		if(build_subtree(ctx.pending[i], &ctx) == -1) {
+			__atomic_store_n(&ctx.error, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	tpool_end_batch(tpool);
+	tpool_wait(tpool);
+
+	free(ctx.pending);
+	return __atomic_load_n(&ctx.error, __ATOMIC_RELAXED) ? -1 : 0;
+}
+
+static int build_sah_rec(struct bvhnode *tree, struct build_ctx *ctx)
+{
+	int i, res;
+	struct aabox cbox;
+	struct bin bins[3][SPLIT_BUCKETS];
 
 	if(tree->num_faces <= 1) {
 		return 0;
 	}
 
-	ext[0] = aabb->vmax.x - aabb->vmin.x;
-	ext[1] = aabb->vmax.y - aabb->vmin.y;
-	ext[2] = aabb->vmax.z - aabb->vmin.z;
+	aabox_init(&cbox);
+	for(i=0; i<tree->num_faces; i++) {
+		add_centroid(&cbox, tree->faces[i]);
+	}
 
-	if((area = surf_area(ext[0], ext[1], ext[2])) <= 0.0f) return 0;
+	bin_faces(tree->faces, tree->num_faces, &cbox, bins);
 
-	tree->axis = ext[0] > ext[1] ? (ext[0] > ext[2] ? 0 : 2) : (ext[1] > ext[2] ? 1 : 2);
+	if((res = split_node(tree, &cbox, bins)) <= 0) {
+		return res;
+	}
 
-	spgap = ext[tree->axis] / SPLIT_BUCKETS;
-	sp0 = cgm_velem(&tree->aabb.vmin, tree->axis) + spgap / 2.0f;
+	if(build_subtree(tree->left, ctx) == -1 || build_subtree(tree->right, ctx) == -1) {
+		return -1;
+	}
+	return 0;
+}
 
-	/* allocate N arrays worth of triangle pointers, one for each bucket */
-	if(!(tribuf = malloc(tree->num_faces * SPLIT_BUCKETS * sizeof *tribuf))) {
-		fprintf(stderr, "failed to allocate buffer for BVH construction\n");
+/* build a subtree, either recursively, or as a separate task if it's large
+ * enough and we're running a multi-threaded build
+ */
+static int build_subtree(struct bvhnode *tree, struct build_ctx *ctx)
+{
+	struct build_job *job;
+
+	if(!ctx || tree->num_faces < TASK_MIN_FACES) {
+		return build_sah_rec(tree, ctx);
+	}
+
+	if(!(job = malloc(sizeof *job))) {
+		fprintf(stderr, "failed to allocate BVH construction task\n");
 		return -1;
 	}
+	job->node = tree;
+	job->ctx = ctx;
+	if(tpool_enqueue(ctx->tpool, job, build_task, 0) == -1) {
+		free(job);
+		return build_sah_rec(tree, ctx);
+	}
+	return 0;
+}
+
+static void build_task(void *cls)
+{
+	struct build_job *job = cls;
+
+	if(!__atomic_load_n(&job->ctx->error, __ATOMIC_RELAXED) &&
+			build_sah_rec(job->node, job->ctx) == -1) {
+		__atomic_store_n(&job->ctx->error, 1, __ATOMIC_RELAXED);
+	}
+	free(job);
+}
+
+static int build_top(struct bvhnode *tree, struct build_ctx *ctx, int root)
+{
+	int i, res;
+	void *tmp;
+	struct aabox cbox;
+	struct bin bins[3][SPLIT_BUCKETS];
+
+	if(tree->num_faces < PAR_BIN_MIN_FACES) {
+		if(root) {
+			/* not worth the trouble, just build the whole thing as one task */
+			aabox_init(&tree->aabb);
+			for(i=0; i<tree->num_faces; i++) {
+				aabox_addface(&tree->aabb, tree->faces[i]);
+			}
+		}
+
+		if(ctx->num_pending >= ctx->max_pending) {
+			int newsz = ctx->max_pending ? ctx->max_pending * 2 : 16;
+			if(!(tmp = realloc(ctx->pending, newsz * sizeof *ctx->pending))) {
+				fprintf(stderr, "failed to resize pending BVH subtree list\n");
+				return -1;
+			}
+			ctx->pending = tmp;
+			ctx->max_pending = newsz;
+		}
+		ctx->pending[ctx->num_pending++] = tree;
+		return 0;
+	}
 
-	for(i=0; i<SPLIT_BUCKETS; i++) {
-		sp = sp0 + i * spgap;
-		spcost[i] = eval_split_cost(tree, area, sp, tribuf + i * tree->num_faces, part + i);
+	if(par_bin_faces(tree->faces, tree->num_faces, ctx->tpool, &cbox, bins) == -1) {
+		return -1;
 	}
 
-	best = 0;
-	for(i=1; i<SPLIT_BUCKETS; i++) {
-		if(spcost[i] <= spcost[best] && part[i] > 0 && part[i] < tree->num_faces) {
-			best = i;
+	if(root) {
+		/* every face falls into exactly one bin per axis */
+		aabox_init(&tree->aabb);
+		for(i=0; i<SPLIT_BUCKETS; i++) {
+			aabox_union(&tree->aabb, &tree->aabb, &bins[0][i].aabb);
 		}
 	}
 
-	nleft = part[best];
-	nright = tree->num_faces - part[best];
+	if((res = split_node(tree, &cbox, bins)) <= 0) {
+		return res;
+	}
+
+	if(build_top(tree->left, ctx, 0) == -1 || build_top(tree->right, ctx, 0) == -1) {
+		return -1;
+	}
+	return 0;
+}
 
-	if(spcost[best] > tree->num_faces || !nleft || !nright) {
-		/* the best split cost is worst than the no-split case, or best split
-		 * actually keeps all triangles under one side and 0 on the other
+/* split a node in two, according to the binned SAH. Returns 1 if the node
+ * was split, 0 if it's cheaper to keep it as a leaf, or -1 on failure.
+ */
+static int split_node(struct bvhnode *tree, struct aabox *cbox, struct bin bins[3][SPLIT_BUCKETS])
+{
+	int i, nleft;
+	struct aabox bbleft, bbright;
+	struct split split;
+
+	if(!find_split(tree, bins, &split, &bbleft, &bbright)) {
+		return 0;	/* cheaper to keep as a leaf */
+	}
+	tree->axis = split.axis;
+
+	nleft = partition(tree->faces, tree->num_faces, cbox, &split);
+	if(nleft != split.nleft) {
+		/* shouldn't happen, unless the compiler evaluates the centroids used for
+		 * binning and partitioning differently. Recalculate the child bounds.
 		 */
-		free(tribuf);
-		return 0;
+		if(!nleft || nleft >= tree->num_faces) return 0;
+		aabox_init(&bbleft);
+		aabox_init(&bbright);
+		for(i=0; i<tree->num_faces; i++) {
+			aabox_addface(i < nleft ? &bbleft : &bbright, tree->faces[i]);
+		}
 	}
 
-	memcpy(tree->faces, tribuf, tree->num_faces * sizeof *tribuf);
-	free(tribuf);
+	if(!(tree->left = calloc(1, sizeof *tree->left))) {
+		fprintf(stderr, "failed to allocate tree nodes during BVH construction\n");
+		return -1;
+	}
+	tree->left->faces = tree->faces;
+	tree->left->num_faces = nleft;
+	tree->left->aabb = bbleft;
 
-	if(nleft) {
-		if(!(tree->left = calloc(1, sizeof *tree->left))) {
-			fprintf(stderr, "failed to allocate tree nodes during BVH construction\n");
-			return -1;
+	if(!(tree->right = calloc(1, sizeof *tree->right))) {
+		fprintf(stderr, "failed to allocate tree nodes during BVH construction\n");
+		free(tree->left);
+		tree->left = 0;
+		return -1;
+	}
+	tree->right->faces = tree->faces + nleft;
+	tree->right->num_faces = tree->num_faces - nleft;
+	tree->right->aabb = bbright;
+
+	tree->num_faces = 0;
+	return 1;
+}
+
+int bvh_builder_id(const char *name)
+{
+	if(strcmp(name, "sah") == 0) {
+		return BVH_BUILD_SAH;
+	}
+	if(strcmp(name, "sbvh") == 0) {
+		return BVH_BUILD_SBVH;
+	}
+	return -1;
+}
+
+static inline float centroid(struct triangle *tri, int axis)
+{
+	return (cgm_velem(&tri->v[0].pos, axis) + cgm_velem(&tri->v[1].pos, axis) +
+			cgm_velem(&tri->v[2].pos, axis)) / 3.0f;
+}
+
+static inline void add_centroid(struct aabox *box, struct triangle *tri)
+{
+	cgm_vec3 c;
+
+	cgm_vcons(&c, centroid(tri, 0), centroid(tri, 1), centroid(tri, 2));
+	if(c.x < box->vmin.x) box->vmin.x = c.x;
+	if(c.x > box->vmax.x) box->vmax.x = c.x;
+	if(c.y < box->vmin.y) box->vmin.y = c.y;
+	if(c.y > box->vmax.y) box->vmax.y = c.y;
+	if(c.z < box->vmin.z) box->vmin.z = c.z;
+	if(c.z > box->vmax.z) box->vmax.z = c.z;
+}
+
+/* bucket of a centroid coordinate, with bucket 0 starting at the minimum of
+ * the centroid bounds on that axis
+ */
+static inline int bucket_index(float c, float cmin, float scale)
+{
+	int b = (int)((c - cmin) * scale);
+	if(b < 0) return 0;
+	return b >= SPLIT_BUCKETS ? SPLIT_BUCKETS - 1 : b;
+}
+
+static inline float bucket_scale(struct aabox *cbox, int axis)
+{
+	float ext = cgm_velem(&cbox->vmax, axis) - cgm_velem(&cbox->vmin, axis);
+	return ext > 0.0f ? SPLIT_BUCKETS / ext : 0.0f;
+}
+
+/* single pass over the faces, binning their centroids on all three axes */
+static void bin_faces(struct triangle **faces, int num, struct aabox *cbox,
+		struct bin bins[3][SPLIT_BUCKETS])
+{
+	int i, j, b;
+	float scale[3], cmin[3];
+	struct aabox fbox;
+
+	for(i=0; i<3; i++) {
+		scale[i] = bucket_scale(cbox, i);
+		cmin[i] = cgm_velem(&cbox->vmin, i);
+		for(j=0; j<SPLIT_BUCKETS; j++) {
+			aabox_init(&bins[i][j].aabb);
+			bins[i][j].count = 0;
 		}
-		tree->left->faces = tree->faces;
-		tree->left->num_faces = nleft;
+	}
 
-		if(build_bvh_sah(tree->left) == -1) {
-			free(tree->left);
-			return -1;
+	for(i=0; i<num; i++) {
+		aabox_init(&fbox);
+		aabox_addface(&fbox, faces[i]);
+
+		for(j=0; j<3; j++) {
+			b = bucket_index(centroid(faces[i], j), cmin[j], scale[j]);
+			aabox_union(&bins[j][b].aabb, &bins[j][b].aabb, &fbox);
+			bins[j][b].count++;
 		}
 	}
-	if(nright) {
-		if(!(tree->right = calloc(1, sizeof *tree->right))) {
-			fprintf(stderr, "failed to allocate tree nodes during BVH construction\n");
-			free(tree->left);
-			return -1;
+}
+
+static void centroid_bounds_task(void *cls, int start, int end)
+{
+	int i;
+	struct bin_job *job = (struct bin_job*)cls + start;
+
+	for(; start<end; start++) {
+		aabox_init(&job->cbox_part);
+		for(i=0; i<job->num; i++) {
+			add_centroid(&job->cbox_part, job->faces[i]);
 		}
-		tree->right->faces = tree->faces + nleft;
-		tree->right->num_faces = nright;
+		job++;
+	}
+}
 
-		if(build_bvh_sah(tree->right) == -1) {
-			free(tree->left);
-			free(tree->right);
-			return -1;
+static void bin_task(void *cls, int start, int end)
+{
+	struct bin_job *job = (struct bin_job*)cls + start;
+
+	for(; start<end; start++) {
+		bin_faces(job->faces, job->num, job->cbox, job->bins);
+		job++;
+	}
+}
+
+/* calculate the centroid bounds and bin the faces of a large node, by
+ * splitting them up in chunks processed in parallel, and merging the results
+ */
+static int par_bin_faces(struct triangle **faces, int num, struct thread_pool *tpool,
+		struct aabox *cbox, struct bin bins[3][SPLIT_BUCKETS])
+{
+	int i, j, k, nchunks;
+	struct bin_job *jobs;
+
+	nchunks = (num + BIN_CHUNK_FACES - 1) / BIN_CHUNK_FACES;
+	if(!(jobs = malloc(nchunks * sizeof *jobs))) {
+		fprintf(stderr, "failed to allocate BVH binning tasks\n");
+		return -1;
+	}
+	for(i=0; i<nchunks; i++) {
+		jobs[i].faces = faces + i * BIN_CHUNK_FACES;
+		jobs[i].num = i < nchunks - 1 ? BIN_CHUNK_FACES : num - i * BIN_CHUNK_FACES;
+		jobs[i].cbox = cbox;
+	}
+
+	tpool_parallel_for(tpool, nchunks, 1, centroid_bounds_task, jobs);
+
+	aabox_init(cbox);
+	for(i=0; i<nchunks; i++) {
+		aabox_union(cbox, cbox, &jobs[i].cbox_part);
+	}
+
+	tpool_parallel_for(tpool, nchunks, 1, bin_task, jobs);
+
+	for(i=0; i<3; i++) {
+		for(j=0; j<SPLIT_BUCKETS; j++) {
+			bins[i][j] = jobs[0].bins[i][j];
+			for(k=1; k<nchunks; k++) {
+				aabox_union(&bins[i][j].aabb, &bins[i][j].aabb, &jobs[k].bins[i][j].aabb);
+				bins[i][j].count += jobs[k].bins[i][j].count;
+			}
 		}
 	}
 
-	tree->num_faces = 0;
+	free(jobs);
 	return 0;
 }
 
-static float eval_split_cost(struct bvhnode *node, float area, float sp, struct triangle **tribuf, int *part)
+/* sweep the bins of each axis from both ends, to evaluate the SAH cost of
+ * all SPLIT_BUCKETS - 1 candidate splits. Returns 0 if no split is cheaper
+ * than leaving the node as a leaf.
+ */
+static int find_split(struct bvhnode *node, struct bin bins[3][SPLIT_BUCKETS],
+		struct split *split, struct aabox *bbleft, struct aabox *bbright)
 {
-	int i, nleft, nright;
-	float x, sp3, cost, sa_left, sa_right, cost_left, cost_right;
-	struct triangle *tri;
-	struct triangle **pleft, **pright;
-	struct aabox bbleft, bbright;
+	int i, axis, n;
+	float area, cost, best_cost;
+	struct aabox box;
+	float right_area[SPLIT_BUCKETS];
+	int right_count[SPLIT_BUCKETS];
+	struct aabox right_box[SPLIT_BUCKETS];
+
+	if((area = aabox_surf_area(&node->aabb)) <= 0.0f) {
+		return 0;
+	}
 
-	sp3 = sp * 3.0f;
+	/* no-split cost: intersect all faces */
+	best_cost = COST_LEAF(node->num_faces);
+	split->axis = -1;
 
-	aabox_init(&bbleft);
-	aabox_init(&bbright);
+	for(axis=0; axis<3; axis++) {
+		/* suffix sweep: accumulate everything right of each split plane */
+		aabox_init(&box);
+		n = 0;
+		for(i=SPLIT_BUCKETS-1; i>0; i--) {
+			aabox_union(&box, &box, &bins[axis][i].aabb);
+			n += bins[axis][i].count;
+			right_box[i] = box;
+			right_count[i] = n;
+			right_area[i] = n ? aabox_surf_area(&box) : 0.0f;
+		}
 
-	/* partition on sp */
-	pleft = tribuf;
-	pright = tribuf + node->num_faces - 1;
+		/* prefix sweep: split i puts buckets [0, i) on the left side */
+		aabox_init(&box);
+		n = 0;
+		for(i=1; i<SPLIT_BUCKETS; i++) {
+			aabox_union(&box, &box, &bins[axis][i - 1].aabb);
+			n += bins[axis][i - 1].count;
+			if(!n || !right_count[i]) continue;
 
-	for(i=0; i<node->num_faces; i++) {
-		tri = node->faces[i];
-		x = cgm_velem(&tri->v[0].pos, node->axis);
-		x += cgm_velem(&tri->v[1].pos, node->axis);
-		x += cgm_velem(&tri->v[2].pos, node->axis);
-		if(x < sp3) {
-			aabox_addface(&bbleft, tri);
-			*pleft++ = tri;
-		} else {
-			aabox_addface(&bbright, tri);
-			*pright-- = tri;
+			/* intersection cost = 1 per group of faces, see COST_LEAF */
+			cost = COST_TRAV + (aabox_surf_area(&box) * COST_LEAF(n) +
+					right_area[i] * COST_LEAF(right_count[i])) / area;
+			if(cost < best_cost) {
+				best_cost = cost;
+				split->axis = axis;
+				split->bucket = i;
+				split->nleft = n;
+				*bbleft = box;
+				*bbright = right_box[i];
+			}
 		}
 	}
 
-	nleft = pleft - tribuf;
-	nright = node->num_faces - nleft;
+	return split->axis >= 0;
+}
 
-	sa_left = nleft ? aabox_surf_area(&bbleft) : 0.0f;
-	sa_right = nright ? aabox_surf_area(&bbright) : 0.0f;
+/* in-place partition of the faces array, moving all faces which fall into
+ * buckets left of the split plane to the beginning. Returns the number of
+ * faces on the left side.
+ */
+static int partition(struct triangle **faces, int num, struct aabox *cbox, struct split *split)
+{
+	int i, j;
+	float scale, cmin;
+	struct triangle *tmp;
 
-	/* intersection cost = 1, traversal cost = 0.125 * intesection cost */
-	cost_left = sa_left * nleft;
-	cost_right = sa_right * nright;
-	cost = 0.125f + (cost_left + cost_right) / area;
+	scale = bucket_scale(cbox, split->axis);
+	cmin = cgm_velem(&cbox->vmin, split->axis);
 
-	*part = nleft;
-	return cost;
+	i = 0;
+	j = num - 1;
+	for(;;) {
+		while(i <= j && bucket_index(centroid(faces[i], split->axis), cmin, scale) < split->bucket) {
+			i++;
+		}
+		while(i <= j && bucket_index(centroid(faces[j], split->axis), cmin, scale) >= split->bucket) {
+			j--;
+		}
+		if(i >= j) break;
+
+		tmp = faces[i];
+		faces[i++] = faces[j];
+		faces[j--] = tmp;
+	}
+	return i;
 }
 
 void free_bvh_tree(struct bvhnode *tree)
@@ -190,52 +581,490 @@ void print_bvh_tree(struct bvhnode *tree, int lvl)
 	}
 }
 
-int ray_bvhnode(cgm_ray *ray, struct bvhnode *bn, float tmax, struct rayhit *hit)
+int flatten_bvh(struct bvh *bvh, struct bvhnode *tree)
 {
-	int i, res = 0;
-	struct rayhit hit0;
+	int nnodes, nfaces = 0, nidx = 0, fidx = 0;
+	size_t size;
 
-	if(!bn || !ray_aabox_any(ray, &bn->aabb, tmax)) {
+	memset(bvh, 0, sizeof *bvh);
+
+	if(!(nnodes = count_nodes(tree, 1, &nfaces, &bvh->max_depth))) {
+		return 0;	/* empty tree */
+	}
+
+	/* round up to a multiple of the alignment, as required by aligned_alloc */
+	size = (nnodes * sizeof *bvh->nodes + NODE_ALIGN - 1) & ~(size_t)(NODE_ALIGN - 1);
+	if(!(bvh->nodes = aligned_alloc(NODE_ALIGN, size))) {
+		fprintf(stderr, "flatten_bvh: failed to allocate %d nodes\n", nnodes);
+		return -1;
+	}
+	if(alloc_groups(bvh, nfaces / TRI_GROUP) == -1) {
+		free(bvh->nodes);
+		bvh->nodes = 0;
+		return -1;
+	}
+	bvh->num_nodes = bvh->max_nodes = nnodes;
+	bvh->width = 2;
+
+	flatten_rec(bvh, tree, &nidx, &fidx);
+	assert(nidx == nnodes && fidx == nfaces);
+	return 0;
+}
+
+void destroy_bvh(struct bvh *bvh)
+{
+	if(!bvh) return;
+	free(bvh->nodes);
+	free(bvh->faces);
+	free(bvh->groups);
+	free(bvh->wnodes);
+	free(bvh->lbvh_tmp);
+	bvh->nodes = 0;
+	bvh->faces = 0;
+	bvh->groups = 0;
+	bvh->wnodes = 0;
+	bvh->lbvh_tmp = 0;
+	bvh->lbvh_max_faces = 0;
+	bvh->num_nodes = bvh->max_nodes = bvh->num_faces = bvh->num_wnodes = 0;
+	bvh->num_groups = bvh->max_groups = 0;
+}
+
+/* resizes the faces and groups arrays of bvh for num groups, keeping the
+ * existing ones if they're big enough. The contents are not preserved.
+ */
+int alloc_groups(struct bvh *bvh, int num)
+{
+	size_t size;
+
+	if(!bvh->groups || bvh->max_groups < num) {
+		free(bvh->faces);
+		free(bvh->groups);
+		bvh->groups = 0;
+		bvh->num_faces = bvh->num_groups = bvh->max_groups = 0;
+
+		size = (num * sizeof *bvh->groups + NODE_ALIGN - 1) & ~(size_t)(NODE_ALIGN - 1);
+		if(!(bvh->faces = malloc(num * TRI_GROUP * sizeof *bvh->faces)) ||
+				!(bvh->groups = aligned_alloc(NODE_ALIGN, size))) {
+			fprintf(stderr, "alloc_groups: failed to allocate face arrays (%d)\n",
+					num * TRI_GROUP);
+			free(bvh->faces);
+			bvh->faces = 0;
+			return -1;
+		}
+		bvh->max_groups = num;
+	}
+	bvh->num_groups = num;
+	bvh->num_faces = num * TRI_GROUP;
+	return 0;
+}
+
+void setup_leaf_groups(struct bvh *bvh, int offs, int count)
+{
+	int i;
+	struct triangle **faces = bvh->faces + offs;
+	struct trigroup *grp = bvh->groups + offs / TRI_GROUP;
+
+	for(i=0; i<count; i+=TRI_GROUP) {
+		trigroup_setup(grp++, faces + i, count - i);
+	}
+	/* null padding up to the start of the next group */
+	for(i=count; i % TRI_GROUP; i++) {
+		faces[i] = 0;
+	}
+}
+
+float refit_bvh(struct bvh *bvh, struct thread_pool *tpool)
+{
+	int i, idx, end, num_top, max_top, num_jobs, top_sp;
+	float cost, area;
+	struct bvhflat *node;
+	struct refit_job *jobs = 0;
+	int *top = 0, *stack = 0;
+
+	if(!bvh->num_nodes) return 0.0f;
+
+	if(!tpool || bvh->num_nodes < REFIT_PAR_MIN_NODES) {
+		cost = refit_range(bvh, 0, bvh->num_nodes);
+		goto done;
+	}
+
+	/* in the depth-first layout every subtree is a contiguous range of nodes,
+	 * starting at its root. Descend from the root until the subtrees are small
+	 * enough, and refit them as independent tasks. The interior nodes above
+	 * them are refitted last, in reverse order of discovery.
+	 */
+	max_top = bvh->num_nodes / REFIT_TASK_NODES * 2;
+	jobs = malloc((max_top + 1) * sizeof *jobs);
+	top = malloc(max_top * sizeof *top);
+	stack = malloc((max_top + 1) * 2 * sizeof *stack);
+	if(!jobs || !top || !stack) {
+		cost = refit_range(bvh, 0, bvh->num_nodes);
+		goto done;
+	}
+
+	num_top = num_jobs = 0;
+	stack[0] = 0;
+	stack[1] = bvh->num_nodes;
+	top_sp = 2;
+	while(top_sp > 0) {
+		end = stack[--top_sp];
+		idx = stack[--top_sp];
+		node = bvh->nodes + idx;
+
+		/* unbalanced trees can have long chains of big subtrees, so the
+		 * number of tasks is capped, letting the last ones grow larger
+		 */
+		if(node->count || end - idx <= REFIT_TASK_NODES || num_top >= max_top) {
+			jobs[num_jobs].bvh = bvh;
+			jobs[num_jobs].start = idx;
+			jobs[num_jobs++].end = end;
+			continue;
+		}
+		top[num_top++] = idx;
+		stack[top_sp++] = idx + 1;
+		stack[top_sp++] = node->offs;
+		stack[top_sp++] = node->offs;
+		stack[top_sp++] = end;
+	}
+
+	tpool_parallel_for(tpool, num_jobs, 1, refit_task, jobs);
+
+	cost = 0.0f;
+	for(i=0; i<num_jobs; i++) {
+		cost += jobs[i].cost;
+	}
+	for(i=num_top-1; i>=0; i--) {
+		node = bvh->nodes + top[i];
+		aabox_union(&node->aabb, &node[1].aabb, &bvh->nodes[node->offs].aabb);
+		node->big_right = aabox_surf_area(&bvh->nodes[node->offs].aabb) >
+			aabox_surf_area(&node[1].aabb);
+		cost += COST_TRAV * aabox_surf_area(&node->aabb);
+	}
+
+done:
+	free(jobs);
+	free(top);
+	free(stack);
+
+	/* the wide nodes hold their own copies of the child bounds */
+	if(bvh->wnodes) {
+		build_wide_bvh(bvh, bvh->width);
+	}
+
+	area = aabox_surf_area(&bvh->nodes[0].aabb);
+	return area > 0.0f ? cost / area : 0.0f;
+}
+
+/* children always come after their parent, so a reverse pass over a subtree
+ * visits them first. Returns the unnormalized SAH cost of the subtree.
+ */
+static float refit_range(struct bvh *bvh, int start, int end)
+{
+	int i, j;
+	float cost = 0.0f;
+	struct bvhflat *node;
+
+	for(i=end-1; i>=start; i--) {
+		node = bvh->nodes + i;
+		if(node->count) {
+			aabox_init(&node->aabb);
+			for(j=0; j<node->count; j++) {
+				aabox_addface(&node->aabb, bvh->faces[node->offs + j]);
+			}
+			setup_leaf_groups(bvh, node->offs, node->count);
+			cost += aabox_surf_area(&node->aabb) * COST_LEAF(node->count);
+		} else {
+			aabox_union(&node->aabb, &node[1].aabb, &bvh->nodes[node->offs].aabb);
+			node->big_right = aabox_surf_area(&bvh->nodes[node->offs].aabb) >
+				aabox_surf_area(&node[1].aabb);
+			cost += COST_TRAV * aabox_surf_area(&node->aabb);
+		}
+	}
+	return cost;
+}
+
+static void refit_task(void *cls, int start, int end)
+{
+	struct refit_job *job = (struct refit_job*)cls + start;
+
+	for(; start<end; start++) {
+		job->cost = refit_range(job->bvh, job->start, job->end);
+		job++;
+	}
+}
+
+static int count_nodes(struct bvhnode *tree, int depth, int *num_faces, int *max_depth)
+{
+	if(!tree) return 0;
+
+	if(depth > *max_depth) *max_depth = depth;
+
+	if(tree->num_faces) {
+		/* every leaf starts at a new group */
+		*num_faces += (tree->num_faces + TRI_GROUP - 1) / TRI_GROUP * TRI_GROUP;
+		return 1;
+	}
+	if(!tree->left && !tree->right) {
 		return 0;
 	}
+	return 1 + count_nodes(tree->left, depth + 1, num_faces, max_depth) +
+		count_nodes(tree->right, depth + 1, num_faces, max_depth);
+}
+
+static void flatten_rec(struct bvh *bvh, struct bvhnode *tree, int *nidx, int *fidx)
+{
+	struct bvhflat *node = bvh->nodes + (*nidx)++;
+
+	node->aabb = tree->aabb;
+	node->axis = tree->axis;
+
+	if(tree->num_faces) {
+		node->offs = *fidx;
+		node->count = tree->num_faces;
+		memcpy(bvh->faces + *fidx, tree->faces, tree->num_faces * sizeof *bvh->faces);
+		setup_leaf_groups(bvh, *fidx, tree->num_faces);
+		*fidx += (tree->num_faces + TRI_GROUP - 1) / TRI_GROUP * TRI_GROUP;
+		return;
+	}
+
+	/* build_bvh* always produces interior nodes with two children */
+	assert(tree->left && tree->right);
+	node->count = 0;
+	node->big_right = aabox_surf_area(&tree->right->aabb) > aabox_surf_area(&tree->left->aabb);
+	flatten_rec(bvh, tree->left, nidx, fidx);
+	node->offs = *nidx;
+	flatten_rec(bvh, tree->right, nidx, fidx);
+}
+
+int ray_bvhnode(cgm_ray *ray, struct bvhnode *bn, float tmax, struct rayhit *hit)
+{
+	struct trihit th;
 
 	if(!hit) {
-		if(bn->num_faces) {
-			for(i=0; i<bn->num_faces; i++) {
-				if(ray_triangle(ray, bn->faces[i], tmax, 0)) {
-					return 1;
-				}
-			}
-			return 0;
+		return occluded_bvhnode(ray, bn, tmax);
+	}
+
+	th.t = tmax;
+	th.tri = 0;
+	ray_bvhnode_rec(ray, bn, &th);
+
+	if(th.tri) {
+		tri_hit_attr(ray, &th, hit);
+		return 1;
+	}
+	return 0;
+}
+
+/* th->t doubles as tmax, and only gets updated by closer hits */
+static void ray_bvhnode_rec(cgm_ray *ray, struct bvhnode *bn, struct trihit *th)
+{
+	int i;
+
+	if(!bn || !ray_aabox_any(ray, &bn->aabb, th->t)) {
+		return;
+	}
+
+	if(bn->num_faces) {
+		for(i=0; i<bn->num_faces; i++) {
+			ray_triangle_uv(ray, bn->faces[i], th->t, th);
 		}
-		return ray_bvhnode(ray, bn->left, tmax, 0) || ray_bvhnode(ray, bn->right, tmax, 0);
+		return;
 	}
+	ray_bvhnode_rec(ray, bn->left, th);
+	ray_bvhnode_rec(ray, bn->right, th);
+}
 
-	hit0.t = FLT_MAX;
+static int occluded_bvhnode(cgm_ray *ray, struct bvhnode *bn, float tmax)
+{
+	int i;
+
+	if(!bn || !ray_aabox_any(ray, &bn->aabb, tmax)) {
+		return 0;
+	}
 
 	if(bn->num_faces) {
-		/* leaf node, intersect faces */
 		for(i=0; i<bn->num_faces; i++) {
-			if(ray_triangle(ray, bn->faces[i], tmax, hit) && hit->t < hit0.t) {
-				hit0 = *hit;
-				res = 1;
+			if(ray_triangle_any(ray, bn->faces[i], tmax)) {
+				return 1;
 			}
 		}
-	} else {
-		/* internal node, recurse */
-		if(ray_bvhnode(ray, bn->left, tmax, hit)) {
-			hit0 = *hit;
-			res = 1;
-		}
-		if(ray_bvhnode(ray, bn->right, tmax, hit) && hit->t < hit0.t) {
-			hit0 = *hit;
-			res = 1;
+		return 0;
+	}
+	return occluded_bvhnode(ray, bn->left, tmax) || occluded_bvhnode(ray, bn->right, tmax);
+}
+
+/* traversal kernels, specialized for each ray direction octant by passing oct
+ * as a constant, which resolves the slab planes of the box tests and the
+ * near-first child order at compile time
+ */
+static inline __attribute__((always_inline)) int ray_bvh_kernel(cgm_ray *ray,
+		struct rayinv *ri, struct bvh *bvh, float tmax, struct trihit *th, int *stack,
+		int oct)
+{
+	int top, idx, near, far, found = 0;
+	struct bvhflat *node;
+
+	top = 0;
+	idx = 0;
+	for(;;) {
+		node = bvh->nodes + idx;
+		STAT_ADD(nodes, 1);
+
+		/* tmax shrinks as closer hits are found, culling farther subtrees */
+		if(ray_aabox_oct(ri, &node->aabb, tmax, oct)) {
+			if(!node->count) {
+				/* visit the nearest child first, and defer the other. The left
+				 * child contains the faces on the low side of the split axis.
+				 */
+				if(oct & (1 << node->axis)) {
+					near = node->offs;
+					far = idx + 1;
+				} else {
+					near = idx + 1;
+					far = node->offs;
+				}
+				stack[top++] = far;
+				idx = near;
+				continue;
+			}
+
+			/* ray_trigroups only reports hits closer than tmax, so any hit
+			 * found here is the closest so far
+			 */
+			STAT_ADD(leaves, 1);
+			STAT_ADD(tri_tests, node->count);
+			if(ray_trigroups(ray, bvh->groups + node->offs / TRI_GROUP,
+						bvh->faces + node->offs, node->count, tmax, th)) {
+				tmax = th->t;
+				found = 1;
+			}
 		}
+
+		if(!top) break;
+		idx = stack[--top];
 	}
+	return found;
+}
 
-	if(res) {
-		*hit = hit0;
-		return 1;
+static inline __attribute__((always_inline)) int occluded_bvh_kernel(cgm_ray *ray,
+		struct rayinv *ri, struct bvh *bvh, float tmax, int *stack, int oct)
+{
+	int top, idx, first;
+	struct bvhflat *node;
+
+	top = 0;
+	idx = 0;
+	for(;;) {
+		node = bvh->nodes + idx;
+		STAT_ADD(nodes, 1);
+
+		if(ray_aabox_oct(ri, &node->aabb, tmax, oct)) {
+			if(!node->count) {
+#if OCCL_LARGEST_FIRST
+				first = node->big_right;
+#else
+				first = (oct >> node->axis) & 1;
+#endif
+				if(first) {
+					stack[top++] = idx + 1;
+					idx = node->offs;
+				} else {
+					stack[top++] = node->offs;
+					idx++;
+				}
+				continue;
+			}
+
+			STAT_ADD(leaves, 1);
+			STAT_ADD(tri_tests, node->count);
+			if(ray_trigroups_any(ray, bvh->groups + node->offs / TRI_GROUP,
+						bvh->faces + node->offs, node->count, tmax)) {
+				STAT_ADD(early_out, 1);
+				return 1;
+			}
+		}
+
+		if(!top) break;
+		idx = stack[--top];
 	}
 	return 0;
 }
+
+typedef int (*ray_kernel_func)(cgm_ray*, struct rayinv*, struct bvh*, float, struct trihit*, int*);
+typedef int (*occl_kernel_func)(cgm_ray*, struct rayinv*, struct bvh*, float, int*);
+
+#define OCT_KERNELS(oct) \
+	static int ray_bvh_oct##oct(cgm_ray *ray, struct rayinv *ri, struct bvh *bvh, \
+			float tmax, struct trihit *th, int *stack) \
+	{ \
+		return ray_bvh_kernel(ray, ri, bvh, tmax, th, stack, oct); \
+	} \
+	static int occluded_bvh_oct##oct(cgm_ray *ray, struct rayinv *ri, struct bvh *bvh, \
+			float tmax, int *stack) \
+	{ \
+		return occluded_bvh_kernel(ray, ri, bvh, tmax, stack, oct); \
+	}
+
+OCT_KERNELS(0)
+OCT_KERNELS(1)
+OCT_KERNELS(2)
+OCT_KERNELS(3)
+OCT_KERNELS(4)
+OCT_KERNELS(5)
+OCT_KERNELS(6)
+OCT_KERNELS(7)
+
+static ray_kernel_func ray_kernel[8] = {
+	ray_bvh_oct0, ray_bvh_oct1, ray_bvh_oct2, ray_bvh_oct3,
+	ray_bvh_oct4, ray_bvh_oct5, ray_bvh_oct6, ray_bvh_oct7
+};
+static occl_kernel_func occl_kernel[8] = {
+	occluded_bvh_oct0, occluded_bvh_oct1, occluded_bvh_oct2, occluded_bvh_oct3,
+	occluded_bvh_oct4, occluded_bvh_oct5, occluded_bvh_oct6, occluded_bvh_oct7
+};
+
+int ray_bvh(cgm_ray *ray, struct bvh *bvh, float tmax, struct rayhit *hit)
+{
+	int stackbuf[BVH_STACK_SIZE], *stack = stackbuf;
+	struct rayinv ri;
+	struct trihit th;
+
+	if(!hit) {
+		return occluded_bvh(ray, bvh, tmax);
+	}
+	if(!bvh->num_nodes) return 0;
+	if(bvh->wnodes) {
+		return ray_bvh_wide(ray, bvh, tmax, hit);
+	}
+
+	if(bvh->max_depth > BVH_STACK_SIZE) {
+		stack = alloca(bvh->max_depth * sizeof *stack);
+	}
+
+	init_rayinv(&ri, ray);
+	if(!ray_kernel[ri.oct](ray, &ri, bvh, tmax, &th, stack)) {
+		return 0;
+	}
+
+	/* hit attributes are only interpolated for the closest hit */
+	tri_hit_attr(ray, &th, hit);
+	return 1;
+}
+
+int occluded_bvh(cgm_ray *ray, struct bvh *bvh, float tmax)
+{
+	int stackbuf[BVH_STACK_SIZE], *stack = stackbuf;
+	struct rayinv ri;
+
+	if(!bvh->num_nodes) return 0;
+	if(bvh->wnodes) {
+		return occluded_bvh_wide(ray, bvh, tmax);
+	}
+
+	if(bvh->max_depth > BVH_STACK_SIZE) {
+		stack = alloca(bvh->max_depth * sizeof *stack);
+	}
+
+	init_rayinv(&ri, ray);
+	return occl_kernel[ri.oct](ray, &ri, bvh, tmax, stack);
+}
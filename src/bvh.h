@@ -2,6 +2,7 @@
 #define BVH_H_
 
 #include "geom.h"
+#include "tpool.h"
 
 struct bvhnode {
 	struct aabox aabb;
@@ -13,13 +14,162 @@ struct bvhnode {
 	struct bvhnode *left, *right;
 };
 
+/* flattened BVH node (32 bytes). Nodes are stored in depth-first order, with
+ * the left child of each interior node immediately following its parent, and
+ * the right child at index offs. Leaf nodes (count > 0) reference count
+ * triangles starting at offs in the faces array of the bvh, and group
+ * offs / TRI_GROUP in the groups array.
+ */
+struct bvhflat {
+	struct aabox aabb;
+	int offs;
+	unsigned int count : 29;
+	unsigned int axis : 2;
+	unsigned int big_right : 1;	/* right child has the larger surface area */
+};
+
+/* Optional multi-branching version of the tree, built by build_wide_bvh, and
+ * used for traversal instead of the binary nodes if present. Each node of a
+ * tree of width W holds W child slots in SoA form, 32 bytes per slot:
+ *   float bmin[3][W], bmax[3][W];
+ *   int child[W];	- node index for interior children, face offset for leaves
+ *   int count[W];	- number of faces for leaves, 0 for interior, -1 if empty
+ * Leaves reference the same faces array as the binary tree.
+ */
+struct bvh {
+	struct bvhflat *nodes;
+	int num_nodes, max_nodes;
+
+	/* intersection data for each group of TRI_GROUP faces, in the same order.
+	 * Every leaf starts at a new group, with the unused entries of the faces
+	 * array padded with nulls, so num_faces = num_groups * TRI_GROUP. Traversal
+	 * only touches groups, and faces just for the final hit.
+	 */
+	struct triangle **faces;
+	struct trigroup *groups;
+	int num_faces, num_groups, max_groups;
+
+	int max_depth;
+	float sah_cost;	/* cost of the tree as built, if known, see refit_bvh */
+
+	int width;		/* 2 for binary, or 4/8 if wnodes has been built */
+	void *wnodes;
+	int num_wnodes;
+	int max_wdepth;
+
+	/* sort keys and temporary nodes of build_bvh_lbvh, kept for rebuilds */
+	void *lbvh_tmp;
+	int lbvh_max_faces;
+};
+
+/* bundle of up to PACKET_MAX_RAYS coherent rays, traced together through the
+ * binary tree by ray_bvh_packet. The ray data is kept in SoA form, padded with
+ * inactive rays to a multiple of 4. th[i].tri is null for rays which haven't
+ * hit anything yet, and tmax[i] is the distance of the closest hit so far.
+ */
+#define PACKET_MAX_RAYS		64
+
+struct raypacket {
+	float org[3][PACKET_MAX_RAYS] __attribute__((aligned(16)));
+	float idir[3][PACKET_MAX_RAYS] __attribute__((aligned(16)));
+	float tmax[PACKET_MAX_RAYS] __attribute__((aligned(16)));
+	int num_rays;
+
+	cgm_ray ray[PACKET_MAX_RAYS];
+	struct trihit th[PACKET_MAX_RAYS];
+
+	/* interval bounds of the origins and inverse directions of all rays, used
+	 * to cull nodes missed by the whole packet. Axes where the directions are
+	 * negative are mirrored, so that all intervals are for positive
+	 * directions. Only valid if all signs agree on every axis (frustum = 1).
+	 * tmax_max is the largest tmax of any ray, lowered as they hit things.
+	 */
+	int frustum;
+	int neg[3];
+	float omin[3], omax[3], imin[3], imax[3];
+	float tmax_max;
+};
+
+enum {
+	BVH_BUILD_SAH,		/* binned SAH object splits */
+	BVH_BUILD_SBVH		/* object and spatial splits, duplicating references */
+};
+
+/* SAH cost of intersecting a leaf of n faces, relative to the traversal cost
+ * of COST_TRAV. Leaves are intersected a group at a time, so there's no point
+ * in splitting them below TRI_GROUP faces.
+ */
+#define COST_TRAV			0.125f
+#define COST_LEAF(n)		(float)(((n) + TRI_GROUP - 1) / TRI_GROUP)
+
+/* default fraction of extra face references the SBVH builder may create */
+#define SBVH_DEF_BUDGET		0.5f
+
 /* build_bvh* needs to be called with a pointer to a single-node tree,
  * containing all the faces, left/right as null, and a pre-computed aabb
  */
 int build_bvh_sah(struct bvhnode *tree);
+/* same as build_bvh_sah, but splits up the work into tasks for the thread pool.
+ * Must not be called from a thread pool worker.
+ */
+int build_bvh_sah_mt(struct bvhnode *tree, struct thread_pool *tpool);
+/* spatial split BVH. Faces may be referenced by more than one leaf, up to
+ * dup_budget * num_faces extra references. Every leaf owns its faces array.
+ */
+int build_bvh_sbvh(struct bvhnode *tree, float dup_budget);
+/* linear BVH over the faces of a single-node tree, built directly into bvh.
+ * Meant to be called every frame for moving geometry: bvh should be zeroed
+ * the first time, and its arrays are reused by subsequent rebuilds. Treelet
+ * restructuring improves the tree at a significant cost in build time.
+ */
+int build_bvh_lbvh(struct bvh *bvh, struct bvhnode *tree, struct thread_pool *tpool,
+		int restructure);
+/* returns one of the BVH_BUILD_* values for a builder name, or -1 */
+int bvh_builder_id(const char *name);
 void free_bvh_tree(struct bvhnode *tree);
 void print_bvh_tree(struct bvhnode *tree, int lvl);
 
+/* convert a pointer-linked tree produced by build_bvh* into the linear
+ * representation used for traversal. The tree is left intact.
+ */
+int flatten_bvh(struct bvh *bvh, struct bvhnode *tree);
+void destroy_bvh(struct bvh *bvh);
+
+/* used by the builders writing directly into a struct bvh: alloc_groups sizes
+ * the faces and groups arrays for num groups, and setup_leaf_groups fills in
+ * the groups of a leaf from its faces, and pads it to a group boundary.
+ */
+int alloc_groups(struct bvh *bvh, int num);
+void setup_leaf_groups(struct bvh *bvh, int offs, int count);
+
+/* recompute the bounds of all nodes and the intersection data of all faces
+ * after the faces have moved, keeping the same topology. Returns the SAH cost
+ * of the refitted tree, which can be compared with sah_cost to decide when
+ * it's time for a full rebuild.
+ */
+float refit_bvh(struct bvh *bvh, struct thread_pool *tpool);
+
+/* collapse a flattened binary tree into a 4 or 8-wide tree */
+int build_wide_bvh(struct bvh *bvh, int width);
+/* best tree width for the SIMD capabilities of the current CPU */
+int bvh_auto_width(void);
+
 int ray_bvhnode(cgm_ray *ray, struct bvhnode *bn, float tmax, struct rayhit *hit);
+int ray_bvh(cgm_ray *ray, struct bvh *bvh, float tmax, struct rayhit *hit);
+/* occlusion query: returns 1 if anything is hit closer than tmax */
+int occluded_bvh(cgm_ray *ray, struct bvh *bvh, float tmax);
+
+/* sets up a packet for num rays (up to PACKET_MAX_RAYS) */
+void init_packet(struct raypacket *pk, cgm_ray *rays, int num, float tmax);
+/* closest hits of all rays in the packet, traversing the binary nodes once for
+ * the whole packet. Can be called for multiple trees in turn, each one only
+ * replacing hits with closer ones. Returns 1 if any ray found a closer hit in
+ * this tree.
+ */
+int ray_bvh_packet(struct raypacket *pk, struct bvh *bvh);
+
+/* wide tree traversal, called by ray_bvh/occluded_bvh when appropriate */
+int ray_bvh_wide(cgm_ray *ray, struct bvh *bvh, float tmax, struct rayhit *hit);
+int occluded_bvh_wide(cgm_ray *ray, struct bvh *bvh, float tmax);
 
 #endif	/* BVH_H_ */
@@ -0,0 +1,493 @@
+/* multi-branching (4/8-wide) BVH, collapsed from the binary flattened tree */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <assert.h>
+#include "bvh.h"
+#include "stats.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BVH_X86_SIMD
+#endif
+
+#define NODE_ALIGN		64
+#define STACK_SIZE		256
+
+#define WN_SIZE(w)		(32 * (w))
+#define WN_NODE(bvh, idx) \
+	((float*)((char*)(bvh)->wnodes + (size_t)(idx) * WN_SIZE((bvh)->width)))
+#define WN_BMIN(node, w, axis)	((node) + (axis) * (w))
+#define WN_BMAX(node, w, axis)	((node) + (3 + (axis)) * (w))
+#define WN_CHILD(node, w)		((int*)(node) + 6 * (w))
+#define WN_COUNT(node, w)		((int*)(node) + 7 * (w))
+
+/* ray data precomputed once for the whole traversal. near[i] selects which
+ * of the two slab planes is entered first along each axis: 0 for the min, 3
+ * for the max plane, as an offset in units of w floats from the start of the
+ * node.
+ */
+struct wray {
+	float org[3], idir[3];
+	int near[3];
+};
+
+struct wstack {
+	int idx, count;
+	float t;
+};
+
+struct collapse_state {
+	struct bvh *bvh;
+	int num_wnodes, max_wnodes;
+	int max_depth;
+};
+
+static int collapse(struct collapse_state *st, int binidx, int depth);
+static void init_wray(struct wray *wr, cgm_ray *ray);
+
+static int have_avx2 = -1;
+
+
+int bvh_auto_width(void)
+{
+#ifdef BVH_X86_SIMD
+	if(__builtin_cpu_supports("avx2")) {
+		return 8;
+	}
+#endif
+	return 4;
+}
+
+int build_wide_bvh(struct bvh *bvh, int width)
+{
+	size_t size;
+	struct collapse_state st;
+
+	if(width != 4 && width != 8) {
+		fprintf(stderr, "build_wide_bvh: invalid width: %d\n", width);
+		return -1;
+	}
+	if(!bvh->num_nodes) return 0;
+
+	if(have_avx2 == -1) {
+#ifdef BVH_X86_SIMD
+		have_avx2 = __builtin_cpu_supports("avx2");
+#else
+		have_avx2 = 0;
+#endif
+	}
+
+	free(bvh->wnodes);
+	bvh->wnodes = 0;
+	bvh->num_wnodes = 0;
+	bvh->width = width;
+
+	/* each wide node consumes at least one interior node of the binary tree,
+	 * plus one for the degenerate single-leaf tree
+	 */
+	st.bvh = bvh;
+	st.num_wnodes = 0;
+	st.max_wnodes = bvh->num_nodes / 2 + 1;
+	st.max_depth = 0;
+
+	size = ((size_t)st.max_wnodes * WN_SIZE(width) + NODE_ALIGN - 1) & ~(size_t)(NODE_ALIGN - 1);
+	if(!(bvh->wnodes = aligned_alloc(NODE_ALIGN, size))) {
+		fprintf(stderr, "build_wide_bvh: failed to allocate %d nodes\n", st.max_wnodes);
+		bvh->width = 2;
+		return -1;
+	}
+
+	collapse(&st, 0, 1);
+	bvh->num_wnodes = st.num_wnodes;
+	bvh->max_wdepth = st.max_depth;
+	return 0;
+}
+
+/* create a wide node out of the binary subtree starting at binidx, by
+ * repeatedly opening up the interior node with the largest surface area,
+ * until there are as many children as the width of the tree.
+ */
+static int collapse(struct collapse_state *st, int binidx, int depth)
+{
+	int i, j, n, best, idx, width;
+	int cand[8];
+	float area, best_area;
+	float *wn, *bmin, *bmax;
+	int *wchild, *wcount;
+	struct bvhflat *bn, *nodes = st->bvh->nodes;
+
+	width = st->bvh->width;
+	idx = st->num_wnodes++;
+	assert(idx < st->max_wnodes);
+	wn = WN_NODE(st->bvh, idx);
+
+	if(depth > st->max_depth) st->max_depth = depth;
+
+	if(nodes[binidx].count) {
+		/* the whole tree is a single leaf */
+		cand[0] = binidx;
+		n = 1;
+	} else {
+		cand[0] = binidx + 1;
+		cand[1] = nodes[binidx].offs;
+		n = 2;
+	}
+
+	while(n < width) {
+		best = -1;
+		best_area = -1.0f;
+		for(i=0; i<n; i++) {
+			bn = nodes + cand[i];
+			if(!bn->count && (area = aabox_surf_area(&bn->aabb)) > best_area) {
+				best_area = area;
+				best = i;
+			}
+		}
+		if(best == -1) break;
+
+		bn = nodes + cand[best];
+		cand[best] = cand[best] + 1;
+		cand[n++] = bn->offs;
+	}
+
+	wchild = WN_CHILD(wn, width);
+	wcount = WN_COUNT(wn, width);
+
+	for(i=0; i<width; i++) {
+		for(j=0; j<3; j++) {
+			bmin = WN_BMIN(wn, width, j);
+			bmax = WN_BMAX(wn, width, j);
+			if(i < n) {
+				bn = nodes + cand[i];
+				bmin[i] = cgm_velem(&bn->aabb.vmin, j);
+				bmax[i] = cgm_velem(&bn->aabb.vmax, j);
+			} else {
+				/* empty slots get an inverted box, which never passes the
+				 * slab test, since the near plane is always beyond the far one
+				 */
+				bmin[i] = FLT_MAX;
+				bmax[i] = -FLT_MAX;
+			}
+		}
+	}
+
+	for(i=0; i<n; i++) {
+		bn = nodes + cand[i];
+		if(bn->count) {
+			wchild[i] = bn->offs;
+			wcount[i] = bn->count;
+		} else {
+			wchild[i] = collapse(st, cand[i], depth + 1);
+			wcount[i] = 0;
+		}
+	}
+	for(i=n; i<width; i++) {
+		wchild[i] = 0;
+		wcount[i] = -1;
+	}
+	return idx;
+}
+
+static void init_wray(struct wray *wr, cgm_ray *ray)
+{
+	int i;
+	float d;
+
+	for(i=0; i<3; i++) {
+		wr->org[i] = cgm_velem(&ray->origin, i);
+		/* avoid infinities for axis-aligned rays, -ffast-math assumes there are
+		 * none, and they produce NaNs on slab planes through the origin
+		 */
+		d = cgm_velem(&ray->dir, i);
+		if(fabs(d) < 1e-12f) {
+			d = d < 0.0f ? -1e-12f : 1e-12f;
+		}
+		wr->idir[i] = 1.0f / d;
+		wr->near[i] = wr->idir[i] >= 0.0f ? 0 : 3;
+	}
+}
+
+/* ---- node intersection: returns a bitmask of the children hit ---- */
+
+static inline unsigned int isect_generic(const float *node, int width,
+		const struct wray *wr, float tmax, float *tnear)
+{
+	int i, j;
+	float t0, t1, tfar;
+	const float *pnear, *pfar;
+	unsigned int mask = 0;
+
+	for(i=0; i<width; i++) {
+		tnear[i] = 0.0f;
+		tfar = tmax;
+		for(j=0; j<3; j++) {
+			pnear = node + (wr->near[j] + j) * width;
+			pfar = node + (3 - wr->near[j] + j) * width;
+			t0 = (pnear[i] - wr->org[j]) * wr->idir[j];
+			t1 = (pfar[i] - wr->org[j]) * wr->idir[j];
+			if(t0 > tnear[i]) tnear[i] = t0;
+			if(t1 < tfar) tfar = t1;
+		}
+		if(tnear[i] <= tfar) {
+			mask |= 1 << i;
+		}
+	}
+	return mask;
+}
+
+#ifdef BVH_X86_SIMD
+static inline unsigned int isect_sse(const float *node, const struct wray *wr,
+		float tmax, float *tnear)
+{
+	int i;
+	__m128 tn = _mm_setzero_ps();
+	__m128 tf = _mm_set1_ps(tmax);
+	__m128 org, idir, pnear, pfar;
+
+	for(i=0; i<3; i++) {
+		org = _mm_set1_ps(wr->org[i]);
+		idir = _mm_set1_ps(wr->idir[i]);
+		pnear = _mm_load_ps(node + (wr->near[i] + i) * 4);
+		pfar = _mm_load_ps(node + (3 - wr->near[i] + i) * 4);
+		tn = _mm_max_ps(tn, _mm_mul_ps(_mm_sub_ps(pnear, org), idir));
+		tf = _mm_min_ps(tf, _mm_mul_ps(_mm_sub_ps(pfar, org), idir));
+	}
+	_mm_store_ps(tnear, tn);
+	return _mm_movemask_ps(_mm_cmple_ps(tn, tf));
+}
+
+__attribute__((target("avx2")))
+static inline unsigned int isect_avx(const float *node, const struct wray *wr,
+		float tmax, float *tnear)
+{
+	int i;
+	__m256 tn = _mm256_setzero_ps();
+	__m256 tf = _mm256_set1_ps(tmax);
+	__m256 org, idir, pnear, pfar;
+
+	for(i=0; i<3; i++) {
+		org = _mm256_set1_ps(wr->org[i]);
+		idir = _mm256_set1_ps(wr->idir[i]);
+		pnear = _mm256_load_ps(node + (wr->near[i] + i) * 8);
+		pfar = _mm256_load_ps(node + (3 - wr->near[i] + i) * 8);
+		tn = _mm256_max_ps(tn, _mm256_mul_ps(_mm256_sub_ps(pnear, org), idir));
+		tf = _mm256_min_ps(tf, _mm256_mul_ps(_mm256_sub_ps(pfar, org), idir));
+	}
+	_mm256_store_ps(tnear, tn);
+	return _mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ));
+}
+#endif	/* BVH_X86_SIMD */
+
+enum { ISECT_GENERIC, ISECT_SSE, ISECT_AVX };
+
+/* the traversal loops are written once, and instantiated below for each
+ * width and node intersection routine. Since width and simd are compile-time
+ * constants in each instance, the dispatch gets resolved statically.
+ */
+static inline __attribute__((always_inline)) unsigned int isect_node(const float *node,
+		int width, int simd, const struct wray *wr, float tmax, float *tnear)
+{
+#ifdef BVH_X86_SIMD
+	if(simd == ISECT_SSE) return isect_sse(node, wr, tmax, tnear);
+	if(simd == ISECT_AVX) return isect_avx(node, wr, tmax, tnear);
+#endif
+	return isect_generic(node, width, wr, tmax, tnear);
+}
+
+static inline __attribute__((always_inline)) int ray_wide(cgm_ray *ray,
+		struct bvh *bvh, float tmax, struct rayhit *hit, int width, int simd)
+{
+	int i, j, n, top, found = 0;
+	unsigned int mask;
+	float tnear[8] __attribute__((aligned(32)));
+	float *node;
+	int *child, *count;
+	struct wray wr;
+	struct wstack ent[8], tmp, cur;
+	struct wstack stackbuf[STACK_SIZE], *stack = stackbuf;
+	struct trihit th;
+
+	if(bvh->max_wdepth * (width - 1) + 1 > STACK_SIZE) {
+		stack = alloca((bvh->max_wdepth * (width - 1) + 1) * sizeof *stack);
+	}
+
+	init_wray(&wr, ray);
+
+	stack[0].idx = 0;
+	stack[0].count = 0;
+	stack[0].t = 0.0f;
+	top = 1;
+
+	while(top) {
+		cur = stack[--top];
+		if(cur.t > tmax) continue;	/* entered beyond the closest hit so far */
+		STAT_ADD(nodes, 1);
+
+		if(cur.count) {
+			STAT_ADD(leaves, 1);
+			STAT_ADD(tri_tests, cur.count);
+			if(ray_trigroups(ray, bvh->groups + cur.idx / TRI_GROUP, bvh->faces + cur.idx,
+						cur.count, tmax, &th)) {
+				tmax = th.t;
+				found = 1;
+			}
+			continue;
+		}
+
+		node = WN_NODE(bvh, cur.idx);
+		if(!(mask = isect_node(node, width, simd, &wr, tmax, tnear))) {
+			continue;
+		}
+		child = WN_CHILD(node, width);
+		count = WN_COUNT(node, width);
+
+		/* sort the children that were hit by descending entry distance, and push
+		 * them in that order, so that the nearest one is popped first
+		 */
+		n = 0;
+		while(mask) {
+			i = __builtin_ctz(mask);
+			mask &= mask - 1;
+
+			tmp.idx = child[i];
+			tmp.count = count[i];
+			tmp.t = tnear[i];
+			for(j=n++; j>0 && ent[j - 1].t < tmp.t; j--) {
+				ent[j] = ent[j - 1];
+			}
+			ent[j] = tmp;
+		}
+		for(i=0; i<n; i++) {
+			stack[top++] = ent[i];
+		}
+	}
+
+	if(found) {
+		tri_hit_attr(ray, &th, hit);
+	}
+	return found;
+}
+
+static inline __attribute__((always_inline)) int occluded_wide(cgm_ray *ray,
+		struct bvh *bvh, float tmax, int width, int simd)
+{
+	int i, top;
+	unsigned int mask;
+	float tnear[8] __attribute__((aligned(32)));
+	float *node;
+	int *child, *count;
+	struct wray wr;
+	struct wstack cur;
+	struct wstack stackbuf[STACK_SIZE], *stack = stackbuf;
+
+	if(bvh->max_wdepth * (width - 1) + 1 > STACK_SIZE) {
+		stack = alloca((bvh->max_wdepth * (width - 1) + 1) * sizeof *stack);
+	}
+
+	init_wray(&wr, ray);
+
+	stack[0].idx = 0;
+	stack[0].count = 0;
+	top = 1;
+
+	while(top) {
+		cur = stack[--top];
+		STAT_ADD(nodes, 1);
+
+		if(cur.count) {
+			STAT_ADD(leaves, 1);
+			STAT_ADD(tri_tests, cur.count);
+			if(ray_trigroups_any(ray, bvh->groups + cur.idx / TRI_GROUP, bvh->faces + cur.idx,
+						cur.count, tmax)) {
+				STAT_ADD(early_out, 1);
+				return 1;
+			}
+			continue;
+		}
+
+		node = WN_NODE(bvh, cur.idx);
+		mask = isect_node(node, width, simd, &wr, tmax, tnear);
+		child = WN_CHILD(node, width);
+		count = WN_COUNT(node, width);
+
+		/* no ordering, any hit will do */
+		while(mask) {
+			i = __builtin_ctz(mask);
+			mask &= mask - 1;
+			stack[top].idx = child[i];
+			stack[top].count = count[i];
+			top++;
+		}
+	}
+	return 0;
+}
+
+static int ray_bvh4(cgm_ray *ray, struct bvh *bvh, float tmax, struct rayhit *hit)
+{
+#ifdef BVH_X86_SIMD
+	return ray_wide(ray, bvh, tmax, hit, 4, ISECT_SSE);
+#else
+	return ray_wide(ray, bvh, tmax, hit, 4, ISECT_GENERIC);
+#endif
+}
+
+static int ray_bvh8(cgm_ray *ray, struct bvh *bvh, float tmax, struct rayhit *hit)
+{
+	return ray_wide(ray, bvh, tmax, hit, 8, ISECT_GENERIC);
+}
+
+static int occluded_bvh4(cgm_ray *ray, struct bvh *bvh, float tmax)
+{
+#ifdef BVH_X86_SIMD
+	return occluded_wide(ray, bvh, tmax, 4, ISECT_SSE);
+#else
+	return occluded_wide(ray, bvh, tmax, 4, ISECT_GENERIC);
+#endif
+}
+
+static int occluded_bvh8(cgm_ray *ray, struct bvh *bvh, float tmax)
+{
+	return occluded_wide(ray, bvh, tmax, 8, ISECT_GENERIC);
+}
+
+#ifdef BVH_X86_SIMD
+__attribute__((target("avx2")))
+static int ray_bvh8_avx(cgm_ray *ray, struct bvh *bvh, float tmax, struct rayhit *hit)
+{
+	return ray_wide(ray, bvh, tmax, hit, 8, ISECT_AVX);
+}
+
+__attribute__((target("avx2")))
+static int occluded_bvh8_avx(cgm_ray *ray, struct bvh *bvh, float tmax)
+{
+	return occluded_wide(ray, bvh, tmax, 8, ISECT_AVX);
+}
+#endif
+
+int ray_bvh_wide(cgm_ray *ray, struct bvh *bvh, float tmax, struct rayhit *hit)
+{
+	if(bvh->width == 4) {
+		return ray_bvh4(ray, bvh, tmax, hit);
+	}
+#ifdef BVH_X86_SIMD
+	if(have_avx2) {
+		return ray_bvh8_avx(ray, bvh, tmax, hit);
+	}
+#endif
+	return ray_bvh8(ray, bvh, tmax, hit);
+}
+
+int occluded_bvh_wide(cgm_ray *ray, struct bvh *bvh, float tmax)
+{
+	if(bvh->width == 4) {
+		return occluded_bvh4(ray, bvh, tmax);
+	}
+#ifdef BVH_X86_SIMD
+	if(have_avx2) {
+		return occluded_bvh8_avx(ray, bvh, tmax);
+	}
+#endif
+	return occluded_bvh8(ray, bvh, tmax);
+}
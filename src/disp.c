@@ -98,6 +98,50 @@ void display(void)
 	bind_program(0);
 }
 
+/* from blue for the fastest tiles, to red for the slowest one */
+void draw_heatmap(void)
+{
+	int i;
+	float t, x0, y0, x1, y1;
+	unsigned long max_dur = 0;
+	struct frametime ft;
+	struct tiletime *tt;
+
+	get_frame_times(&ft);
+	for(i=0; i<ft.num_tiles; i++) {
+		tt = ft.tiles + i;
+		if(tt->thread >= 0 && tt->end - tt->start > max_dur) {
+			max_dur = tt->end - tt->start;
+		}
+	}
+	if(!max_dur) return;
+
+	glDisable(GL_TEXTURE_2D);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	glBegin(GL_QUADS);
+	for(i=0; i<ft.num_tiles; i++) {
+		tt = ft.tiles + i;
+		if(tt->thread < 0) continue;
+
+		t = (float)(tt->end - tt->start) / (float)max_dur;
+		glColor4f(t, 0.0f, 1.0f - t, 0.4f);
+
+		x0 = 2.0f * tt->x / fb.width - 1.0f;
+		x1 = 2.0f * (tt->x + tt->width) / fb.width - 1.0f;
+		y0 = 1.0f - 2.0f * tt->y / fb.height;
+		y1 = 1.0f - 2.0f * (tt->y + tt->height) / fb.height;
+		glVertex2f(x0, y1);
+		glVertex2f(x1, y1);
+		glVertex2f(x1, y0);
+		glVertex2f(x0, y0);
+	}
+	glEnd();
+
+	glDisable(GL_BLEND);
+}
+
 static unsigned int nextpow2(unsigned int x)
 {
 	x--;
@@ -9,5 +9,7 @@ void cleanup_display(void);
 void resize_display(int x, int y);
 
 void display(void);
+/* tints the tiles by how long they took to render in the last frame */
+void draw_heatmap(void);
 
 #endif	/* DISP_H_ */
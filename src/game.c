@@ -1,16 +1,29 @@
+#include <string.h>
 #include "game.h"
 #include "optcfg.h"
 
-enum { OPT_SIZE, OPT_SCALE, OPT_NTHREADS, OPT_TILESZ, OPT_ITER, OPT_SAMPLES, OPT_GAMMA, OPT_HELP };
+enum { OPT_SIZE, OPT_SCALE, OPT_NTHREADS, OPT_TILESZ, OPT_PACKETSZ, OPT_WAVEFRONT, OPT_ITER,
+	OPT_SAMPLES, OPT_ADAPTIVE, OPT_GAMMA, OPT_BVH_WIDTH, OPT_BVH_BUILDER, OPT_SBVH_BUDGET,
+	OPT_CAMERA, OPT_BENCH, OPT_BENCH_OUT, OPT_TRACE, OPT_HELP };
 
 static struct optcfg_option options[] = {
 	{'s', "size", OPT_SIZE, "rendering resolution (WxH)"},
 	{0, "scale", OPT_SCALE, "output scale factor"},
 	{'t', "threads", OPT_NTHREADS, "number of worker threads to use for rendering (0 means auto-detect)"},
 	{'T', "tile", OPT_TILESZ, "render tile size"},
+	{0, "packet", OPT_PACKETSZ, "primary ray packet size, up to 8 (NxN rays, 1 disables packets)"},
+	{0, "wavefront", OPT_WAVEFRONT, "wavefront renderer: trace and shade paths in sorted batches"},
 	{0, "iter", OPT_ITER, "maximum recursion depth"},
 	{'S', "samples", OPT_SAMPLES, "number of samples per pixel"},
+	{0, "adaptive", OPT_ADAPTIVE, "relative error below which tiles stop taking samples (0 disables adaptive sampling)"},
 	{0, "gamma", OPT_GAMMA, "output gamma"},
+	{0, "bvh-width", OPT_BVH_WIDTH, "BVH branching factor: 2, 4, or 8 (0 means auto-detect)"},
+	{0, "bvh-builder", OPT_BVH_BUILDER, "static BVH builder: sah or sbvh (overrides level setting)"},
+	{0, "sbvh-budget", OPT_SBVH_BUDGET, "fraction of duplicate face references allowed by the SBVH builder"},
+	{0, "camera", OPT_CAMERA, "initial camera position and orientation in degrees (x,y,z[,theta,phi])"},
+	{0, "bench", OPT_BENCH, "render the given number of frames without a window, and report performance"},
+	{0, "bench-out", OPT_BENCH_OUT, "save the last benchmark frame to an image file"},
+	{0, "trace", OPT_TRACE, "record the tile timeline of every frame to a chrome trace file"},
 	{'h', "help", OPT_HELP, "print usage and exit"},
 	OPTCFG_OPTIONS_END
 };
@@ -27,9 +40,15 @@ int init_options(int argc, char **argv)
 	opt.scale = 1.0f;
 	opt.nthreads = 0;
 	opt.tilesz = 32;
+	opt.packetsz = 8;
 	opt.max_iter = 6;
 	opt.nsamples = 2;
+	opt.adapt_thresh = 0.02f;
 	opt.gamma = 2.2;
+	opt.bvh_width = 0;
+	opt.bvh_builder = -1;
+	opt.sbvh_budget = -1.0f;
+	cgm_vcons(&opt.cam_pos, 0.0f, 1.6f, 0.0f);
 
 	optcfg = optcfg_init(options);
 	optcfg_set_opt_callback(optcfg, opt_handler, argv[0]);
@@ -43,6 +62,13 @@ int init_options(int argc, char **argv)
 	return 0;
 }
 
+void destroy_options(void)
+{
+	free(opt.bench_out);
+	free(opt.trace_file);
+	opt.bench_out = opt.trace_file = 0;
+}
+
 static int opt_handler(struct optcfg *o, int optid, void *cls)
 {
 	char *val;
@@ -79,6 +105,21 @@ static int opt_handler(struct optcfg *o, int optid, void *cls)
 		}
 		break;
 
+	case OPT_PACKETSZ:
+		if(!(val = optcfg_next_value(o)) || optcfg_int_value(val, &opt.packetsz) == -1 ||
+				opt.packetsz <= 0 || opt.packetsz * opt.packetsz > PACKET_MAX_RAYS) {
+			fprintf(stderr, "packet: expected a packet size between 1 and 8\n");
+			return -1;
+		}
+		break;
+
+	case OPT_WAVEFRONT:
+		if(optcfg_enabled_value(o, &opt.wavefront) == -1) {
+			fprintf(stderr, "wavefront: expected a boolean value\n");
+			return -1;
+		}
+		break;
+
 	case OPT_ITER:
 		if(!(val = optcfg_next_value(o)) || optcfg_int_value(val, &opt.max_iter) == -1 ||
 				opt.max_iter <= 0) {
@@ -95,6 +136,14 @@ static int opt_handler(struct optcfg *o, int optid, void *cls)
 		}
 		break;
 
+	case OPT_ADAPTIVE:
+		if(!(val = optcfg_next_value(o)) || optcfg_float_value(val, &opt.adapt_thresh) == -1 ||
+				opt.adapt_thresh < 0.0f) {
+			fprintf(stderr, "adaptive: expected a relative error threshold, or 0 to disable\n");
+			return -1;
+		}
+		break;
+
 	case OPT_GAMMA:
 		if(!(val = optcfg_next_value(o)) || optcfg_float_value(val, &opt.gamma) == -1 ||
 				opt.gamma <= 0.0f) {
@@ -103,6 +152,67 @@ static int opt_handler(struct optcfg *o, int optid, void *cls)
 		}
 		break;
 
+	case OPT_BVH_WIDTH:
+		if(!(val = optcfg_next_value(o)) || optcfg_int_value(val, &opt.bvh_width) == -1 ||
+				(opt.bvh_width != 0 && opt.bvh_width != 2 && opt.bvh_width != 4 &&
+				 opt.bvh_width != 8)) {
+			fprintf(stderr, "bvh-width: expected 2, 4, 8, or 0 for auto-detect\n");
+			return -1;
+		}
+		break;
+
+	case OPT_BVH_BUILDER:
+		if(!(val = optcfg_next_value(o)) || (opt.bvh_builder = bvh_builder_id(val)) == -1) {
+			fprintf(stderr, "bvh-builder: expected sah or sbvh\n");
+			return -1;
+		}
+		break;
+
+	case OPT_SBVH_BUDGET:
+		if(!(val = optcfg_next_value(o)) || optcfg_float_value(val, &opt.sbvh_budget) == -1 ||
+				opt.sbvh_budget < 0.0f) {
+			fprintf(stderr, "sbvh-budget: expected a non-negative fraction of extra references\n");
+			return -1;
+		}
+		break;
+
+	case OPT_CAMERA:
+		opt.cam_theta = opt.cam_phi = 0.0f;
+		if(!(val = optcfg_next_value(o)) || sscanf(val, "%f,%f,%f,%f,%f", &opt.cam_pos.x,
+					&opt.cam_pos.y, &opt.cam_pos.z, &opt.cam_theta, &opt.cam_phi) < 3) {
+			fprintf(stderr, "camera: expected <x>,<y>,<z>[,<theta>,<phi>]\n");
+			return -1;
+		}
+		opt.cam_theta = cgm_deg_to_rad(opt.cam_theta);
+		opt.cam_phi = cgm_deg_to_rad(opt.cam_phi);
+		break;
+
+	case OPT_BENCH:
+		if(!(val = optcfg_next_value(o)) || optcfg_int_value(val, &opt.bench) == -1 ||
+				opt.bench <= 0) {
+			fprintf(stderr, "bench: expected the number of frames to render\n");
+			return -1;
+		}
+		break;
+
+	case OPT_BENCH_OUT:
+		if(!(val = optcfg_next_value(o))) {
+			fprintf(stderr, "bench-out: expected an image file name\n");
+			return -1;
+		}
+		free(opt.bench_out);
+		opt.bench_out = strdup(val);
+		break;
+
+	case OPT_TRACE:
+		if(!(val = optcfg_next_value(o))) {
+			fprintf(stderr, "trace: expected a file name\n");
+			return -1;
+		}
+		free(opt.trace_file);
+		opt.trace_file = strdup(val);
+		break;
+
 	case OPT_HELP:
 		printf("Usage: %s [options]\n", (char*)cls);
 		printf("Options:\n");
@@ -9,9 +9,22 @@ struct options {
 	float scale;
 	int nthreads;
 	int tilesz;
+	int packetsz;		/* primary ray packets of packetsz x packetsz, 1 disables */
+	int wavefront;		/* use render_wavefront instead of the tile renderer */
 	int max_iter;
 	int nsamples;
+	float adapt_thresh;	/* relative error of converged tiles, 0 disables */
 	float gamma;
+	int bvh_width;
+	int bvh_builder;	/* -1 means use the level setting */
+	float sbvh_budget;	/* negative means use the level setting */
+
+	cgm_vec3 cam_pos;
+	float cam_theta, cam_phi;
+
+	int bench;			/* frames to render headless, see bench.c, 0 opens a window */
+	char *bench_out;	/* image file for the last frame of the benchmark */
+	char *trace_file;	/* tile timeline, recorded from the start if set, see trace.h */
 
 	char *lvlfile;
 };
@@ -26,7 +39,10 @@ struct options opt;
 struct dtx_font *uifont;
 
 int init_options(int argc, char **argv);
+/* frees the option strings */
+void destroy_options(void);
 
 unsigned long get_msec(void);
+unsigned long get_usec(void);
 
 #endif	/* GAME_H_ */
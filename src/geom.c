@@ -1,56 +1,383 @@
+#include <string.h>
 #include <float.h>
 #include "geom.h"
 #include "rt.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define GEOM_X86_SIMD
+#endif
+
+#ifdef GEOM_X86_SIMD
+static int have_avx = -1;
+#endif
+
 int ray_triangle(cgm_ray *ray, struct triangle *tri, float tmax, struct rayhit *hit)
 {
-	float t, ndotdir, u, v;
-	cgm_vec3 vdir, bc, pos, mask_texel;
+	struct trihit th;
+
+	if(!hit) {
+		return ray_triangle_any(ray, tri, tmax);
+	}
+	if(!ray_triangle_uv(ray, tri, tmax, &th)) {
+		return 0;
+	}
+	tri_hit_attr(ray, &th, hit);
+	return 1;
+}
+
+/* alpha mask test at the barycentric coordinates of a hit */
+static int masked_out(struct triangle *tri, float u, float v)
+{
+	float w = 1.0f - u - v;
+	cgm_vec3 mask_texel;
+
+	tex_lookup(&mask_texel, tri->mtl->mask,
+			tri->v[0].tex.x * w + tri->v[1].tex.x * u + tri->v[2].tex.x * v,
+			tri->v[0].tex.y * w + tri->v[1].tex.y * u + tri->v[2].tex.y * v);
+	return mask_texel.x < 0.5f;
+}
+
+/* Moller-Trumbore test, with v0 and edges e1, e2. u and v are the weights of
+ * v[1] and v[2] respectively.
+ */
+#define MT_TEST(ray, v0, e1, e2, tmax, t, u, v)	\
+	do { \
+		cgm_vec3 pvec, tvec, qvec;	\
+		float det, inv_det;	\
+		cgm_vcross(&pvec, &(ray)->dir, e2);	\
+		det = cgm_vdot(e1, &pvec);	\
+		if(det > -1e-12f && det < 1e-12f) return 0;	\
+		inv_det = 1.0f / det;	\
+		tvec = (ray)->origin;	\
+		cgm_vsub(&tvec, v0);	\
+		u = cgm_vdot(&tvec, &pvec) * inv_det;	\
+		if(u < 0.0f || u > 1.0f) return 0;	\
+		cgm_vcross(&qvec, &tvec, e1);	\
+		v = cgm_vdot(&(ray)->dir, &qvec) * inv_det;	\
+		if(v < 0.0f || u + v > 1.0f) return 0;	\
+		t = cgm_vdot(e2, &qvec) * inv_det;	\
+		if(t <= 1e-6f || t > (tmax)) return 0;	\
+	} while(0)
+
+void tri_setup(struct triangle *tri)
+{
+	tri->e1 = tri->v[1].pos;
+	cgm_vsub(&tri->e1, &tri->v[0].pos);
+	tri->e2 = tri->v[2].pos;
+	cgm_vsub(&tri->e2, &tri->v[0].pos);
+}
+
+int ray_triangle_uv(cgm_ray *ray, struct triangle *tri, float tmax, struct trihit *th)
+{
+	float t, u, v;
+
+	MT_TEST(ray, &tri->v[0].pos, &tri->e1, &tri->e2, tmax, t, u, v);
 
-	if(fabs(ndotdir = cgm_vdot(&ray->dir, &tri->norm)) <= 1e-6) {
+	if(tri->mtl->mask && masked_out(tri, u, v)) {
 		return 0;
 	}
 
-	vdir = tri->v[0].pos;
-	cgm_vsub(&vdir, &ray->origin);
+	th->t = t;
+	th->u = u;
+	th->v = v;
+	th->tri = tri;
+	return 1;
+}
+
+void tri_hit_attr(cgm_ray *ray, struct trihit *th, struct rayhit *hit)
+{
+	float u = th->u, v = th->v, w = 1.0f - th->u - th->v;
+	struct triangle *tri = th->tri;
+
+	hit->t = th->t;
+	hit->ray = *ray;
+	hit->mtl = tri->mtl;
+	hit->tri = tri;
+	hit->inst = 0;
+
+	cgm_raypos(&hit->v.pos, ray, th->t);
+
+	hit->v.norm.x = tri->v[0].norm.x * w + tri->v[1].norm.x * u + tri->v[2].norm.x * v;
+	hit->v.norm.y = tri->v[0].norm.y * w + tri->v[1].norm.y * u + tri->v[2].norm.y * v;
+	hit->v.norm.z = tri->v[0].norm.z * w + tri->v[1].norm.z * u + tri->v[2].norm.z * v;
+	/* cgm_vnormalize(&hit->v.norm); */
+
+	hit->v.tex.x = tri->v[0].tex.x * w + tri->v[1].tex.x * u + tri->v[2].tex.x * v;
+	hit->v.tex.y = tri->v[0].tex.y * w + tri->v[1].tex.y * u + tri->v[2].tex.y * v;
+}
 
-	if((t = cgm_vdot(&tri->norm, &vdir) / ndotdir) <= 1e-6 || t > tmax) {
+/* any-hit version of ray_triangle, for occlusion queries. Texture coordinates
+ * are only interpolated if the material has an alpha mask.
+ */
+int ray_triangle_any(cgm_ray *ray, struct triangle *tri, float tmax)
+{
+	float t, u, v;
+
+	MT_TEST(ray, &tri->v[0].pos, &tri->e1, &tri->e2, tmax, t, u, v);
+
+	if(tri->mtl->mask && masked_out(tri, u, v)) {
 		return 0;
 	}
+	return 1;
+}
 
-	cgm_raypos(&pos, ray, t);
-	cgm_bary(&bc, &tri->v[0].pos, &tri->v[1].pos, &tri->v[2].pos, &pos);
+void trigroup_setup(struct trigroup *grp, struct triangle **faces, int count)
+{
+	int i, j;
+	struct triangle *tri;
 
-	if(bc.x < 0.0f || bc.x > 1.0f) return 0;
-	if(bc.y < 0.0f || bc.y > 1.0f) return 0;
-	if(bc.z < 0.0f || bc.z > 1.0f) return 0;
+#ifdef GEOM_X86_SIMD
+	if(have_avx == -1) {
+		have_avx = __builtin_cpu_supports("avx");
+	}
+#endif
 
-	if(hit) {
-		u = tri->v[0].tex.x * bc.x + tri->v[1].tex.x * bc.y + tri->v[2].tex.x * bc.z;
-		v = tri->v[0].tex.y * bc.x + tri->v[1].tex.y * bc.y + tri->v[2].tex.y * bc.z;
+	memset(grp, 0, sizeof *grp);
+	if(count > TRI_GROUP) count = TRI_GROUP;
 
+	for(i=0; i<count; i++) {
+		tri = faces[i];
+		for(j=0; j<3; j++) {
+			grp->v0[j][i] = cgm_velem(&tri->v[0].pos, j);
+			grp->e1[j][i] = cgm_velem(&tri->e1, j);
+			grp->e2[j][i] = cgm_velem(&tri->e2, j);
+		}
 		if(tri->mtl->mask) {
-			tex_lookup(&mask_texel, tri->mtl->mask, u, v);
-			if(mask_texel.x < 0.5f) {
-				return 0;
+			grp->masked |= 1 << i;
+		}
+	}
+}
+
+/* distance and barycentric coordinates of each lane of one or two groups */
+struct lanehits {
+	float t[2 * TRI_GROUP], u[2 * TRI_GROUP], v[2 * TRI_GROUP];
+} __attribute__((aligned(32)));
+
+#ifdef GEOM_X86_SIMD
+/* the same test as MT_TEST, on all lanes of a group at once. Returns the mask
+ * of lanes hit closer than tmax.
+ */
+static inline unsigned int isect_group_sse(cgm_ray *ray, struct trigroup *grp,
+		float tmax, struct lanehits *lh)
+{
+	__m128 dx, dy, dz, e1x, e1y, e1z, e2x, e2y, e2z;
+	__m128 px, py, pz, tx, ty, tz, qx, qy, qz;
+	__m128 det, inv_det, u, v, t, ok;
+
+	dx = _mm_set1_ps(ray->dir.x);
+	dy = _mm_set1_ps(ray->dir.y);
+	dz = _mm_set1_ps(ray->dir.z);
+	e1x = _mm_load_ps(grp->e1[0]);
+	e1y = _mm_load_ps(grp->e1[1]);
+	e1z = _mm_load_ps(grp->e1[2]);
+	e2x = _mm_load_ps(grp->e2[0]);
+	e2y = _mm_load_ps(grp->e2[1]);
+	e2z = _mm_load_ps(grp->e2[2]);
+
+	/* pvec = dir x e2 */
+	px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+	det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+	/* tvec = origin - v0, qvec = tvec x e1 */
+	tx = _mm_sub_ps(_mm_set1_ps(ray->origin.x), _mm_load_ps(grp->v0[0]));
+	ty = _mm_sub_ps(_mm_set1_ps(ray->origin.y), _mm_load_ps(grp->v0[1]));
+	tz = _mm_sub_ps(_mm_set1_ps(ray->origin.z), _mm_load_ps(grp->v0[2]));
+	qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+	qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+	qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+
+	u = _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz));
+	u = _mm_mul_ps(u, inv_det);
+	v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz));
+	v = _mm_mul_ps(v, inv_det);
+	t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz));
+	t = _mm_mul_ps(t, inv_det);
+
+	ok = _mm_cmpge_ps(_mm_andnot_ps(_mm_set1_ps(-0.0f), det), _mm_set1_ps(1e-12f));
+	ok = _mm_and_ps(ok, _mm_cmpge_ps(u, _mm_setzero_ps()));
+	ok = _mm_and_ps(ok, _mm_cmpge_ps(v, _mm_setzero_ps()));
+	ok = _mm_and_ps(ok, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+	ok = _mm_and_ps(ok, _mm_cmpgt_ps(t, _mm_set1_ps(1e-6f)));
+	ok = _mm_and_ps(ok, _mm_cmple_ps(t, _mm_set1_ps(tmax)));
+
+	_mm_store_ps(lh->t, t);
+	_mm_store_ps(lh->u, u);
+	_mm_store_ps(lh->v, v);
+	return _mm_movemask_ps(ok);
+}
+
+/* two consecutive groups as the low and high halves of 8-wide vectors */
+#define LOAD_PAIR(grp, field, axis)	\
+	_mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps((grp)[0].field[axis])), \
+			_mm_load_ps((grp)[1].field[axis]), 1)
+
+__attribute__((target("avx")))
+static inline unsigned int isect_group2_avx(cgm_ray *ray, struct trigroup *grp,
+		float tmax, struct lanehits *lh)
+{
+	__m256 dx, dy, dz, e1x, e1y, e1z, e2x, e2y, e2z;
+	__m256 px, py, pz, tx, ty, tz, qx, qy, qz;
+	__m256 det, inv_det, u, v, t, ok;
+
+	dx = _mm256_set1_ps(ray->dir.x);
+	dy = _mm256_set1_ps(ray->dir.y);
+	dz = _mm256_set1_ps(ray->dir.z);
+	e1x = LOAD_PAIR(grp, e1, 0);
+	e1y = LOAD_PAIR(grp, e1, 1);
+	e1z = LOAD_PAIR(grp, e1, 2);
+	e2x = LOAD_PAIR(grp, e2, 0);
+	e2y = LOAD_PAIR(grp, e2, 1);
+	e2z = LOAD_PAIR(grp, e2, 2);
+
+	px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+	py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+	pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+	det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)),
+			_mm256_mul_ps(e1z, pz));
+	inv_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+
+	tx = _mm256_sub_ps(_mm256_set1_ps(ray->origin.x), LOAD_PAIR(grp, v0, 0));
+	ty = _mm256_sub_ps(_mm256_set1_ps(ray->origin.y), LOAD_PAIR(grp, v0, 1));
+	tz = _mm256_sub_ps(_mm256_set1_ps(ray->origin.z), LOAD_PAIR(grp, v0, 2));
+	qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+	qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+	qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+
+	u = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)),
+			_mm256_mul_ps(tz, pz));
+	u = _mm256_mul_ps(u, inv_det);
+	v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)),
+			_mm256_mul_ps(dz, qz));
+	v = _mm256_mul_ps(v, inv_det);
+	t = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)),
+			_mm256_mul_ps(e2z, qz));
+	t = _mm256_mul_ps(t, inv_det);
+
+	ok = _mm256_cmp_ps(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), det), _mm256_set1_ps(1e-12f),
+			_CMP_GE_OQ);
+	ok = _mm256_and_ps(ok, _mm256_cmp_ps(u, _mm256_setzero_ps(), _CMP_GE_OQ));
+	ok = _mm256_and_ps(ok, _mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_GE_OQ));
+	ok = _mm256_and_ps(ok, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+	ok = _mm256_and_ps(ok, _mm256_cmp_ps(t, _mm256_set1_ps(1e-6f), _CMP_GT_OQ));
+	ok = _mm256_and_ps(ok, _mm256_cmp_ps(t, _mm256_set1_ps(tmax), _CMP_LE_OQ));
+
+	_mm256_store_ps(lh->t, t);
+	_mm256_store_ps(lh->u, u);
+	_mm256_store_ps(lh->v, v);
+	return _mm256_movemask_ps(ok);
+}
+#else	/* !GEOM_X86_SIMD */
+static int lane_test(cgm_ray *ray, struct trigroup *grp, int lane, float tmax,
+		struct lanehits *lh)
+{
+	float t, u, v;
+	cgm_vec3 v0, e1, e2;
+
+	cgm_vcons(&v0, grp->v0[0][lane], grp->v0[1][lane], grp->v0[2][lane]);
+	cgm_vcons(&e1, grp->e1[0][lane], grp->e1[1][lane], grp->e1[2][lane]);
+	cgm_vcons(&e2, grp->e2[0][lane], grp->e2[1][lane], grp->e2[2][lane]);
+	MT_TEST(ray, &v0, &e1, &e2, tmax, t, u, v);
+
+	lh->t[lane] = t;
+	lh->u[lane] = u;
+	lh->v[lane] = v;
+	return 1;
+}
+
+static unsigned int isect_group_generic(cgm_ray *ray, struct trigroup *grp,
+		float tmax, struct lanehits *lh)
+{
+	int i;
+	unsigned int mask = 0;
+
+	for(i=0; i<TRI_GROUP; i++) {
+		if(lane_test(ray, grp, i, tmax, lh)) {
+			mask |= 1 << i;
+		}
+	}
+	return mask;
+}
+#endif	/* GEOM_X86_SIMD */
+
+/* tests one group, or two with AVX if there are enough faces left, returning
+ * the mask of lanes hit. The alpha mask bits of the same lanes are returned in
+ * masked, and the number of lanes tested in n.
+ */
+static inline unsigned int isect_groups(cgm_ray *ray, struct trigroup *grp, int count,
+		float tmax, struct lanehits *lh, unsigned int *masked, int *n)
+{
+#ifdef GEOM_X86_SIMD
+	if(have_avx > 0 && count > TRI_GROUP) {
+		*masked = grp[0].masked | (grp[1].masked << TRI_GROUP);
+		*n = 2 * TRI_GROUP;
+		return isect_group2_avx(ray, grp, tmax, lh);
+	}
+	*masked = grp->masked;
+	*n = TRI_GROUP;
+	return isect_group_sse(ray, grp, tmax, lh);
+#else
+	*masked = grp->masked;
+	*n = TRI_GROUP;
+	return isect_group_generic(ray, grp, tmax, lh);
+#endif
+}
+
+int ray_trigroups(cgm_ray *ray, struct trigroup *grp, struct triangle **faces, int count,
+		float tmax, struct trihit *th)
+{
+	int i, j, n, found = 0;
+	unsigned int mask, masked;
+	struct lanehits lh;
+
+	for(i=0; i<count; i+=n) {
+		mask = isect_groups(ray, grp + i / TRI_GROUP, count - i, tmax, &lh, &masked, &n);
+
+		/* the closest of the lanes hit, which survives the alpha mask */
+		while(mask) {
+			j = __builtin_ctz(mask);
+			mask &= mask - 1;
+
+			if(lh.t[j] > tmax) continue;
+			if((masked & (1 << j)) && masked_out(faces[i + j], lh.u[j], lh.v[j])) {
+				continue;
 			}
+			tmax = th->t = lh.t[j];
+			th->u = lh.u[j];
+			th->v = lh.v[j];
+			th->tri = faces[i + j];
+			found = 1;
 		}
+	}
+	return found;
+}
 
-		hit->t = t;
-		hit->ray = *ray;
-		hit->mtl = tri->mtl;
+int ray_trigroups_any(cgm_ray *ray, struct trigroup *grp, struct triangle **faces, int count,
+		float tmax)
+{
+	int i, j, n;
+	unsigned int mask, masked;
+	struct lanehits lh;
 
-		hit->v.pos = pos;
+	for(i=0; i<count; i+=n) {
+		mask = isect_groups(ray, grp + i / TRI_GROUP, count - i, tmax, &lh, &masked, &n);
 
-		hit->v.norm.x = tri->v[0].norm.x * bc.x + tri->v[1].norm.x * bc.y + tri->v[2].norm.x * bc.z;
-		hit->v.norm.y = tri->v[0].norm.y * bc.x + tri->v[1].norm.y * bc.y + tri->v[2].norm.y * bc.z;
-		hit->v.norm.z = tri->v[0].norm.z * bc.x + tri->v[1].norm.z * bc.y + tri->v[2].norm.z * bc.z;
-		/* cgm_vnormalize(&hit->v.norm); */
+		/* no alpha masks, any lane will do */
+		if(mask & ~masked) return 1;
 
-		hit->v.tex.x = u;
-		hit->v.tex.y = v;
+		mask &= masked;
+		while(mask) {
+			j = __builtin_ctz(mask);
+			mask &= mask - 1;
+			if(!masked_out(faces[i + j], lh.u[j], lh.v[j])) {
+				return 1;
+			}
+		}
 	}
-	return 1;
+	return 0;
 }
 
 #define SLABCHECK(dim)	\
@@ -80,6 +407,24 @@ int ray_aabox_any(cgm_ray *ray, struct aabox *box, float tmax)
 	return 1;
 }
 
+void init_rayinv(struct rayinv *ri, cgm_ray *ray)
+{
+	int i;
+	float d;
+
+	ri->oct = 0;
+	for(i=0; i<3; i++) {
+		ri->org[i] = cgm_velem(&ray->origin, i);
+		/* avoid infinities for axis-aligned rays, see init_wray */
+		d = cgm_velem(&ray->dir, i);
+		if(fabs(d) < 1e-12f) {
+			d = d < 0.0f ? -1e-12f : 1e-12f;
+		}
+		ri->idir[i] = 1.0f / d;
+		if(d < 0.0f) ri->oct |= 1 << i;
+	}
+}
+
 void aabox_init(struct aabox *box)
 {
 	box->vmin.x = box->vmin.y = box->vmin.z = FLT_MAX;
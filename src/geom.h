@@ -13,23 +13,103 @@ struct vertex {
 struct triangle {
 	struct vertex v[3];
 	cgm_vec3 norm;
+	cgm_vec3 e1, e2;	/* edges from v[0], precomputed by tri_setup */
 	struct material *mtl;
 };
 
+/* number of triangles intersected at once by ray_trigroups */
+#define TRI_GROUP	4
+
+/* the part of up to TRI_GROUP triangles needed for intersection tests, in SoA
+ * form (160 bytes), copied from the first vertex and the tri_setup edges, and
+ * kept separately from the shading attributes in struct triangle, see struct
+ * bvh. Unused lanes are zeroed, which never hits.
+ */
+struct trigroup {
+	float v0[3][TRI_GROUP];	/* first vertex, and edges from it */
+	float e1[3][TRI_GROUP];
+	float e2[3][TRI_GROUP];
+	unsigned int masked;	/* one bit per lane: material has an alpha mask */
+} __attribute__((aligned(16)));
+
 struct aabox {
 	cgm_vec3 vmin, vmax;
 };
 
+struct instance;
+
 struct rayhit {
 	float t;
 	struct vertex v;
 	cgm_ray ray;
 	struct material *mtl;
+	struct triangle *tri;
+	struct instance *inst;	/* null unless the face belongs to an instance */
+};
+
+/* closest hit so far during traversal: just the distance and barycentric
+ * coordinates, with the rest of the hit attributes left for tri_hit_attr
+ */
+struct trihit {
+	float t, u, v;
+	struct triangle *tri;
+};
+
+/* ray prepared for repeated box tests during traversal, with the inverse
+ * direction computed once, and the direction octant: bit i set if the ray
+ * points towards -inf along axis i
+ */
+struct rayinv {
+	float org[3], idir[3];
+	int oct;
 };
 
+/* must be called whenever the vertex positions of a triangle change */
+void tri_setup(struct triangle *tri);
+
+/* fills a group from the first TRI_GROUP (or count if less) faces */
+void trigroup_setup(struct trigroup *grp, struct triangle **faces, int count);
+
 int ray_triangle(cgm_ray *ray, struct triangle *tri, float tmax, struct rayhit *hit);
+/* intersection test for traversal, fills th only for hits closer than tmax */
+int ray_triangle_uv(cgm_ray *ray, struct triangle *tri, float tmax, struct trihit *th);
+/* same as ray_triangle_uv for count consecutive faces, and their groups
+ * starting at grp, testing a whole group (or two with AVX) at a time. faces
+ * are only accessed for hits, to check alpha masks and to fill in th->tri.
+ */
+int ray_trigroups(cgm_ray *ray, struct trigroup *grp, struct triangle **faces, int count,
+		float tmax, struct trihit *th);
+int ray_trigroups_any(cgm_ray *ray, struct trigroup *grp, struct triangle **faces, int count,
+		float tmax);
+/* interpolated vertex attributes of the final closest hit */
+void tri_hit_attr(cgm_ray *ray, struct trihit *th, struct rayhit *hit);
+int ray_triangle_any(cgm_ray *ray, struct triangle *tri, float tmax);
 int ray_aabox_any(cgm_ray *ray, struct aabox *box, float tmax);
 
+void init_rayinv(struct rayinv *ri, cgm_ray *ray);
+
+/* box test for rays in octant oct, which should be a compile-time constant, so
+ * that the entry and exit plane along each axis is selected statically
+ */
+#define OCT_SLAB(i, dim) \
+	do { \
+		t0 = ((oct & (1 << i) ? box->vmax.dim : box->vmin.dim) - ri->org[i]) * ri->idir[i]; \
+		t1 = ((oct & (1 << i) ? box->vmin.dim : box->vmax.dim) - ri->org[i]) * ri->idir[i]; \
+		tmin = t0 > tmin ? t0 : tmin; \
+		tmax = t1 < tmax ? t1 : tmax; \
+	} while(0)
+
+static inline __attribute__((always_inline)) int ray_aabox_oct(const struct rayinv *ri,
+		const struct aabox *box, float tmax, int oct)
+{
+	float t0, t1, tmin = 0.0f;
+
+	OCT_SLAB(0, x);
+	OCT_SLAB(1, y);
+	OCT_SLAB(2, z);
+	return tmin <= tmax;
+}
+
 void aabox_init(struct aabox *box);
 void aabox_addface(struct aabox *box, struct triangle *tri);
 void aabox_union(struct aabox *res, struct aabox *a, struct aabox *b);
@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <assert.h>
+#include "instance.h"
+#include "stats.h"
+
+#define SPLIT_BUCKETS	16
+#define NODE_ALIGN		64
+#define BVH_STACK_SIZE	64
+
+struct bin {
+	struct aabox aabb;
+	int count;
+};
+
+static int build_rec(struct inst_bvh *ib, int first, int num, int depth, int *nidx);
+static int split_inst(struct instance *inst, int num, struct aabox *bbox, int *axis);
+
+int set_instance_xform(struct instance *inst, float *xform)
+{
+	int i;
+	cgm_vec3 v;
+	struct aabox *box = &inst->bvh->nodes[0].aabb;
+
+	memcpy(inst->xform, xform, sizeof inst->xform);
+	memcpy(inst->inv_xform, xform, sizeof inst->inv_xform);
+	if(cgm_minverse(inst->inv_xform) == -1) {
+		return -1;
+	}
+
+	/* world bounds of the transformed corners of the object bounds */
+	aabox_init(&inst->aabb);
+	for(i=0; i<8; i++) {
+		v.x = i & 1 ? box->vmax.x : box->vmin.x;
+		v.y = i & 2 ? box->vmax.y : box->vmin.y;
+		v.z = i & 4 ? box->vmax.z : box->vmin.z;
+		cgm_vmul_m4v3(&v, xform);
+		if(v.x < inst->aabb.vmin.x) inst->aabb.vmin.x = v.x;
+		if(v.x > inst->aabb.vmax.x) inst->aabb.vmax.x = v.x;
+		if(v.y < inst->aabb.vmin.y) inst->aabb.vmin.y = v.y;
+		if(v.y > inst->aabb.vmax.y) inst->aabb.vmax.y = v.y;
+		if(v.z < inst->aabb.vmin.z) inst->aabb.vmin.z = v.z;
+		if(v.z > inst->aabb.vmax.z) inst->aabb.vmax.z = v.z;
+	}
+	return 0;
+}
+
+int build_inst_bvh(struct inst_bvh *ib, struct instance *inst, int num_inst)
+{
+	int nidx = 0;
+	size_t size;
+
+	memset(ib, 0, sizeof *ib);
+	if(!num_inst) return 0;
+
+	if(!(ib->inst = malloc(num_inst * sizeof *ib->inst))) {
+		fprintf(stderr, "build_inst_bvh: failed to allocate %d instances\n", num_inst);
+		return -1;
+	}
+	memcpy(ib->inst, inst, num_inst * sizeof *ib->inst);
+	ib->num_inst = num_inst;
+
+	/* one instance per leaf */
+	ib->num_nodes = 2 * num_inst - 1;
+	size = (ib->num_nodes * sizeof *ib->nodes + NODE_ALIGN - 1) & ~(size_t)(NODE_ALIGN - 1);
+	if(!(ib->nodes = aligned_alloc(NODE_ALIGN, size))) {
+		fprintf(stderr, "build_inst_bvh: failed to allocate %d nodes\n", ib->num_nodes);
+		free(ib->inst);
+		ib->inst = 0;
+		return -1;
+	}
+
+	build_rec(ib, 0, num_inst, 1, &nidx);
+	assert(nidx == ib->num_nodes);
+	return 0;
+}
+
+void destroy_inst_bvh(struct inst_bvh *ib)
+{
+	if(!ib) return;
+	free(ib->nodes);
+	free(ib->inst);
+	ib->nodes = 0;
+	ib->inst = 0;
+	ib->num_nodes = ib->num_inst = 0;
+}
+
+static int build_rec(struct inst_bvh *ib, int first, int num, int depth, int *nidx)
+{
+	int i, nleft, dl, dr, axis;
+	struct bvhflat *node = ib->nodes + (*nidx)++;
+	struct bvhflat *left, *right;
+
+	if(depth > ib->max_depth) ib->max_depth = depth;
+
+	if(num == 1) {
+		node->aabb = ib->inst[first].aabb;
+		node->offs = first;
+		node->count = 1;
+		node->axis = 0;
+		node->big_right = 0;
+		return depth;
+	}
+
+	aabox_init(&node->aabb);
+	for(i=0; i<num; i++) {
+		aabox_union(&node->aabb, &node->aabb, &ib->inst[first + i].aabb);
+	}
+	nleft = split_inst(ib->inst + first, num, &node->aabb, &axis);
+
+	node->count = 0;
+	node->axis = axis;
+	left = node + 1;
+	dl = build_rec(ib, first, nleft, depth + 1, nidx);
+	node->offs = *nidx;
+	right = ib->nodes + node->offs;
+	dr = build_rec(ib, first + nleft, num - nleft, depth + 1, nidx);
+
+	node->big_right = aabox_surf_area(&right->aabb) > aabox_surf_area(&left->aabb);
+	return dl > dr ? dl : dr;
+}
+
+static inline float inst_centroid(struct instance *inst, int axis)
+{
+	return (cgm_velem(&inst->aabb.vmin, axis) + cgm_velem(&inst->aabb.vmax, axis)) * 0.5f;
+}
+
+/* binned SAH split of the instance centroids, partitioning the array in place
+ * and returning the number of instances on the low side of the split axis.
+ * Falls back to halving the array if all centroids coincide.
+ */
+static int split_inst(struct instance *inst, int num, struct aabox *bbox, int *axis)
+{
+	int i, j, b, best_axis, best_bucket, nleft, count;
+	float cost, best_cost, area, cmin, ext, scale, c;
+	float right_area[SPLIT_BUCKETS];
+	int right_count[SPLIT_BUCKETS];
+	struct bin bins[SPLIT_BUCKETS];
+	struct aabox cbox, box;
+	struct instance tmp;
+
+	aabox_init(&cbox);
+	for(i=0; i<num; i++) {
+		for(j=0; j<3; j++) {
+			c = inst_centroid(inst + i, j);
+			if(c < cgm_velem(&cbox.vmin, j)) cgm_velem(&cbox.vmin, j) = c;
+			if(c > cgm_velem(&cbox.vmax, j)) cgm_velem(&cbox.vmax, j) = c;
+		}
+	}
+
+	area = aabox_surf_area(bbox);
+	best_cost = FLT_MAX;
+	best_axis = -1;
+	best_bucket = 0;
+
+	for(j=0; j<3; j++) {
+		cmin = cgm_velem(&cbox.vmin, j);
+		if((ext = cgm_velem(&cbox.vmax, j) - cmin) <= 0.0f) continue;
+		scale = SPLIT_BUCKETS / ext;
+
+		for(b=0; b<SPLIT_BUCKETS; b++) {
+			aabox_init(&bins[b].aabb);
+			bins[b].count = 0;
+		}
+		for(i=0; i<num; i++) {
+			b = (int)((inst_centroid(inst + i, j) - cmin) * scale);
+			if(b >= SPLIT_BUCKETS) b = SPLIT_BUCKETS - 1;
+			aabox_union(&bins[b].aabb, &bins[b].aabb, &inst[i].aabb);
+			bins[b].count++;
+		}
+
+		aabox_init(&box);
+		count = 0;
+		for(b=SPLIT_BUCKETS-1; b>0; b--) {
+			aabox_union(&box, &box, &bins[b].aabb);
+			count += bins[b].count;
+			right_area[b] = aabox_surf_area(&box);
+			right_count[b] = count;
+		}
+
+		aabox_init(&box);
+		count = 0;
+		for(b=0; b<SPLIT_BUCKETS-1; b++) {
+			aabox_union(&box, &box, &bins[b].aabb);
+			count += bins[b].count;
+			if(!count || !right_count[b + 1]) continue;
+
+			cost = (aabox_surf_area(&box) * count + right_area[b + 1] * right_count[b + 1]) / area;
+			if(cost < best_cost) {
+				best_cost = cost;
+				best_axis = j;
+				best_bucket = b;
+			}
+		}
+	}
+
+	if(best_axis == -1) {
+		/* all centroids coincide, any split is as good as any other */
+		*axis = 0;
+		return num / 2;
+	}
+
+	cmin = cgm_velem(&cbox.vmin, best_axis);
+	scale = SPLIT_BUCKETS / (cgm_velem(&cbox.vmax, best_axis) - cmin);
+
+	i = 0;
+	j = num - 1;
+	while(i <= j) {
+		b = (int)((inst_centroid(inst + i, best_axis) - cmin) * scale);
+		if(b <= best_bucket) {
+			i++;
+		} else {
+			tmp = inst[i];
+			inst[i] = inst[j];
+			inst[j--] = tmp;
+		}
+	}
+	nleft = i;
+
+	/* can't happen as long as the partition buckets agree with the binning,
+	 * but never leave a side empty
+	 */
+	if(nleft == 0 || nleft == num) {
+		nleft = num / 2;
+	}
+	*axis = best_axis;
+	return nleft;
+}
+
+static inline void inst_hit(struct rayhit *hit, struct instance *inst, cgm_ray *ray)
+{
+	/* position by the forward transform, normal by the inverse transpose */
+	cgm_vmul_m4v3(&hit->v.pos, inst->xform);
+	cgm_vmul_v3m3(&hit->v.norm, inst->inv_xform);
+	cgm_vnormalize(&hit->v.norm);
+	hit->ray = *ray;
+	hit->inst = inst;
+}
+
+int ray_inst_bvh(cgm_ray *ray, struct inst_bvh *ib, float tmax, struct rayhit *hit)
+{
+	int top, idx, near, far, found = 0;
+	int stackbuf[BVH_STACK_SIZE], *stack = stackbuf;
+	struct bvhflat *node;
+	struct instance *inst;
+	cgm_ray oray;
+
+	if(!hit) {
+		return occluded_inst_bvh(ray, ib, tmax);
+	}
+	if(!ib->num_nodes) return 0;
+
+	if(ib->max_depth > BVH_STACK_SIZE) {
+		stack = alloca(ib->max_depth * sizeof *stack);
+	}
+
+	top = 0;
+	idx = 0;
+	for(;;) {
+		node = ib->nodes + idx;
+		STAT_ADD(nodes, 1);
+
+		if(ray_aabox_any(ray, &node->aabb, tmax)) {
+			if(!node->count) {
+				if(cgm_velem(&ray->dir, node->axis) < 0.0f) {
+					near = node->offs;
+					far = idx + 1;
+				} else {
+					near = idx + 1;
+					far = node->offs;
+				}
+				stack[top++] = far;
+				idx = near;
+				continue;
+			}
+
+			/* the object space direction is not normalized, so that distances
+			 * along the ray stay comparable between instances
+			 */
+			inst = ib->inst + node->offs;
+			oray = *ray;
+			cgm_rmul_mr(&oray, inst->inv_xform);
+			if(ray_bvh(&oray, inst->bvh, tmax, hit)) {
+				inst_hit(hit, inst, ray);
+				tmax = hit->t;
+				found = 1;
+			}
+		}
+
+		if(!top) break;
+		idx = stack[--top];
+	}
+	return found;
+}
+
+int occluded_inst_bvh(cgm_ray *ray, struct inst_bvh *ib, float tmax)
+{
+	int top, idx;
+	int stackbuf[BVH_STACK_SIZE], *stack = stackbuf;
+	struct bvhflat *node;
+	struct instance *inst;
+	cgm_ray oray;
+
+	if(!ib->num_nodes) return 0;
+
+	if(ib->max_depth > BVH_STACK_SIZE) {
+		stack = alloca(ib->max_depth * sizeof *stack);
+	}
+
+	top = 0;
+	idx = 0;
+	for(;;) {
+		node = ib->nodes + idx;
+		STAT_ADD(nodes, 1);
+
+		if(ray_aabox_any(ray, &node->aabb, tmax)) {
+			if(!node->count) {
+				if(node->big_right) {
+					stack[top++] = idx + 1;
+					idx = node->offs;
+				} else {
+					stack[top++] = node->offs;
+					idx++;
+				}
+				continue;
+			}
+
+			inst = ib->inst + node->offs;
+			oray = *ray;
+			cgm_rmul_mr(&oray, inst->inv_xform);
+			if(occluded_bvh(&oray, inst->bvh, tmax)) {
+				return 1;
+			}
+		}
+
+		if(!top) break;
+		idx = stack[--top];
+	}
+	return 0;
+}
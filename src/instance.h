@@ -0,0 +1,43 @@
+#ifndef INSTANCE_H_
+#define INSTANCE_H_
+
+#include "bvh.h"
+
+struct object;
+
+/* placement of a bottom-level tree in the world */
+struct instance {
+	struct bvh *bvh;	/* object space tree, may be shared by many instances */
+	struct object *obj;	/* the level object the tree belongs to */
+	float xform[16], inv_xform[16];
+	struct aabox aabb;	/* world space bounds */
+};
+
+/* top-level tree over instances. It uses the same node layout as struct bvh,
+ * with every leaf referencing a single instance, by its index in the instance
+ * array (offs).
+ */
+struct inst_bvh {
+	struct bvhflat *nodes;
+	int num_nodes, max_depth;
+
+	struct instance *inst;
+	int num_inst;
+};
+
+/* sets the transformation of an instance, and computes its world bounds.
+ * Returns -1 if the matrix is not invertible.
+ */
+int set_instance_xform(struct instance *inst, float *xform);
+
+/* builds the top-level tree over a copy of the instance array */
+int build_inst_bvh(struct inst_bvh *ib, struct instance *inst, int num_inst);
+void destroy_inst_bvh(struct inst_bvh *ib);
+
+/* rays are transformed into object space before descending into the tree of
+ * an instance, and hits are transformed back into world space
+ */
+int ray_inst_bvh(cgm_ray *ray, struct inst_bvh *ib, float tmax, struct rayhit *hit);
+int occluded_inst_bvh(cgm_ray *ray, struct inst_bvh *ib, float tmax);
+
+#endif	/* INSTANCE_H_ */
@@ -0,0 +1,605 @@
+/* linear BVH builder for dynamic geometry.
+ * Triangles are sorted by the morton code of their centroid with a parallel
+ * radix sort, and the hierarchy is emitted top-down by splitting each range
+ * of sorted codes at the highest differing bit. Optionally the resulting tree
+ * is improved by treelet restructuring, before being written out in the same
+ * depth-first layout used by flatten_bvh.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <float.h>
+#include <assert.h>
+#include "bvh.h"
+
+/* every leaf is a single group of faces */
+#define LEAF_MAX_FACES	TRI_GROUP
+#define NODE_ALIGN		64
+
+/* faces above which 63-bit codes are used instead of 30-bit ones */
+#define MORTON63_MIN_FACES	65536
+
+#define RADIX_BITS		8
+#define RADIX_SIZE		(1 << RADIX_BITS)
+
+/* work is split into at most MAX_CHUNKS chunks of at least CHUNK_FACES each */
+#define CHUNK_FACES		16384
+#define MAX_CHUNKS		64
+
+#define TREELET_LEAVES	7
+
+struct mkey {
+	uint64_t code;
+	struct triangle *tri;
+};
+
+/* intermediate index-linked node, rewritten into struct bvhflat at the end */
+struct tnode {
+	struct aabox aabb;
+	float cost;			/* SAH cost of the subtree, not normalized by area */
+	int left, right;	/* -1 for leaves */
+	int offs, count;
+};
+
+struct lbvh {
+	struct mkey *keys, *tmpkeys;
+	int num_keys;
+	int bits;
+
+	struct aabox cbox;
+	float qscale[3];
+
+	struct tnode *tnodes;
+	int num_tnodes;
+};
+
+struct chunk_job {
+	struct lbvh *lb;
+	int start, count;
+	struct aabox cbox;
+	int shift;
+	int hist[RADIX_SIZE];
+};
+
+/* a set of chunk jobs run by tpool_parallel_for */
+struct chunk_batch {
+	struct chunk_job *jobs;
+	tpool_callback func;
+};
+
+static int init_chunks(struct chunk_job *jobs, struct lbvh *lb);
+static void run_chunks(struct thread_pool *tpool, struct chunk_job *jobs, int njobs,
+		tpool_callback func);
+static void chunk_range(void *cls, int start, int end);
+static void cbox_task(void *cls);
+static void code_task(void *cls);
+static void hist_task(void *cls);
+static void scatter_task(void *cls);
+static void radix_sort(struct lbvh *lb, struct thread_pool *tpool,
+		struct chunk_job *jobs, int njobs);
+static int emit_rec(struct lbvh *lb, int first, int last);
+static void restructure_rec(struct lbvh *lb, int idx);
+static int layout_rec(struct bvh *bvh, struct lbvh *lb, int idx, int *nidx, int *gidx,
+		int depth);
+
+int build_bvh_lbvh(struct bvh *bvh, struct bvhnode *tree, struct thread_pool *tpool,
+		int restructure)
+{
+	int i, njobs, num, nidx, gidx;
+	float area;
+	size_t size;
+	struct lbvh lb;
+	struct chunk_job jobs[MAX_CHUNKS];
+
+	if(!(num = tree->num_faces)) {
+		bvh->num_nodes = bvh->num_faces = bvh->num_groups = 0;
+		return 0;
+	}
+
+	memset(&lb, 0, sizeof lb);
+	lb.num_keys = num;
+	lb.bits = num >= MORTON63_MIN_FACES ? 63 : 30;
+
+	/* the sort keys and the temporary nodes share a block, which is only
+	 * reallocated when the number of faces grows
+	 */
+	if(!bvh->lbvh_tmp || bvh->lbvh_max_faces < num) {
+		free(bvh->lbvh_tmp);
+		size = 2 * num * sizeof *lb.keys + (2 * num - 1) * sizeof *lb.tnodes;
+		if(!(bvh->lbvh_tmp = malloc(size))) {
+			fprintf(stderr, "build_bvh_lbvh: failed to allocate build buffers (%d faces)\n", num);
+			bvh->lbvh_max_faces = 0;
+			return -1;
+		}
+		bvh->lbvh_max_faces = num;
+	}
+	lb.keys = bvh->lbvh_tmp;
+	lb.tmpkeys = lb.keys + num;
+	lb.tnodes = (struct tnode*)(lb.keys + 2 * num);
+
+	/* the output arrays are kept around between rebuilds if they're big enough */
+	if(!bvh->nodes || bvh->max_nodes < 2 * num - 1) {
+		free(bvh->nodes);
+		bvh->max_nodes = 2 * num - 1;
+		size = (bvh->max_nodes * sizeof *bvh->nodes + NODE_ALIGN - 1) & ~(size_t)(NODE_ALIGN - 1);
+		if(!(bvh->nodes = aligned_alloc(NODE_ALIGN, size))) {
+			fprintf(stderr, "build_bvh_lbvh: failed to allocate %d nodes\n", bvh->max_nodes);
+			goto err;
+		}
+	}
+	/* the result is always a binary tree */
+	free(bvh->wnodes);
+	bvh->wnodes = 0;
+	bvh->num_wnodes = 0;
+	bvh->width = 2;
+
+	for(i=0; i<num; i++) {
+		lb.keys[i].tri = tree->faces[i];
+	}
+
+	/* centroid bounds, to quantize centroids for the morton codes */
+	njobs = init_chunks(jobs, &lb);
+	run_chunks(tpool, jobs, njobs, cbox_task);
+	aabox_init(&lb.cbox);
+	for(i=0; i<njobs; i++) {
+		aabox_union(&lb.cbox, &lb.cbox, &jobs[i].cbox);
+	}
+	for(i=0; i<3; i++) {
+		float ext = cgm_velem(&lb.cbox.vmax, i) - cgm_velem(&lb.cbox.vmin, i);
+		lb.qscale[i] = ext > 0.0f ? (float)(1 << (lb.bits / 3)) / ext : 0.0f;
+	}
+	run_chunks(tpool, jobs, njobs, code_task);
+
+	radix_sort(&lb, tpool, jobs, njobs);
+
+	emit_rec(&lb, 0, num - 1);
+	if(restructure) {
+		restructure_rec(&lb, 0);
+	}
+
+	/* one group per leaf, and there's one more leaf than interior nodes */
+	if(alloc_groups(bvh, (lb.num_tnodes + 1) / 2) == -1) {
+		goto err;
+	}
+
+	area = aabox_surf_area(&lb.tnodes[0].aabb);
+	bvh->sah_cost = area > 0.0f ? lb.tnodes[0].cost / area : 0.0f;
+
+	nidx = gidx = 0;
+	bvh->max_depth = layout_rec(bvh, &lb, 0, &nidx, &gidx, 1);
+	bvh->num_nodes = nidx;
+	assert(nidx == lb.num_tnodes && gidx == bvh->num_groups);
+	return 0;
+
+err:
+	destroy_bvh(bvh);
+	return -1;
+}
+
+static int init_chunks(struct chunk_job *jobs, struct lbvh *lb)
+{
+	int i, njobs, csize;
+
+	njobs = (lb->num_keys + CHUNK_FACES - 1) / CHUNK_FACES;
+	if(njobs > MAX_CHUNKS) njobs = MAX_CHUNKS;
+	csize = (lb->num_keys + njobs - 1) / njobs;
+
+	for(i=0; i<njobs; i++) {
+		jobs[i].lb = lb;
+		jobs[i].start = i * csize;
+		jobs[i].count = i < njobs - 1 ? csize : lb->num_keys - i * csize;
+	}
+	return njobs;
+}
+
+static void run_chunks(struct thread_pool *tpool, struct chunk_job *jobs, int njobs,
+		tpool_callback func)
+{
+	int i;
+	struct chunk_batch batch;
+
+	if(!tpool || njobs <= 1) {
+		for(i=0; i<njobs; i++) {
+			func(jobs + i);
+		}
+		return;
+	}
+
+	batch.jobs = jobs;
+	batch.func = func;
+	tpool_parallel_for(tpool, njobs, 1, chunk_range, &batch);
+}
+
+static void chunk_range(void *cls, int start, int end)
+{
+	struct chunk_batch *batch = cls;
+
+	for(; start<end; start++) {
+		batch->func(batch->jobs + start);
+	}
+}
+
+static inline void tri_centroid(cgm_vec3 *c, struct triangle *tri)
+{
+	c->x = (tri->v[0].pos.x + tri->v[1].pos.x + tri->v[2].pos.x) / 3.0f;
+	c->y = (tri->v[0].pos.y + tri->v[1].pos.y + tri->v[2].pos.y) / 3.0f;
+	c->z = (tri->v[0].pos.z + tri->v[1].pos.z + tri->v[2].pos.z) / 3.0f;
+}
+
+static void cbox_task(void *cls)
+{
+	int i;
+	cgm_vec3 c;
+	struct chunk_job *job = cls;
+	struct mkey *key = job->lb->keys + job->start;
+
+	aabox_init(&job->cbox);
+	for(i=0; i<job->count; i++) {
+		tri_centroid(&c, key++->tri);
+		if(c.x < job->cbox.vmin.x) job->cbox.vmin.x = c.x;
+		if(c.x > job->cbox.vmax.x) job->cbox.vmax.x = c.x;
+		if(c.y < job->cbox.vmin.y) job->cbox.vmin.y = c.y;
+		if(c.y > job->cbox.vmax.y) job->cbox.vmax.y = c.y;
+		if(c.z < job->cbox.vmin.z) job->cbox.vmin.z = c.z;
+		if(c.z > job->cbox.vmax.z) job->cbox.vmax.z = c.z;
+	}
+}
+
+/* insert 2 zero bits between each of the low 10 bits of x */
+static inline uint64_t expand10(uint64_t x)
+{
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x30000ff;
+	x = (x | (x << 8)) & 0x300f00f;
+	x = (x | (x << 4)) & 0x30c30c3;
+	x = (x | (x << 2)) & 0x9249249;
+	return x;
+}
+
+/* insert 2 zero bits between each of the low 21 bits of x */
+static inline uint64_t expand21(uint64_t x)
+{
+	x &= 0x1fffff;
+	x = (x | (x << 32)) & 0x1f00000000ffffULL;
+	x = (x | (x << 16)) & 0x1f0000ff0000ffULL;
+	x = (x | (x << 8)) & 0x100f00f00f00f00fULL;
+	x = (x | (x << 4)) & 0x10c30c30c30c30c3ULL;
+	x = (x | (x << 2)) & 0x1249249249249249ULL;
+	return x;
+}
+
+static inline unsigned int quantize(float c, float cmin, float scale, unsigned int maxval)
+{
+	float q = (c - cmin) * scale;
+	if(q <= 0.0f) return 0;
+	return q >= (float)maxval ? maxval : (unsigned int)q;
+}
+
+static void code_task(void *cls)
+{
+	int i;
+	cgm_vec3 c;
+	unsigned int qx, qy, qz, qmax;
+	struct chunk_job *job = cls;
+	struct lbvh *lb = job->lb;
+	struct mkey *key = lb->keys + job->start;
+
+	qmax = (1 << (lb->bits / 3)) - 1;
+
+	for(i=0; i<job->count; i++) {
+		tri_centroid(&c, key->tri);
+		qx = quantize(c.x, lb->cbox.vmin.x, lb->qscale[0], qmax);
+		qy = quantize(c.y, lb->cbox.vmin.y, lb->qscale[1], qmax);
+		qz = quantize(c.z, lb->cbox.vmin.z, lb->qscale[2], qmax);
+		if(lb->bits == 30) {
+			key->code = (expand10(qx) << 2) | (expand10(qy) << 1) | expand10(qz);
+		} else {
+			key->code = (expand21(qx) << 2) | (expand21(qy) << 1) | expand21(qz);
+		}
+		key++;
+	}
+}
+
+static void hist_task(void *cls)
+{
+	int i;
+	struct chunk_job *job = cls;
+	struct mkey *key = job->lb->keys + job->start;
+
+	memset(job->hist, 0, sizeof job->hist);
+	for(i=0; i<job->count; i++) {
+		job->hist[(key++->code >> job->shift) & (RADIX_SIZE - 1)]++;
+	}
+}
+
+/* hist holds the output offset of each digit for this chunk at this point */
+static void scatter_task(void *cls)
+{
+	int i;
+	struct chunk_job *job = cls;
+	struct mkey *src = job->lb->keys + job->start;
+	struct mkey *dst = job->lb->tmpkeys;
+
+	for(i=0; i<job->count; i++) {
+		dst[job->hist[(src->code >> job->shift) & (RADIX_SIZE - 1)]++] = *src;
+		src++;
+	}
+}
+
+/* LSD radix sort, 8 bits per pass. Every pass histograms each chunk in
+ * parallel, and then scatters the chunks in parallel to disjoint output
+ * ranges, which keeps the sort stable.
+ */
+static void radix_sort(struct lbvh *lb, struct thread_pool *tpool,
+		struct chunk_job *jobs, int njobs)
+{
+	int i, j, shift, sum, count;
+	struct mkey *tmp;
+
+	for(shift=0; shift<lb->bits; shift+=RADIX_BITS) {
+		for(i=0; i<njobs; i++) {
+			jobs[i].shift = shift;
+		}
+		run_chunks(tpool, jobs, njobs, hist_task);
+
+		/* skip the pass if every key has the same digit */
+		for(i=0; i<RADIX_SIZE; i++) {
+			count = 0;
+			for(j=0; j<njobs; j++) {
+				count += jobs[j].hist[i];
+			}
+			if(count) break;
+		}
+		if(count == lb->num_keys) continue;
+
+		sum = 0;
+		for(i=0; i<RADIX_SIZE; i++) {
+			for(j=0; j<njobs; j++) {
+				count = jobs[j].hist[i];
+				jobs[j].hist[i] = sum;
+				sum += count;
+			}
+		}
+		run_chunks(tpool, jobs, njobs, scatter_task);
+
+		tmp = lb->keys;
+		lb->keys = lb->tmpkeys;
+		lb->tmpkeys = tmp;
+	}
+}
+
+/* index of the last key of the left half of a range, which is the last key
+ * with the highest differing bit of the range cleared
+ */
+static int find_split(struct mkey *keys, int first, int last)
+{
+	int step, split, prefix;
+	uint64_t fcode = keys[first].code;
+	uint64_t lcode = keys[last].code;
+
+	if(fcode == lcode) {
+		return (first + last) >> 1;	/* identical codes, split in the middle */
+	}
+	prefix = __builtin_clzll(fcode ^ lcode);
+
+	/* binary search for the last key sharing more than prefix bits with first */
+	split = first;
+	step = last - first;
+	do {
+		step = (step + 1) >> 1;
+		if(split + step < last && __builtin_clzll(fcode ^ keys[split + step].code) > prefix) {
+			split += step;
+		}
+	} while(step > 1);
+	return split;
+}
+
+static int emit_rec(struct lbvh *lb, int first, int last)
+{
+	int i, split, idx = lb->num_tnodes++;
+	struct tnode *node = lb->tnodes + idx;
+	struct tnode *left, *right;
+
+	if(last - first + 1 <= LEAF_MAX_FACES) {
+		node->left = node->right = -1;
+		node->offs = first;
+		node->count = last - first + 1;
+		aabox_init(&node->aabb);
+		for(i=first; i<=last; i++) {
+			aabox_addface(&node->aabb, lb->keys[i].tri);
+		}
+		node->cost = aabox_surf_area(&node->aabb) * COST_LEAF(node->count);
+		return idx;
+	}
+
+	split = find_split(lb->keys, first, last);
+	node->count = 0;
+	node->left = emit_rec(lb, first, split);
+	node->right = emit_rec(lb, split + 1, last);
+
+	left = lb->tnodes + node->left;
+	right = lb->tnodes + node->right;
+	aabox_union(&node->aabb, &left->aabb, &right->aabb);
+	node->cost = COST_TRAV * aabox_surf_area(&node->aabb) + left->cost + right->cost;
+	return idx;
+}
+
+static int rebuild_treelet(struct tnode *tnodes, int set, int *part, int *leaves,
+		int *inner, int *next_inner)
+{
+	int idx;
+	struct tnode *node, *left, *right;
+
+	if(!(set & (set - 1))) {
+		return leaves[__builtin_ctz(set)];
+	}
+
+	idx = inner[(*next_inner)++];
+	node = tnodes + idx;
+	node->left = rebuild_treelet(tnodes, part[set], part, leaves, inner, next_inner);
+	node->right = rebuild_treelet(tnodes, set ^ part[set], part, leaves, inner, next_inner);
+
+	left = tnodes + node->left;
+	right = tnodes + node->right;
+	aabox_union(&node->aabb, &left->aabb, &right->aabb);
+	node->cost = COST_TRAV * aabox_surf_area(&node->aabb) + left->cost + right->cost;
+	return idx;
+}
+
+/* find the optimal topology for the treelet of up to TREELET_LEAVES subtrees
+ * under idx, by exhaustive search over all subsets of its leaves, and reuse
+ * the treelet's interior nodes to rebuild it if it's an improvement.
+ */
+static void optimize_treelet(struct lbvh *lb, int idx)
+{
+	int i, n, s, p, low, best_part, nleaves, ninner, next_inner, full;
+	int leaves[TREELET_LEAVES], inner[TREELET_LEAVES - 1];
+	int part[1 << TREELET_LEAVES];
+	float cost[1 << TREELET_LEAVES];
+	float area, best_area, best_cost, c;
+	struct aabox box;
+	struct tnode *tnodes = lb->tnodes;
+
+	inner[0] = idx;
+	ninner = 1;
+	leaves[0] = tnodes[idx].left;
+	leaves[1] = tnodes[idx].right;
+	nleaves = 2;
+
+	/* grow the treelet by opening the interior leaf with the largest area */
+	while(nleaves < TREELET_LEAVES) {
+		n = -1;
+		best_area = -1.0f;
+		for(i=0; i<nleaves; i++) {
+			if(tnodes[leaves[i]].left == -1) continue;
+			if((area = aabox_surf_area(&tnodes[leaves[i]].aabb)) > best_area) {
+				best_area = area;
+				n = i;
+			}
+		}
+		if(n == -1) break;
+
+		inner[ninner++] = leaves[n];
+		leaves[nleaves++] = tnodes[leaves[n]].right;
+		leaves[n] = tnodes[leaves[n]].left;
+	}
+	if(nleaves < 3) return;	/* only one possible topology */
+
+	full = (1 << nleaves) - 1;
+	for(s=1; s<=full; s++) {
+		if(!(s & (s - 1))) {
+			cost[s] = tnodes[leaves[__builtin_ctz(s)]].cost;
+			continue;
+		}
+
+		aabox_init(&box);
+		for(i=0; i<nleaves; i++) {
+			if(s & (1 << i)) {
+				aabox_union(&box, &box, &tnodes[leaves[i]].aabb);
+			}
+		}
+
+		/* every partition of s, once, by keeping the lowest bit on the left */
+		low = s & -s;
+		best_cost = FLT_MAX;
+		best_part = low;
+		for(p=(s - 1) & s; p; p=(p - 1) & s) {
+			if(!(p & low)) continue;
+			if((c = cost[p] + cost[s ^ p]) < best_cost) {
+				best_cost = c;
+				best_part = p;
+			}
+		}
+		cost[s] = COST_TRAV * aabox_surf_area(&box) + best_cost;
+		part[s] = best_part;
+	}
+
+	if(cost[full] >= tnodes[idx].cost * 0.999f) {
+		return;
+	}
+	next_inner = 0;
+	rebuild_treelet(tnodes, full, part, leaves, inner, &next_inner);
+	assert(next_inner == ninner);
+}
+
+/* treelets are optimized bottom-up, so that each one sees improved subtrees.
+ * the node's cost is refreshed from its children first, since they may have
+ * been restructured below it.
+ */
+static void restructure_rec(struct lbvh *lb, int idx)
+{
+	struct tnode *left, *right;
+	struct tnode *node = lb->tnodes + idx;
+
+	if(node->left == -1) return;
+
+	restructure_rec(lb, node->left);
+	restructure_rec(lb, node->right);
+
+	left = lb->tnodes + node->left;
+	right = lb->tnodes + node->right;
+	node->cost = COST_TRAV * aabox_surf_area(&node->aabb) + left->cost + right->cost;
+	optimize_treelet(lb, idx);
+}
+
+static int layout_rec(struct bvh *bvh, struct lbvh *lb, int idx, int *nidx, int *gidx,
+		int depth)
+{
+	int i, axis, tmp, dl, dr;
+	float d, maxd;
+	cgm_vec3 cl, cr;
+	struct tnode *tn = lb->tnodes + idx;
+	struct tnode *left, *right;
+	struct bvhflat *node = bvh->nodes + (*nidx)++;
+
+	node->aabb = tn->aabb;
+
+	if(tn->left == -1) {
+		node->offs = (*gidx)++ * TRI_GROUP;
+		node->count = tn->count;
+		for(i=0; i<tn->count; i++) {
+			bvh->faces[node->offs + i] = lb->keys[tn->offs + i].tri;
+		}
+		setup_leaf_groups(bvh, node->offs, tn->count);
+		node->axis = 0;
+		node->big_right = 0;
+		return depth;
+	}
+
+	/* there's no split axis as such; pick the one separating the children
+	 * the most, and put the child with the lower center first, which is what
+	 * ray_bvh assumes for its near-first ordering
+	 */
+	left = lb->tnodes + tn->left;
+	right = lb->tnodes + tn->right;
+	cgm_vcons(&cl, left->aabb.vmin.x + left->aabb.vmax.x, left->aabb.vmin.y + left->aabb.vmax.y,
+			left->aabb.vmin.z + left->aabb.vmax.z);
+	cgm_vcons(&cr, right->aabb.vmin.x + right->aabb.vmax.x, right->aabb.vmin.y + right->aabb.vmax.y,
+			right->aabb.vmin.z + right->aabb.vmax.z);
+	axis = 0;
+	maxd = -1.0f;
+	for(i=0; i<3; i++) {
+		d = cgm_velem(&cr, i) - cgm_velem(&cl, i);
+		if(d < 0.0f) d = -d;
+		if(d > maxd) {
+			maxd = d;
+			axis = i;
+		}
+	}
+	if(cgm_velem(&cl, axis) > cgm_velem(&cr, axis)) {
+		tmp = tn->left;
+		tn->left = tn->right;
+		tn->right = tmp;
+		left = lb->tnodes + tn->left;
+		right = lb->tnodes + tn->right;
+	}
+
+	node->count = 0;
+	node->axis = axis;
+	node->big_right = aabox_surf_area(&right->aabb) > aabox_surf_area(&left->aabb);
+	dl = layout_rec(bvh, lb, tn->left, nidx, gidx, depth + 1);
+	node->offs = *nidx;
+	dr = layout_rec(bvh, lb, tn->right, nidx, gidx, depth + 1);
+	return dl > dr ? dl : dr;
+}
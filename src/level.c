@@ -6,7 +6,25 @@
 #include "treestore.h"
 #include "mesh.h"
 
+/* the dynamic tree is refitted as objects move, and rebuilt once its SAH
+ * cost has grown by this factor. Can be set by level.bvh.refit_limit, with 0
+ * meaning rebuild every time.
+ */
+#define DEF_REFIT_LIMIT		1.3f
+
+static int load_scene(struct level *lvl, struct ts_node *node, const char *path,
+		struct bvhnode *tree, int dynamic);
+static int add_instance(struct level *lvl, struct ts_node *node, const char *path,
+		float *xform, int builder, float budget);
+static int build_static(struct bvh *bvh, struct bvhnode *tree, int builder, float budget);
+static int scene_xform(struct ts_node *node, float *xform);
 static int add_mesh_faces(struct bvhnode *bnode, struct mesh *mesh);
+static int add_dynobj(struct level *lvl, struct mesh *mesh, struct ts_node *snode,
+		cgm_vec3 *pivot);
+static void scene_center(struct scenefile *scn, cgm_vec3 *res);
+static int collect_emitters(struct bvhnode *tree, struct triangle ***res);
+static int add_light(struct level *lvl, struct triangle *tri, struct instance *inst);
+static int build_lights(struct level *lvl);
 static void proc_edits(struct ts_node *snode, struct scenefile *scn);
 static int edit_mtl(struct ts_node *node, const char *mtlname, const char *mtlprop, struct scenefile *scn);
 
@@ -15,10 +33,14 @@ int load_level(struct level *lvl, const char *fname)
 	char *dirname, *ptr;
 	char path[256];
 	struct ts_node *root, *node;
-	struct scenefile scn;
-	struct mesh *mesh, *tail;
 	unsigned long start_time;
 	float *vec;
+	int i, builder, dynamic;
+	float budget;
+	float xform[16];
+	struct mesh *mesh;
+	struct bvhnode *tree;
+	const char *str;
 
 	memset(lvl, 0, sizeof *lvl);
 	if(!(lvl->st_root = calloc(1, sizeof *lvl->st_root)) ||
@@ -57,6 +79,20 @@ int load_level(struct level *lvl, const char *fname)
 		lvl->bgcolor.z = vec[2];
 	}
 
+	/* BVH construction settings, can be overriden from the command line */
+	builder = BVH_BUILD_SAH;
+	if((str = ts_lookup_str(root, "level.bvh.builder", 0))) {
+		if((builder = bvh_builder_id(str)) == -1) {
+			fprintf(stderr, "load_level: unknown BVH builder: %s, using sah\n", str);
+			builder = BVH_BUILD_SAH;
+		}
+	}
+	budget = ts_lookup_num(root, "level.bvh.dup_budget", SBVH_DEF_BUDGET);
+	if(opt.bvh_builder >= 0) builder = opt.bvh_builder;
+	if(opt.sbvh_budget >= 0.0f) budget = opt.sbvh_budget;
+	lvl->dyn_treelets = ts_lookup_int(root, "level.bvh.treelets", 0);
+	lvl->dyn_refit_limit = ts_lookup_num(root, "level.bvh.refit_limit", DEF_REFIT_LIMIT);
+
 	/* load scene files */
 	node = root->child_list;
 	while(node) {
@@ -66,48 +102,128 @@ int load_level(struct level *lvl, const char *fname)
 				goto cont;
 			}
 			snprintf(path, sizeof path, "%s%s", dirname, fname);
-			printf("loading scene file: %s\n", path);
 
-			if(load_scenefile(&scn, path) == -1) {
+			/* scenes placed with a transformation become instances of a
+			 * separate tree, shared by all instances of the same file
+			 */
+			dynamic = ts_get_attr_int(node, "dynamic", 0);
+			if(!dynamic && scene_xform(node, xform)) {
+				add_instance(lvl, node, path, xform, builder, budget);
 				goto cont;
 			}
 
-			/* perform any edits on the loaded scene */
-			proc_edits(node, &scn);
-
-			mesh = tail = scn.meshlist;
-			while(mesh) {
-				add_mesh_faces(lvl->st_root, mesh);
-				tail = mesh;
-				mesh = mesh->next;
-			}
-
-			if(tail) {
-				tail->next = lvl->meshlist;
-				lvl->meshlist = scn.meshlist;
-				scn.meshlist = 0;
-			}
-			destroy_scenefile(&scn);
+			printf("loading scene file: %s\n", path);
+			load_scene(lvl, node, path, dynamic ? lvl->dyn_root : lvl->st_root, dynamic);
 		}
 cont:	node = node->next;
 	}
 	ts_free_tree(root);
 
-	printf("Building static BVH tree\n");
-	start_time = get_msec();
-	if(build_bvh_sah(lvl->st_root) == -1) {
+	/* every mesh has its own material */
+	lvl->num_mtl = 0;
+	for(mesh=lvl->meshlist; mesh; mesh=mesh->next) {
+		mesh->mtl.id = lvl->num_mtl++;
+	}
+
+	/* emissive faces in world space become lights, before the static tree
+	 * takes over the faces array
+	 */
+	for(i=0; i<lvl->st_root->num_faces; i++) {
+		if(is_emissive(lvl->st_root->faces[i]->mtl)) {
+			add_light(lvl, lvl->st_root->faces[i], 0);
+		}
+	}
+	for(i=0; i<lvl->dyn_root->num_faces; i++) {
+		if(is_emissive(lvl->dyn_root->faces[i]->mtl)) {
+			add_light(lvl, lvl->dyn_root->faces[i], 0);
+			lvl->dyn_lights = 1;
+		}
+	}
+
+	if(lvl->st_root->num_faces) {
+		start_time = get_msec();
+		if(builder == BVH_BUILD_SBVH) {
+			printf("Building static BVH tree (SBVH, duplication budget: %g)\n", budget);
+		} else {
+			printf("Building static BVH tree\n");
+		}
+		/* build_static frees the source tree, even if it fails */
+		tree = lvl->st_root;
+		lvl->st_root = 0;
+		if(build_static(&lvl->st_bvh, tree, builder, budget) == -1) {
+			return -1;
+		}
+		lvl->build_msec += get_msec() - start_time;
+		printf("BVH construction took: %lu msec (%d nodes, %d-wide: %d nodes)\n",
+				get_msec() - start_time, lvl->st_bvh.num_nodes, lvl->st_bvh.width,
+				lvl->st_bvh.num_wnodes);
+	} else {
+		free_bvh_tree(lvl->st_root);
+	}
+	lvl->st_root = 0;
+
+	if(lvl->num_inst) {
+		if(build_inst_bvh(&lvl->inst_bvh, lvl->inst, lvl->num_inst) == -1) {
+			return -1;
+		}
+		printf("instances: %d (depth: %d)\n", lvl->num_inst, lvl->inst_bvh.max_depth);
+		/* the top-level tree keeps its own reordered copy */
+		free(lvl->inst);
+		lvl->inst = 0;
+		lvl->num_inst = lvl->max_inst = 0;
+	}
+
+	/* dyn_root is kept around, as the source of faces for every rebuild */
+	if(lvl->dyn_root->num_faces) {
+		start_time = get_msec();
+		if(build_bvh_lbvh(&lvl->dyn_bvh, lvl->dyn_root, tpool, lvl->dyn_treelets) == -1) {
+			return -1;
+		}
+		lvl->build_msec += get_msec() - start_time;
+		printf("dynamic BVH construction took: %lu msec (%d faces, %d nodes)\n",
+				get_msec() - start_time, lvl->dyn_root->num_faces, lvl->dyn_bvh.num_nodes);
+	}
+
+	if(build_lights(lvl) == -1) {
 		return -1;
 	}
-	printf("BVH construction took: %lu msec\n", get_msec() - start_time);
+	if(lvl->light_bvh.num_lights) {
+		printf("lights: %d emissive faces (light tree depth: %d)\n",
+				lvl->light_bvh.num_lights, lvl->light_bvh.max_depth);
+	}
 	return 0;
 }
 
 void destroy_level(struct level *lvl)
 {
 	struct mesh *mesh;
+	struct dynobj *dobj;
+	struct object *obj;
 
 	free_bvh_tree(lvl->st_root);
 	free_bvh_tree(lvl->dyn_root);
+	destroy_bvh(&lvl->st_bvh);
+	destroy_bvh(&lvl->dyn_bvh);
+	destroy_inst_bvh(&lvl->inst_bvh);
+	free(lvl->inst);
+	destroy_light_bvh(&lvl->light_bvh);
+	free(lvl->lights);
+
+	while(lvl->objlist) {
+		obj = lvl->objlist;
+		lvl->objlist = lvl->objlist->next;
+		destroy_bvh(&obj->bvh);
+		free(obj->emitters);
+		free(obj->fname);
+		free(obj);
+	}
+
+	while(lvl->dynlist) {
+		dobj = lvl->dynlist;
+		lvl->dynlist = lvl->dynlist->next;
+		free(dobj->rest);
+		free(dobj);
+	}
 
 	while(lvl->meshlist) {
 		mesh = lvl->meshlist;
@@ -116,77 +232,369 @@ void destroy_level(struct level *lvl)
 	}
 }
 
+int update_level(struct level *lvl, unsigned long msec)
+{
+	int i, j;
+	float xform[16];
+	struct dynobj *dobj;
+	struct triangle *src, *dst;
+
+	if(!lvl->dynlist) return 0;
+
+	dobj = lvl->dynlist;
+	while(dobj) {
+		cgm_mrotation(xform, dobj->speed * (float)msec / 1000.0f, dobj->axis.x,
+				dobj->axis.y, dobj->axis.z);
+
+		src = dobj->rest;
+		dst = dobj->mesh->faces;
+		for(i=0; i<dobj->mesh->num_faces; i++) {
+			for(j=0; j<3; j++) {
+				dst->v[j].pos = src->v[j].pos;
+				cgm_vsub(&dst->v[j].pos, &dobj->pivot);
+				cgm_vmul_m3v3(&dst->v[j].pos, xform);
+				cgm_vadd(&dst->v[j].pos, &dobj->pivot);
+				dst->v[j].norm = src->v[j].norm;
+				cgm_vmul_m3v3(&dst->v[j].norm, xform);
+			}
+			dst->norm = src->norm;
+			cgm_vmul_m3v3(&dst->norm, xform);
+			tri_setup(dst);
+			src++;
+			dst++;
+		}
+		dobj = dobj->next;
+	}
+
+	if(lvl->dyn_lights) {
+		refit_light_bvh(&lvl->light_bvh);
+	}
+
+	/* refitting keeps the topology, which is fine for small motions */
+	if(lvl->dyn_refit_limit > 0.0f && lvl->dyn_bvh.num_nodes &&
+			refit_bvh(&lvl->dyn_bvh, tpool) <= lvl->dyn_bvh.sah_cost * lvl->dyn_refit_limit) {
+		return 1;
+	}
+
+	if(build_bvh_lbvh(&lvl->dyn_bvh, lvl->dyn_root, tpool, lvl->dyn_treelets) == -1) {
+		/* leave the dynamic objects out, rather than trace a stale tree */
+		lvl->dyn_bvh.num_nodes = 0;
+	}
+	return 1;
+}
+
 
 int ray_level(cgm_ray *ray, struct level *lvl, float tmax, struct rayhit *hit)
 {
 	int found = 0;
-	struct rayhit hit0;
 
 	if(!hit) {
-		if(ray_bvhnode(ray, lvl->st_root, tmax, 0)) return 1;
-		if(ray_bvhnode(ray, lvl->dyn_root, tmax, 0)) return 1;
-		return 0;
+		return occluded_level(ray, lvl, tmax);
 	}
 
-	hit0.t = FLT_MAX;
-	if(ray_bvhnode(ray, lvl->st_root, tmax, hit)) {
-		hit0 = *hit;
+	/* ray_bvh only overwrites hit if it finds something closer than tmax */
+	if(ray_bvh(ray, &lvl->st_bvh, tmax, hit)) {
+		tmax = hit->t;
 		found = 1;
 	}
-	if(ray_bvhnode(ray, lvl->dyn_root, tmax, hit) && hit->t < hit0.t) {
-		hit0 = *hit;
+	if(ray_bvh(ray, &lvl->dyn_bvh, tmax, hit)) {
+		tmax = hit->t;
 		found = 1;
 	}
+	if(ray_inst_bvh(ray, &lvl->inst_bvh, tmax, hit)) {
+		found = 1;
+	}
+	return found;
+}
 
-	if(found) {
-		*hit = hit0;
-		return 1;
+void ray_level_packet(struct raypacket *pk, struct level *lvl, struct rayhit *hits)
+{
+	int i;
+
+	ray_bvh_packet(pk, &lvl->st_bvh);
+	ray_bvh_packet(pk, &lvl->dyn_bvh);
+
+	for(i=0; i<pk->num_rays; i++) {
+		if(pk->th[i].tri) {
+			tri_hit_attr(pk->ray + i, pk->th + i, hits + i);
+		} else {
+			hits[i].mtl = 0;
+		}
+		ray_inst_bvh(pk->ray + i, &lvl->inst_bvh, pk->tmax[i], hits + i);
 	}
-	return 0;
 }
 
-static void draw_level_rec(struct bvhnode *bn)
+int occluded_level(cgm_ray *ray, struct level *lvl, float tmax)
 {
-	int i, j;
+	return occluded_bvh(ray, &lvl->st_bvh, tmax) || occluded_bvh(ray, &lvl->dyn_bvh, tmax) ||
+		occluded_inst_bvh(ray, &lvl->inst_bvh, tmax);
+}
+
+/* orders faces by material, and duplicates next to each other */
+static int face_cmp(const void *a, const void *b)
+{
+	struct triangle *ta = *(struct triangle**)a;
+	struct triangle *tb = *(struct triangle**)b;
+
+	if(ta->mtl != tb->mtl) {
+		return ta->mtl < tb->mtl ? -1 : 1;
+	}
+	return ta < tb ? -1 : (ta > tb ? 1 : 0);
+}
+
+/* SBVH leaves can share faces, so the faces are sorted to draw each of them
+ * once, in a buffer which is kept around between frames
+ */
+static void draw_level_bvh(struct bvh *bvh)
+{
+	int i, j, num;
 	struct triangle *tri;
 	struct material *curmtl;
 	float color[4] = {0, 0, 0, 1};
+	static struct triangle **faces;
+	static int max_faces;
+	void *tmp;
 
-	if(!bn) return;
-
-	if(bn->faces) {
-		curmtl = bn->faces[0]->mtl;
-
-		glBegin(GL_TRIANGLES);
-		for(i=0; i<bn->num_faces; i++) {
-			tri = bn->faces[i];
-			if(tri->mtl != curmtl) {
-				glEnd();
-				color[0] = tri->mtl->attr[MATTR_COLOR].value.x;
-				color[1] = tri->mtl->attr[MATTR_COLOR].value.y;
-				color[2] = tri->mtl->attr[MATTR_COLOR].value.z;
-				glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, color);
-				curmtl = tri->mtl;
-				glBegin(GL_TRIANGLES);
-			}
+	if(!bvh->num_faces) return;
 
-			for(j=0; j<3; j++) {
-				glNormal3fv(&tri->v[j].norm.x);
-				glTexCoord2fv(&tri->v[j].tex.x);
-				glVertex3fv(&tri->v[j].pos.x);
-			}
+	if(bvh->num_faces > max_faces) {
+		if(!(tmp = realloc(faces, bvh->num_faces * sizeof *faces))) {
+			fprintf(stderr, "draw_level: failed to allocate %d faces\n", bvh->num_faces);
+			return;
+		}
+		faces = tmp;
+		max_faces = bvh->num_faces;
+	}
+
+	num = 0;
+	for(i=0; i<bvh->num_faces; i++) {
+		if(bvh->faces[i]) {		/* skip group padding */
+			faces[num++] = bvh->faces[i];
 		}
-		glEnd();
 	}
+	qsort(faces, num, sizeof *faces, face_cmp);
+
+	curmtl = 0;
+	glBegin(GL_TRIANGLES);
+	for(i=0; i<num; i++) {
+		tri = faces[i];
+		if(i > 0 && tri == faces[i - 1]) continue;
+
+		if(tri->mtl != curmtl) {
+			glEnd();
+			color[0] = tri->mtl->attr[MATTR_COLOR].value.x;
+			color[1] = tri->mtl->attr[MATTR_COLOR].value.y;
+			color[2] = tri->mtl->attr[MATTR_COLOR].value.z;
+			glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, color);
+			curmtl = tri->mtl;
+			glBegin(GL_TRIANGLES);
+		}
 
-	draw_level_rec(bn->left);
-	draw_level_rec(bn->right);
+		for(j=0; j<3; j++) {
+			glNormal3fv(&tri->v[j].norm.x);
+			glTexCoord2fv(&tri->v[j].tex.x);
+			glVertex3fv(&tri->v[j].pos.x);
+		}
+	}
+	glEnd();
 }
 
 void draw_level(struct level *lvl)
 {
-	draw_level_rec(lvl->st_root);
-	draw_level_rec(lvl->dyn_root);
+	int i;
+	struct instance *inst;
+
+	draw_level_bvh(&lvl->st_bvh);
+	draw_level_bvh(&lvl->dyn_bvh);
+
+	inst = lvl->inst_bvh.inst;
+	for(i=0; i<lvl->inst_bvh.num_inst; i++) {
+		glPushMatrix();
+		glMultMatrixf(inst->xform);
+		draw_level_bvh(inst->bvh);
+		glPopMatrix();
+		inst++;
+	}
+}
+
+/* loads a scene file, applies any material edits from the level, and adds
+ * its faces to tree. The meshes are added to the level mesh list.
+ */
+static int load_scene(struct level *lvl, struct ts_node *node, const char *path,
+		struct bvhnode *tree, int dynamic)
+{
+	struct scenefile scn;
+	struct mesh *mesh, *tail;
+	cgm_vec3 pivot;
+
+	if(load_scenefile(&scn, path) == -1) {
+		return -1;
+	}
+
+	/* perform any edits on the loaded scene */
+	proc_edits(node, &scn);
+
+	/* dynamic scenes go to the dynamic tree, which is rebuilt as they move */
+	if(dynamic) {
+		scene_center(&scn, &pivot);
+	}
+
+	mesh = tail = scn.meshlist;
+	while(mesh) {
+		add_mesh_faces(tree, mesh);
+		if(dynamic && add_dynobj(lvl, mesh, node, &pivot) == -1) {
+			/* still part of the dynamic tree, it just won't move */
+			fprintf(stderr, "load_scene: %s: failed to animate a mesh\n", path);
+		}
+		tail = mesh;
+		mesh = mesh->next;
+	}
+
+	if(tail) {
+		tail->next = lvl->meshlist;
+		lvl->meshlist = scn.meshlist;
+		scn.meshlist = 0;
+	}
+	destroy_scenefile(&scn);
+	return 0;
+}
+
+/* scenes with material edits get a tree of their own, all others share the
+ * tree of the first instance of the same file
+ */
+static int add_instance(struct level *lvl, struct ts_node *node, const char *path,
+		float *xform, int builder, float budget)
+{
+	int newsz;
+	void *tmp;
+	struct object *obj;
+	struct bvhnode *tree;
+	struct instance *inst;
+	struct ts_node *child;
+	int shared = 1;
+
+	child = node->child_list;
+	while(child) {
+		if(strcmp(child->name, "mtledit") == 0) {
+			shared = 0;
+			break;
+		}
+		child = child->next;
+	}
+
+	obj = lvl->objlist;
+	while(obj) {
+		if(shared && obj->fname && strcmp(obj->fname, path) == 0) {
+			break;
+		}
+		obj = obj->next;
+	}
+
+	if(!obj) {
+		printf("loading scene file: %s (instanced)\n", path);
+		if(!(obj = calloc(1, sizeof *obj)) || !(tree = calloc(1, sizeof *tree))) {
+			fprintf(stderr, "add_instance: failed to allocate object\n");
+			free(obj);
+			return -1;
+		}
+		aabox_init(&tree->aabb);
+		if(load_scene(lvl, node, path, tree, 0) == -1 || !tree->num_faces ||
+				(obj->num_emitters = collect_emitters(tree, &obj->emitters)) == -1) {
+			free_bvh_tree(tree);
+			free(obj);
+			return -1;
+		}
+		if(build_static(&obj->bvh, tree, builder, budget) == -1) {
+			free(obj->emitters);
+			destroy_bvh(&obj->bvh);
+			free(obj);
+			return -1;
+		}
+		if(shared && !(obj->fname = strdup(path))) {
+			fprintf(stderr, "add_instance: failed to allocate file name\n");
+		}
+		obj->next = lvl->objlist;
+		lvl->objlist = obj;
+	}
+
+	if(lvl->num_inst >= lvl->max_inst) {
+		newsz = lvl->max_inst ? lvl->max_inst * 2 : 16;
+		if(!(tmp = realloc(lvl->inst, newsz * sizeof *lvl->inst))) {
+			fprintf(stderr, "add_instance: failed to resize instance array to %d\n", newsz);
+			return -1;
+		}
+		lvl->inst = tmp;
+		lvl->max_inst = newsz;
+	}
+	inst = lvl->inst + lvl->num_inst;
+	inst->bvh = &obj->bvh;
+	inst->obj = obj;
+	if(set_instance_xform(inst, xform) == -1) {
+		fprintf(stderr, "add_instance: ignoring %s instance with singular transformation\n", path);
+		return -1;
+	}
+	lvl->num_inst++;
+	return 0;
+}
+
+/* builds a static tree with the selected builder, and frees the source tree */
+static int build_static(struct bvh *bvh, struct bvhnode *tree, int builder, float budget)
+{
+	int res, width;
+
+	if(builder == BVH_BUILD_SBVH) {
+		res = build_bvh_sbvh(tree, budget);
+	} else {
+		res = build_bvh_sah_mt(tree, tpool);
+	}
+	if(res == -1 || flatten_bvh(bvh, tree) == -1) {
+		free_bvh_tree(tree);
+		return -1;
+	}
+	/* the flattened tree has its own copy of the face pointers */
+	free_bvh_tree(tree);
+
+	width = opt.bvh_width ? opt.bvh_width : bvh_auto_width();
+	if(width > 2 && build_wide_bvh(bvh, width) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+/* optional position/rotation/scale attributes of a scene, rotation in degrees.
+ * Returns 0 if there are none.
+ */
+static int scene_xform(struct ts_node *node, float *xform)
+{
+	float *pos, *rot, scale[3] = {1, 1, 1};
+	struct ts_attr *attr;
+
+	pos = ts_get_attr_vec(node, "position", 0);
+	rot = ts_get_attr_vec(node, "rotation", 0);
+	if((attr = ts_get_attr(node, "scale"))) {
+		if(attr->val.type == TS_NUMBER) {
+			scale[0] = scale[1] = scale[2] = attr->val.fnum;
+		} else if(attr->val.type == TS_VECTOR) {
+			scale[0] = attr->val.vec[0];
+			scale[1] = attr->val.vec[1];
+			scale[2] = attr->val.vec[2];
+		}
+	}
+	if(!pos && !rot && !attr) {
+		return 0;
+	}
+
+	/* scale first, then rotate, then translate */
+	cgm_midentity(xform);
+	cgm_mscale(xform, scale[0], scale[1], scale[2]);
+	if(rot) {
+		cgm_mrotate_euler(xform, cgm_deg_to_rad(rot[0]), cgm_deg_to_rad(rot[1]),
+				cgm_deg_to_rad(rot[2]), CGM_EULER_XYZ);
+	}
+	if(pos) {
+		cgm_mtranslate(xform, pos[0], pos[1], pos[2]);
+	}
+	return 1;
 }
 
 static int add_mesh_faces(struct bvhnode *bnode, struct mesh *mesh)
@@ -201,6 +609,7 @@ static int add_mesh_faces(struct bvhnode *bnode, struct mesh *mesh)
 		return -1;
 	}
 	bnode->faces = tmp;
+	bnode->max_faces = newsz;	/* the root node owns the faces array */
 	triptr = bnode->faces + bnode->num_faces;
 	bnode->num_faces = newsz;
 
@@ -221,6 +630,68 @@ static int add_mesh_faces(struct bvhnode *bnode, struct mesh *mesh)
 	return 0;
 }
 
+/* "spin" is the rotation speed in degrees per second, around "spin_axis"
+ * through the center of the scene. Meshes which don't spin stay put, but
+ * are still part of the dynamic tree.
+ */
+static int add_dynobj(struct level *lvl, struct mesh *mesh, struct ts_node *snode,
+		cgm_vec3 *pivot)
+{
+	float speed, *vec;
+	struct dynobj *dobj;
+
+	if((speed = ts_get_attr_num(snode, "spin", 0.0f)) == 0.0f) {
+		return 0;
+	}
+
+	if(!(dobj = malloc(sizeof *dobj))) {
+		fprintf(stderr, "add_dynobj: failed to allocate dynamic object\n");
+		return -1;
+	}
+	if(!(dobj->rest = malloc(mesh->num_faces * sizeof *dobj->rest))) {
+		fprintf(stderr, "add_dynobj: failed to allocate copy of %d faces\n", mesh->num_faces);
+		free(dobj);
+		return -1;
+	}
+	memcpy(dobj->rest, mesh->faces, mesh->num_faces * sizeof *dobj->rest);
+
+	dobj->mesh = mesh;
+	dobj->pivot = *pivot;
+	dobj->speed = cgm_deg_to_rad(speed);
+	if((vec = ts_get_attr_vec(snode, "spin_axis", 0))) {
+		cgm_vcons(&dobj->axis, vec[0], vec[1], vec[2]);
+		cgm_vnormalize(&dobj->axis);
+	} else {
+		cgm_vcons(&dobj->axis, 0, 1, 0);
+	}
+
+	dobj->next = lvl->dynlist;
+	lvl->dynlist = dobj;
+	return 0;
+}
+
+static void scene_center(struct scenefile *scn, cgm_vec3 *res)
+{
+	int i;
+	struct aabox box;
+	struct mesh *mesh;
+
+	aabox_init(&box);
+	mesh = scn->meshlist;
+	while(mesh) {
+		for(i=0; i<mesh->num_faces; i++) {
+			aabox_addface(&box, mesh->faces + i);
+		}
+		mesh = mesh->next;
+	}
+	if(box.vmin.x > box.vmax.x) {
+		cgm_vcons(res, 0, 0, 0);
+		return;
+	}
+	cgm_vcons(res, (box.vmin.x + box.vmax.x) * 0.5f, (box.vmin.y + box.vmax.y) * 0.5f,
+			(box.vmin.z + box.vmax.z) * 0.5f);
+}
+
 static void proc_edits(struct ts_node *snode, struct scenefile *scn)
 {
 	const char *mtlname, *mtlprop;
@@ -348,3 +819,77 @@ static int edit_mtl(struct ts_node *node, const char *mtlname, const char *mtlpr
 	}
 	return 0;
 }
+
+/* returns the number of emissive faces of a tree, and an array of them in res */
+static int collect_emitters(struct bvhnode *tree, struct triangle ***res)
+{
+	int i, num = 0;
+	struct triangle **arr;
+
+	*res = 0;
+	for(i=0; i<tree->num_faces; i++) {
+		if(is_emissive(tree->faces[i]->mtl)) num++;
+	}
+	if(!num) return 0;
+
+	if(!(arr = malloc(num * sizeof *arr))) {
+		fprintf(stderr, "collect_emitters: failed to allocate %d faces\n", num);
+		return -1;
+	}
+	num = 0;
+	for(i=0; i<tree->num_faces; i++) {
+		if(is_emissive(tree->faces[i]->mtl)) {
+			arr[num++] = tree->faces[i];
+		}
+	}
+	*res = arr;
+	return num;
+}
+
+static int add_light(struct level *lvl, struct triangle *tri, struct instance *inst)
+{
+	int newsz;
+	void *tmp;
+
+	if(lvl->num_lights >= lvl->max_lights) {
+		newsz = lvl->max_lights ? lvl->max_lights * 2 : 64;
+		if(!(tmp = realloc(lvl->lights, newsz * sizeof *lvl->lights))) {
+			fprintf(stderr, "add_light: failed to resize light array to %d\n", newsz);
+			return -1;
+		}
+		lvl->lights = tmp;
+		lvl->max_lights = newsz;
+	}
+	lvl->lights[lvl->num_lights].tri = tri;
+	lvl->lights[lvl->num_lights++].inst = inst;
+	return 0;
+}
+
+/* adds the emitters of every instance to the world space lights collected
+ * while loading, and builds the light tree over all of them
+ */
+static int build_lights(struct level *lvl)
+{
+	int i, j;
+	struct instance *inst;
+	struct object *obj;
+
+	for(i=0; i<lvl->inst_bvh.num_inst; i++) {
+		inst = lvl->inst_bvh.inst + i;
+		obj = inst->obj;
+		for(j=0; j<obj->num_emitters; j++) {
+			if(add_light(lvl, obj->emitters[j], inst) == -1) {
+				return -1;
+			}
+		}
+	}
+
+	if(build_light_bvh(&lvl->light_bvh, lvl->lights, lvl->num_lights) == -1) {
+		return -1;
+	}
+	/* the light tree keeps its own reordered copy */
+	free(lvl->lights);
+	lvl->lights = 0;
+	lvl->num_lights = lvl->max_lights = 0;
+	return 0;
+}
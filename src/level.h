@@ -3,6 +3,26 @@
 
 #include "rt.h"
 #include "bvh.h"
+#include "instance.h"
+#include "light.h"
+
+/* mesh of a scene marked as dynamic, rotating around a pivot */
+struct dynobj {
+	struct mesh *mesh;
+	struct triangle *rest;	/* copy of the faces in their initial positions */
+	cgm_vec3 pivot, axis;
+	float speed;			/* radians per second */
+	struct dynobj *next;
+};
+
+/* tree of an instanced scene file, in object space */
+struct object {
+	char *fname;	/* null if it's not shared (scene with material edits) */
+	struct bvh bvh;
+	struct triangle **emitters;	/* emissive faces, added as lights per instance */
+	int num_emitters;
+	struct object *next;
+};
 
 struct level {
 	cgm_vec3 bgcolor;
@@ -10,13 +30,48 @@ struct level {
 	struct bvhnode *st_root;
 	struct bvhnode *dyn_root;
 
+	/* flattened versions of the above, used for ray traversal */
+	struct bvh st_bvh, dyn_bvh;
+
+	/* top-level tree over the instances of objects */
+	struct inst_bvh inst_bvh;
+	struct object *objlist;
+	struct instance *inst;	/* instances collected while loading */
+	int num_inst, max_inst;
+
 	struct mesh *meshlist;
+	int num_mtl;		/* materials are numbered in meshlist order */
+	struct dynobj *dynlist;
+
+	/* light tree over the emissive faces of the static and dynamic trees and
+	 * of every instance, refitted as dynamic objects move
+	 */
+	struct light_bvh light_bvh;
+	struct light *lights;	/* lights collected while loading */
+	int num_lights, max_lights;
+	int dyn_lights;
+
+	int dyn_treelets;	/* treelet restructuring for dynamic tree rebuilds */
+	float dyn_refit_limit;	/* SAH cost growth from refitting before a rebuild */
+
+	unsigned long build_msec;	/* time spent building the trees while loading */
 };
 
 int load_level(struct level *lvl, const char *fname);
 void destroy_level(struct level *lvl);
 
+/* animates dynamic objects and rebuilds the dynamic tree. Returns 1 if
+ * anything moved.
+ */
+int update_level(struct level *lvl, unsigned long msec);
+
 int ray_level(cgm_ray *ray, struct level *lvl, float tmax, struct rayhit *hit);
+int occluded_level(cgm_ray *ray, struct level *lvl, float tmax);
+/* closest hits for a packet of rays, traced with ray_bvh_packet through the
+ * static and dynamic trees, and one at a time through the instances. Rays
+ * which didn't hit anything get a null hits[i].mtl.
+ */
+void ray_level_packet(struct raypacket *pk, struct level *lvl, struct rayhit *hits);
 
 void draw_level(struct level *lvl);
 
@@ -0,0 +1,481 @@
+/* light tree for many-light sampling (Conty Estevez & Kulla 2018). Every node
+ * bounds the position, orientation and power of the emitters below it, which
+ * gives a conservative estimate of their contribution to a shading point.
+ * Sampling descends the tree choosing children in proportion to that estimate.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "light.h"
+
+static int build_rec(struct light_bvh *lb, int first, int num, int parent, int depth,
+		int *nidx);
+static int split_lights(struct light *lights, int num);
+static void light_geom(struct light *lt);
+static void init_leaf(struct lightnode *node, struct light *lt);
+static void merge_nodes(struct lightnode *node, struct lightnode *a, struct lightnode *b);
+static int init_hash(struct light_bvh *lb);
+static int find_light(struct light_bvh *lb, struct triangle *tri, struct instance *inst);
+
+int is_emissive(struct material *mtl)
+{
+	cgm_vec3 *emit = &mtl->attr[MATTR_EMIT].value;
+	return mtl->attr[MATTR_EMIT].tex || emit->x > 0.0f || emit->y > 0.0f || emit->z > 0.0f;
+}
+
+/* brightness of the emission of a material, for estimating the power of lights.
+ * Textures replace the emission value, so for those it's a guess.
+ */
+static inline float emit_lum(struct material *mtl)
+{
+	cgm_vec3 *emit = &mtl->attr[MATTR_EMIT].value;
+	float lum = (emit->x + emit->y + emit->z) / 3.0f;
+
+	if(mtl->attr[MATTR_EMIT].tex && lum <= 0.0f) {
+		return 1.0f;
+	}
+	return lum;
+}
+
+int build_light_bvh(struct light_bvh *lb, struct light *lights, int num_lights)
+{
+	int i, nidx = 0;
+
+	memset(lb, 0, sizeof *lb);
+	if(!num_lights) return 0;
+
+	if(!(lb->lights = malloc(num_lights * sizeof *lb->lights))) {
+		fprintf(stderr, "build_light_bvh: failed to allocate %d lights\n", num_lights);
+		return -1;
+	}
+	memcpy(lb->lights, lights, num_lights * sizeof *lb->lights);
+	lb->num_lights = num_lights;
+
+	for(i=0; i<num_lights; i++) {
+		light_geom(lb->lights + i);
+	}
+
+	/* one light per leaf */
+	lb->num_nodes = 2 * num_lights - 1;
+	if(!(lb->nodes = malloc(lb->num_nodes * sizeof *lb->nodes))) {
+		fprintf(stderr, "build_light_bvh: failed to allocate %d nodes\n", lb->num_nodes);
+		destroy_light_bvh(lb);
+		return -1;
+	}
+	build_rec(lb, 0, num_lights, -1, 1, &nidx);
+	assert(nidx == lb->num_nodes);
+
+	if(init_hash(lb) == -1) {
+		destroy_light_bvh(lb);
+		return -1;
+	}
+	return 0;
+}
+
+void destroy_light_bvh(struct light_bvh *lb)
+{
+	if(!lb) return;
+	free(lb->nodes);
+	free(lb->lights);
+	free(lb->hash);
+	memset(lb, 0, sizeof *lb);
+}
+
+/* children always come after their parent, so a backwards pass over the nodes
+ * updates them bottom-up
+ */
+void refit_light_bvh(struct light_bvh *lb)
+{
+	int i;
+	struct lightnode *node;
+	struct light *lt;
+
+	for(i=lb->num_nodes-1; i>=0; i--) {
+		node = lb->nodes + i;
+		if(node->leaf) {
+			lt = lb->lights + node->offs;
+			light_geom(lt);
+			init_leaf(node, lt);
+		} else {
+			merge_nodes(node, node + 1, lb->nodes + node->offs);
+		}
+	}
+}
+
+static int build_rec(struct light_bvh *lb, int first, int num, int parent, int depth,
+		int *nidx)
+{
+	int idx, nleft, dl, dr;
+	struct lightnode *node;
+
+	idx = (*nidx)++;
+	node = lb->nodes + idx;
+	node->parent = parent;
+
+	if(depth > lb->max_depth) lb->max_depth = depth;
+
+	if(num == 1) {
+		node->offs = first;
+		lb->lights[first].node = idx;
+		init_leaf(node, lb->lights + first);
+		return depth;
+	}
+
+	nleft = split_lights(lb->lights + first, num);
+
+	dl = build_rec(lb, first, nleft, idx, depth + 1, nidx);
+	node->offs = *nidx;
+	dr = build_rec(lb, first + nleft, num - nleft, idx, depth + 1, nidx);
+
+	merge_nodes(node, node + 1, lb->nodes + node->offs);
+	return dl > dr ? dl : dr;
+}
+
+static inline float light_centroid(struct light *lt, int axis)
+{
+	return (cgm_velem(&lt->aabb.vmin, axis) + cgm_velem(&lt->aabb.vmax, axis)) * 0.5f;
+}
+
+/* midpoint split of the centroids along their longest extent, partitioning the
+ * array in place and returning the number of lights on the low side
+ */
+static int split_lights(struct light *lights, int num)
+{
+	int i, j, best_axis = 0;
+	float c, ext, best_ext = 0.0f, mid;
+	struct aabox cbox;
+	struct light tmp;
+
+	aabox_init(&cbox);
+	for(i=0; i<num; i++) {
+		for(j=0; j<3; j++) {
+			c = light_centroid(lights + i, j);
+			if(c < cgm_velem(&cbox.vmin, j)) cgm_velem(&cbox.vmin, j) = c;
+			if(c > cgm_velem(&cbox.vmax, j)) cgm_velem(&cbox.vmax, j) = c;
+		}
+	}
+	for(j=0; j<3; j++) {
+		if((ext = cgm_velem(&cbox.vmax, j) - cgm_velem(&cbox.vmin, j)) > best_ext) {
+			best_ext = ext;
+			best_axis = j;
+		}
+	}
+	if(best_ext <= 0.0f) {
+		/* all centroids coincide */
+		return num / 2;
+	}
+	mid = (cgm_velem(&cbox.vmin, best_axis) + cgm_velem(&cbox.vmax, best_axis)) * 0.5f;
+
+	i = 0;
+	j = num - 1;
+	while(i <= j) {
+		if(light_centroid(lights + i, best_axis) < mid) {
+			i++;
+		} else {
+			tmp = lights[i];
+			lights[i] = lights[j];
+			lights[j--] = tmp;
+		}
+	}
+	if(i == 0 || i == num) {
+		i = num / 2;
+	}
+	return i;
+}
+
+/* world space bounds, normal, area, and power of a light */
+static void light_geom(struct light *lt)
+{
+	int i;
+	float len;
+	cgm_vec3 v[3];
+
+	aabox_init(&lt->aabb);
+	for(i=0; i<3; i++) {
+		v[i] = lt->tri->v[i].pos;
+		if(lt->inst) {
+			cgm_vmul_m4v3(v + i, lt->inst->xform);
+		}
+		if(v[i].x < lt->aabb.vmin.x) lt->aabb.vmin.x = v[i].x;
+		if(v[i].x > lt->aabb.vmax.x) lt->aabb.vmax.x = v[i].x;
+		if(v[i].y < lt->aabb.vmin.y) lt->aabb.vmin.y = v[i].y;
+		if(v[i].y > lt->aabb.vmax.y) lt->aabb.vmax.y = v[i].y;
+		if(v[i].z < lt->aabb.vmin.z) lt->aabb.vmin.z = v[i].z;
+		if(v[i].z > lt->aabb.vmax.z) lt->aabb.vmax.z = v[i].z;
+	}
+	cgm_vsub(v + 1, v);
+	cgm_vsub(v + 2, v);
+	cgm_vcross(&lt->norm, v + 1, v + 2);
+
+	if((len = cgm_vlength(&lt->norm)) > 0.0f) {
+		cgm_vscale(&lt->norm, 1.0f / len);
+	} else {
+		cgm_vcons(&lt->norm, 0.0f, 1.0f, 0.0f);
+	}
+	lt->area = len * 0.5f;
+	lt->power = emit_lum(lt->tri->mtl) * lt->area;
+}
+
+static void init_leaf(struct lightnode *node, struct light *lt)
+{
+	node->aabb = lt->aabb;
+	node->axis = lt->norm;
+	node->theta = 0.0f;
+	node->cos_theta = 1.0f;
+	node->sin_theta = 0.0f;
+	node->power = lt->power;
+	node->leaf = 1;
+}
+
+/* bounding cone of two cones. They are two-sided, so the second one is
+ * flipped to the side closest to the first, and any cone reaching pi/2
+ * contains every direction.
+ */
+static void cone_union(cgm_vec3 *axis, float *theta, cgm_vec3 *axis2, float theta2)
+{
+	float cosd, theta_d, theta_o, theta_r, len;
+	cgm_vec3 w = *axis2, k, t;
+
+	if((cosd = cgm_vdot(axis, &w)) < 0.0f) {
+		cgm_vcons(&w, -w.x, -w.y, -w.z);
+		cosd = -cosd;
+	}
+	theta_d = acos(cosd > 1.0f ? 1.0f : cosd);
+
+	if(theta_d + theta2 <= *theta) return;
+	if(theta_d + *theta <= theta2) {
+		*axis = w;
+		*theta = theta2;
+		return;
+	}
+
+	theta_o = (*theta + theta_d + theta2) * 0.5f;
+	cgm_vcross(&k, axis, &w);
+	if(theta_o >= M_PI / 2.0f || (len = cgm_vlength(&k)) <= 1e-6f) {
+		*theta = M_PI / 2.0f;
+		return;
+	}
+	cgm_vscale(&k, 1.0f / len);
+
+	/* rotate the axis towards w, around k, to the middle of the new cone */
+	theta_r = theta_o - *theta;
+	cgm_vcross(&t, &k, axis);
+	axis->x = axis->x * cos(theta_r) + t.x * sin(theta_r);
+	axis->y = axis->y * cos(theta_r) + t.y * sin(theta_r);
+	axis->z = axis->z * cos(theta_r) + t.z * sin(theta_r);
+	cgm_vnormalize(axis);
+	*theta = theta_o;
+}
+
+static void merge_nodes(struct lightnode *node, struct lightnode *a, struct lightnode *b)
+{
+	aabox_union(&node->aabb, &a->aabb, &b->aabb);
+	node->axis = a->axis;
+	node->theta = a->theta;
+	cone_union(&node->axis, &node->theta, &b->axis, b->theta);
+	node->cos_theta = cos(node->theta);
+	node->sin_theta = sin(node->theta);
+	node->power = a->power + b->power;
+	node->leaf = 0;
+}
+
+/* conservative estimate of the light reaching pos, reflected off a surface
+ * with normal norm, from the emitters below a node: their power over the
+ * squared distance, and the cosines at both ends, reduced by the spread of the
+ * normal cone and by the angle the bounds subtend from pos. Angle differences
+ * are worked out from sines and cosines, without any inverse trigonometry.
+ */
+static float importance(struct lightnode *node, cgm_vec3 *pos, cgm_vec3 *norm)
+{
+	cgm_vec3 c, dir;
+	float rsq, dsq, sin_u, cos_u, cos_b, sin_b, cosang, sinang, res;
+
+	if(node->power <= 0.0f) return 0.0f;
+
+	c.x = (node->aabb.vmin.x + node->aabb.vmax.x) * 0.5f;
+	c.y = (node->aabb.vmin.y + node->aabb.vmax.y) * 0.5f;
+	c.z = (node->aabb.vmin.z + node->aabb.vmax.z) * 0.5f;
+	dir = node->aabb.vmax;
+	cgm_vsub(&dir, &c);
+	rsq = cgm_vdot(&dir, &dir);
+
+	dir = c;
+	cgm_vsub(&dir, pos);
+	dsq = cgm_vdot(&dir, &dir);
+
+	if(dsq <= rsq) {
+		/* inside the bounds, light may come from any direction */
+		return rsq > 0.0f ? node->power / rsq : 0.0f;
+	}
+	cgm_vscale(&dir, 1.0f / sqrt(dsq));
+	sin_u = sqrt(rsq / dsq);
+	cos_u = sqrt(1.0f - sin_u * sin_u);
+
+	res = node->power / dsq;
+
+	/* emitter side, against the closest side of the two-sided normal cone,
+	 * widened by the bounds: the angle bound is theta + theta_u
+	 */
+	cos_b = node->cos_theta * cos_u - node->sin_theta * sin_u;
+	sin_b = node->sin_theta * cos_u + node->cos_theta * sin_u;
+	cosang = fabs(cgm_vdot(&dir, &node->axis));
+	if(cosang < cos_b) {
+		sinang = sqrt(1.0f - cosang * cosang);
+		res *= cosang * cos_b + sinang * sin_b;
+	}
+
+	/* receiver side, nothing below the horizon of the surface */
+	cosang = cgm_vdot(&dir, norm);
+	if(cosang < cos_u) {
+		sinang = sqrt(fabs(1.0f - cosang * cosang));
+		if((cosang = cosang * cos_u + sinang * sin_u) <= 0.0f) {
+			return 0.0f;
+		}
+		res *= cosang;
+	}
+	return res;
+}
+
+int sample_light_bvh(struct light_bvh *lb, cgm_vec3 *pos, cgm_vec3 *norm, float r0,
+		float r1, float r2, struct lightsample *ls)
+{
+	float il, ir, pl, pmf, su, w, u, v;
+	struct lightnode *node;
+	struct light *lt;
+	struct triangle *tri;
+
+	if(!lb->num_nodes) return 0;
+
+	/* descend the tree, reusing r0 for every choice */
+	pmf = 1.0f;
+	node = lb->nodes;
+	while(!node->leaf) {
+		il = importance(node + 1, pos, norm);
+		ir = importance(lb->nodes + node->offs, pos, norm);
+		if(il + ir <= 0.0f) return 0;
+
+		pl = il / (il + ir);
+		if(r0 < pl) {
+			r0 /= pl;
+			pmf *= pl;
+			node++;
+		} else {
+			r0 = (r0 - pl) / (1.0f - pl);
+			pmf *= 1.0f - pl;
+			node = lb->nodes + node->offs;
+		}
+		if(r0 >= 1.0f) r0 = 0.99999994f;
+	}
+	lt = lb->lights + node->offs;
+	if(lt->area <= 0.0f) return 0;
+	tri = lt->tri;
+
+	/* uniformly distributed barycentric coordinates */
+	su = sqrt(r1);
+	w = 1.0f - su;
+	u = r2 * su;
+	v = 1.0f - w - u;
+
+	ls->v.pos.x = tri->v[0].pos.x * w + tri->v[1].pos.x * u + tri->v[2].pos.x * v;
+	ls->v.pos.y = tri->v[0].pos.y * w + tri->v[1].pos.y * u + tri->v[2].pos.y * v;
+	ls->v.pos.z = tri->v[0].pos.z * w + tri->v[1].pos.z * u + tri->v[2].pos.z * v;
+	ls->v.norm.x = tri->v[0].norm.x * w + tri->v[1].norm.x * u + tri->v[2].norm.x * v;
+	ls->v.norm.y = tri->v[0].norm.y * w + tri->v[1].norm.y * u + tri->v[2].norm.y * v;
+	ls->v.norm.z = tri->v[0].norm.z * w + tri->v[1].norm.z * u + tri->v[2].norm.z * v;
+	ls->v.tex.x = tri->v[0].tex.x * w + tri->v[1].tex.x * u + tri->v[2].tex.x * v;
+	ls->v.tex.y = tri->v[0].tex.y * w + tri->v[1].tex.y * u + tri->v[2].tex.y * v;
+
+	if(lt->inst) {
+		cgm_vmul_m4v3(&ls->v.pos, lt->inst->xform);
+		cgm_vmul_v3m3(&ls->v.norm, lt->inst->inv_xform);
+	}
+	cgm_vnormalize(&ls->v.norm);
+
+	ls->mtl = tri->mtl;
+	ls->pdf = pmf / lt->area;
+	return 1;
+}
+
+/* the probability of sample_light_bvh reaching a leaf is the product of the
+ * choices along the way, recomputed walking up from the leaf
+ */
+float light_bvh_pdf(struct light_bvh *lb, cgm_vec3 *pos, cgm_vec3 *norm,
+		struct triangle *tri, struct instance *inst)
+{
+	int i, idx, parent;
+	float il, ir, pmf;
+	struct lightnode *pnode;
+	struct light *lt;
+
+	if((i = find_light(lb, tri, inst)) == -1) {
+		return 0.0f;
+	}
+	lt = lb->lights + i;
+	if(lt->area <= 0.0f) return 0.0f;
+
+	pmf = 1.0f;
+	idx = lt->node;
+	while((parent = lb->nodes[idx].parent) >= 0) {
+		pnode = lb->nodes + parent;
+		il = importance(pnode + 1, pos, norm);
+		ir = importance(lb->nodes + pnode->offs, pos, norm);
+		if(il + ir <= 0.0f) return 0.0f;
+
+		pmf *= (idx == parent + 1 ? il : ir) / (il + ir);
+		idx = parent;
+	}
+	return pmf / lt->area;
+}
+
+static inline unsigned int hash_light(struct triangle *tri, struct instance *inst)
+{
+	uint64_t x = (uintptr_t)tri ^ ((uint64_t)(uintptr_t)inst << 17);
+	x *= 0x9e3779b97f4a7c15ull;
+	return (unsigned int)(x >> 32);
+}
+
+/* open addressing with linear probing, at most half full */
+static int init_hash(struct light_bvh *lb)
+{
+	int i;
+	unsigned int size = 16, h;
+
+	while(size < 2 * lb->num_lights) size <<= 1;
+
+	if(!(lb->hash = malloc(size * sizeof *lb->hash))) {
+		fprintf(stderr, "build_light_bvh: failed to allocate hash table (%u)\n", size);
+		return -1;
+	}
+	lb->hash_mask = size - 1;
+	for(i=0; i<size; i++) {
+		lb->hash[i] = -1;
+	}
+
+	for(i=0; i<lb->num_lights; i++) {
+		h = hash_light(lb->lights[i].tri, lb->lights[i].inst) & lb->hash_mask;
+		while(lb->hash[h] != -1) {
+			h = (h + 1) & lb->hash_mask;
+		}
+		lb->hash[h] = i;
+	}
+	return 0;
+}
+
+static int find_light(struct light_bvh *lb, struct triangle *tri, struct instance *inst)
+{
+	int i;
+	unsigned int h;
+
+	if(!lb->hash) return -1;
+
+	h = hash_light(tri, inst) & lb->hash_mask;
+	while((i = lb->hash[h]) != -1) {
+		if(lb->lights[i].tri == tri && lb->lights[i].inst == inst) {
+			return i;
+		}
+		h = (h + 1) & lb->hash_mask;
+	}
+	return -1;
+}
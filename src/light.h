@@ -0,0 +1,74 @@
+#ifndef LIGHT_H_
+#define LIGHT_H_
+
+#include "geom.h"
+#include "instance.h"
+
+/* emissive triangle, for sampling direct light. Emission is two-sided. */
+struct light {
+	struct triangle *tri;
+	struct instance *inst;	/* null for faces in world space */
+
+	/* world space geometry, updated by build_light_bvh and refit_light_bvh */
+	struct aabox aabb;
+	cgm_vec3 norm;
+	float area, power;
+	int node;				/* leaf of the light tree */
+};
+
+/* node of the light tree, with the same layout as struct bvhflat: the left
+ * child follows its parent, the right child is at offs, and leaves reference a
+ * single light by its index (offs). The normals of the emitters below are
+ * bounded by a two-sided cone around axis, with half-angle theta.
+ */
+struct lightnode {
+	struct aabox aabb;
+	cgm_vec3 axis;
+	float theta, cos_theta, sin_theta;
+	float power;			/* total power of the emitters below */
+	int offs, parent;
+	int leaf;
+};
+
+struct light_bvh {
+	struct lightnode *nodes;
+	int num_nodes, max_depth;
+
+	struct light *lights;
+	int num_lights;
+
+	/* light index by triangle and instance, for light_bvh_pdf */
+	int *hash;
+	unsigned int hash_mask;
+};
+
+/* point picked on a light by sample_light_bvh */
+struct lightsample {
+	struct vertex v;
+	struct material *mtl;
+	float pdf;				/* probability density per unit of area */
+};
+
+/* returns 1 if the material emits any light */
+int is_emissive(struct material *mtl);
+
+/* builds the tree over a copy of the light array */
+int build_light_bvh(struct light_bvh *lb, struct light *lights, int num_lights);
+void destroy_light_bvh(struct light_bvh *lb);
+/* updates the bounds of the tree after the faces of any lights have moved */
+void refit_light_bvh(struct light_bvh *lb);
+
+/* picks a point on a light to illuminate the surface at pos, with normal norm,
+ * descending the tree with a probability proportional to the estimated
+ * contribution of each subtree, from 3 random numbers in [0, 1). Returns 0 if
+ * no light can contribute.
+ */
+int sample_light_bvh(struct light_bvh *lb, cgm_vec3 *pos, cgm_vec3 *norm, float r0,
+		float r1, float r2, struct lightsample *ls);
+/* probability density per unit of area of sample_light_bvh picking any given
+ * point on the face tri of instance inst (null for world space faces)
+ */
+float light_bvh_pdf(struct light_bvh *lb, cgm_vec3 *pos, cgm_vec3 *norm,
+		struct triangle *tri, struct instance *inst);
+
+#endif	/* LIGHT_H_ */
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <sys/time.h>
 #include <cgmath/cgmath.h>
 #include "opengl.h"
 #include "miniglut.h"
@@ -9,6 +10,9 @@
 #include "level.h"
 #include "rt.h"
 #include "statui.h"
+#include "bench.h"
+#include "stats.h"
+#include "trace.h"
 
 enum {
 	MOD_SHIFT	= 1,
@@ -55,11 +59,13 @@ static void skeyup(int key, int x, int y);
 static void mouse(int bn, int st, int x, int y);
 static void motion(int x, int y);
 static void update_modstate(void);
+static unsigned long sys_usec(void);
 
 static int cur_sample;
+static int show_heatmap;
 
 static float cam_theta, cam_phi;
-static cgm_vec3 cam_pos = {0, 1.6, 0};
+static cgm_vec3 cam_pos;
 
 static int mouse_x, mouse_y;
 static int bnstate[8];
@@ -79,17 +85,26 @@ static unsigned int modstate;
 static int auto_res;
 
 static unsigned long nframes;
-static unsigned long start_time;
+static unsigned long start_time;	/* usec */
 
 
 int main(int argc, char **argv)
 {
-	glutInit(&argc, argv);
+	int res;
+
+	start_time = sys_usec();
 
 	if(init_options(argc, argv) == -1) {
+		destroy_options();
 		return 1;
 	}
+	if(opt.bench) {
+		res = run_bench();
+		destroy_options();
+		return res == -1 ? 1 : 0;
+	}
 
+	glutInit(&argc, argv);
 	glutInitWindowSize(opt.width * opt.scale, opt.height * opt.scale);
 	glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE);
 	glutCreateWindow("cyberay");
@@ -106,19 +121,34 @@ int main(int argc, char **argv)
 	glutPassiveMotionFunc(motion);
 
 	if(init() == -1) {
+		destroy_options();
 		return 1;
 	}
 	atexit(cleanup);
 
-	start_time = glutGet(GLUT_ELAPSED_TIME);
+	start_time = sys_usec();
 
 	glutMainLoop();
 	return 0;
 }
 
+/* not glutGet, which needs a window system connection, see run_bench */
+static unsigned long sys_usec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, 0);
+	return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 unsigned long get_msec(void)
 {
-	return glutGet(GLUT_ELAPSED_TIME) - start_time;
+	return (sys_usec() - start_time) / 1000;
+}
+
+unsigned long get_usec(void)
+{
+	return sys_usec() - start_time;
 }
 
 static int init(void)
@@ -151,8 +181,16 @@ static int init(void)
 		return -1;
 	}
 
+	cam_pos = opt.cam_pos;
+	cam_theta = opt.cam_theta;
+	cam_phi = opt.cam_phi;
+
 	resizefb(opt.width, opt.height);
 	init_statui();
+
+	if(opt.trace_file && trace_start(opt.trace_file) == -1) {
+		return -1;
+	}
 	return 0;
 }
 
@@ -162,6 +200,8 @@ static void cleanup(void)
 
 	tsec = get_msec() / 1000.0f;
 	printf("avg framerate: %.2f fps\n", (float)nframes / tsec);
+	print_stats(stdout);
+	trace_stop();
 
 	destroy_level(&lvl);
 
@@ -172,6 +212,8 @@ static void cleanup(void)
 	tpool_destroy(tpool);
 
 	dtx_close_font(uifont);
+
+	destroy_options();
 }
 
 #define WALK_SPEED 3.0f
@@ -204,6 +246,10 @@ static void update(void)
 		cur_sample = 0;
 	}
 
+	if(update_level(&lvl, msec)) {
+		cur_sample = 0;
+	}
+
 	cam_pos.x += cos(cam_theta) * vright + sin(cam_theta) * vfwd;
 	cam_pos.z += -sin(cam_theta) * vright + cos(cam_theta) * vfwd;
 
@@ -217,8 +263,18 @@ static void disp(void)
 {
 	update();
 
-	render(cur_sample++);
+	if(opt.wavefront) {
+		render_wavefront(cur_sample++);
+	} else {
+		render(cur_sample++);
+	}
+	if(trace_active()) {
+		trace_frame(nframes);
+	}
 	display();
+	if(show_heatmap) {
+		draw_heatmap();
+	}
 	draw_statui();
 
 	glutSwapBuffers();
@@ -288,6 +344,18 @@ static void keyb(int key, int press)
 			showstat ^= 1;
 			show_statui(showstat);
 			break;
+
+		case 'h':
+			show_heatmap ^= 1;
+			break;
+
+		case 't':
+			if(trace_active()) {
+				trace_stop();
+			} else {
+				trace_start(opt.trace_file ? opt.trace_file : "trace.json");
+			}
+			break;
 		}
 	}
 }
@@ -145,6 +145,7 @@ int load_scenefile(struct scenefile *scn, const char *fname)
 			tri->v[1].pos = varr[fv[1].vidx];
 			tri->v[2].pos = varr[fv[2].vidx];
 			calc_face_normal(tri);
+			tri_setup(tri);
 			for(i=0; i<3; i++) {
 				tri->v[i].norm = fv[i].nidx >= 0 ? narr[fv[i].nidx] : tri->norm;
 				tri->v[i].tex = fv[i].tidx >= 0 ? tarr[fv[i].tidx] : def_tc;
@@ -161,6 +162,7 @@ int load_scenefile(struct scenefile *scn, const char *fname)
 				tri->v[2].pos = varr[fv[3].vidx];
 				tri->v[2].norm = fv[3].nidx >= 0 ? narr[fv[3].nidx] : tri->norm;
 				tri->v[2].tex = fv[3].tidx >= 0 ? tarr[fv[3].tidx] : def_tc;
+				tri_setup(tri);
 			}
 			break;
 
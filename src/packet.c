@@ -0,0 +1,268 @@
+/* packet traversal of coherent rays (primary rays) through the binary tree.
+ * The whole packet descends the tree together, keeping track of the first ray
+ * which is still active in each subtree (Wald et al. 2007). Nodes are tested
+ * against the first active ray, then against the packet frustum, and only as
+ * a last resort against the rest of the rays, 4 at a time.
+ */
+#include <stdlib.h>
+#include <math.h>
+#include "bvh.h"
+#include "stats.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PACKET_X86_SIMD
+#endif
+
+#define BVH_STACK_SIZE	64
+
+struct pstack {
+	int idx, first;
+};
+
+void init_packet(struct raypacket *pk, cgm_ray *rays, int num, float tmax)
+{
+	int i, j, npad;
+	float o, d, id;
+
+	if(num > PACKET_MAX_RAYS) num = PACKET_MAX_RAYS;
+	pk->num_rays = num;
+	pk->frustum = num > 0;
+	pk->tmax_max = tmax;
+
+	for(i=0; i<num; i++) {
+		pk->ray[i] = rays[i];
+		pk->tmax[i] = tmax;
+		pk->th[i].tri = 0;
+
+		for(j=0; j<3; j++) {
+			o = cgm_velem(&rays[i].origin, j);
+			/* avoid infinities for axis-aligned rays, see init_wray */
+			d = cgm_velem(&rays[i].dir, j);
+			if(fabs(d) < 1e-12f) {
+				d = d < 0.0f ? -1e-12f : 1e-12f;
+			}
+			id = 1.0f / d;
+			pk->org[j][i] = o;
+			pk->idir[j][i] = id;
+
+			if(i == 0) {
+				pk->neg[j] = id < 0.0f;
+			} else if((id < 0.0f) != pk->neg[j]) {
+				pk->frustum = 0;
+			}
+			if(pk->neg[j]) {
+				o = -o;
+				id = -id;
+			}
+			if(i == 0 || o < pk->omin[j]) pk->omin[j] = o;
+			if(i == 0 || o > pk->omax[j]) pk->omax[j] = o;
+			if(i == 0 || id < pk->imin[j]) pk->imin[j] = id;
+			if(i == 0 || id > pk->imax[j]) pk->imax[j] = id;
+		}
+	}
+
+	/* inactive rays have a negative tmax, which never hits anything */
+	npad = (num + 3) & ~3;
+	for(i=num; i<npad; i++) {
+		for(j=0; j<3; j++) {
+			pk->org[j][i] = 0.0f;
+			pk->idir[j][i] = 1.0f;
+		}
+		pk->tmax[i] = -1.0f;
+	}
+}
+
+static inline int ray_box(struct raypacket *pk, int i, const struct aabox *box)
+{
+	int j;
+	float t0, t1, tmp, tnear = 0.0f, tfar = pk->tmax[i];
+
+	for(j=0; j<3; j++) {
+		t0 = (cgm_velem(&box->vmin, j) - pk->org[j][i]) * pk->idir[j][i];
+		t1 = (cgm_velem(&box->vmax, j) - pk->org[j][i]) * pk->idir[j][i];
+		if(t0 > t1) {
+			tmp = t0;
+			t0 = t1;
+			t1 = tmp;
+		}
+		if(t0 > tnear) tnear = t0;
+		if(t1 < tfar) tfar = t1;
+	}
+	return tnear <= tfar;
+}
+
+/* returns 1 if no ray in the packet can hit the box, by interval arithmetic
+ * on the slab distances of the mirrored origin and direction intervals
+ */
+static inline int frustum_miss(struct raypacket *pk, const struct aabox *box)
+{
+	int j;
+	float bmin, bmax, lo, hi, tnear = 0.0f, tfar = pk->tmax_max;
+
+	for(j=0; j<3; j++) {
+		if(pk->neg[j]) {
+			bmin = -cgm_velem(&box->vmax, j);
+			bmax = -cgm_velem(&box->vmin, j);
+		} else {
+			bmin = cgm_velem(&box->vmin, j);
+			bmax = cgm_velem(&box->vmax, j);
+		}
+		/* lowest possible entry, and highest possible exit distance */
+		lo = bmin - pk->omax[j];
+		lo *= lo >= 0.0f ? pk->imin[j] : pk->imax[j];
+		hi = bmax - pk->omin[j];
+		hi *= hi >= 0.0f ? pk->imax[j] : pk->imin[j];
+
+		if(lo > tnear) tnear = lo;
+		if(hi < tfar) tfar = hi;
+	}
+	return tnear > tfar;
+}
+
+/* mask of the 4 rays starting at i (a multiple of 4) hitting the box */
+static inline unsigned int ray_box4(struct raypacket *pk, int i, const struct aabox *box)
+{
+#ifdef PACKET_X86_SIMD
+	int j;
+	__m128 org, idir, t0, t1;
+	__m128 tn = _mm_setzero_ps();
+	__m128 tf = _mm_load_ps(pk->tmax + i);
+
+	for(j=0; j<3; j++) {
+		org = _mm_load_ps(pk->org[j] + i);
+		idir = _mm_load_ps(pk->idir[j] + i);
+		t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(cgm_velem(&box->vmin, j)), org), idir);
+		t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(cgm_velem(&box->vmax, j)), org), idir);
+		tn = _mm_max_ps(tn, _mm_min_ps(t0, t1));
+		tf = _mm_min_ps(tf, _mm_max_ps(t0, t1));
+	}
+	return _mm_movemask_ps(_mm_cmple_ps(tn, tf));
+#else
+	int j;
+	unsigned int mask = 0;
+
+	for(j=0; j<4; j++) {
+		if(ray_box(pk, i + j, box)) {
+			mask |= 1 << j;
+		}
+	}
+	return mask;
+#endif
+}
+
+/* index of the first ray, starting from first, which hits the box, or
+ * num_rays if the whole packet misses it
+ */
+static inline int first_hit(struct raypacket *pk, int first, const struct aabox *box)
+{
+	int i;
+	unsigned int mask;
+
+	if(ray_box(pk, first, box)) {
+		return first;
+	}
+	if(pk->frustum && frustum_miss(pk, box)) {
+		return pk->num_rays;
+	}
+
+	i = first & ~3;
+	mask = ray_box4(pk, i, box) & (~0u << (first - i + 1));
+	for(;;) {
+		if(mask) {
+			return i + __builtin_ctz(mask);
+		}
+		if((i += 4) >= pk->num_rays) break;
+		mask = ray_box4(pk, i, box);
+	}
+	return pk->num_rays;
+}
+
+/* the frustum test is bounded by the furthest any ray can still go, so it's
+ * lowered as the rays find closer hits
+ */
+static inline void update_tmax_max(struct raypacket *pk)
+{
+	int i;
+	float t = pk->tmax[0];
+
+	for(i=1; i<pk->num_rays; i++) {
+		if(pk->tmax[i] > t) t = pk->tmax[i];
+	}
+	pk->tmax_max = t;
+}
+
+int ray_bvh_packet(struct raypacket *pk, struct bvh *bvh)
+{
+	int i, r, top, idx, first, near, far, hit, found = 0;
+	unsigned int mask;
+	struct pstack stackbuf[BVH_STACK_SIZE], *stack = stackbuf;
+	struct bvhflat *node;
+	struct trigroup *groups;
+	struct triangle **faces;
+
+	if(!bvh->num_nodes || !pk->num_rays) return 0;
+
+	if(bvh->max_depth > BVH_STACK_SIZE) {
+		stack = alloca(bvh->max_depth * sizeof *stack);
+	}
+
+	top = 0;
+	idx = 0;
+	first = 0;
+	for(;;) {
+		node = bvh->nodes + idx;
+		STAT_ADD(nodes, 1);
+
+		if((first = first_hit(pk, first, &node->aabb)) < pk->num_rays) {
+			if(!node->count) {
+				/* near-first order for the first active ray, which for coherent
+				 * packets is the right order for most of the other rays too
+				 */
+				if(pk->idir[node->axis][first] < 0.0f) {
+					near = node->offs;
+					far = idx + 1;
+				} else {
+					near = idx + 1;
+					far = node->offs;
+				}
+				stack[top].idx = far;
+				stack[top++].first = first;
+				idx = near;
+				continue;
+			}
+
+			/* leaf: intersect the triangles with every active ray hitting it */
+			groups = bvh->groups + node->offs / TRI_GROUP;
+			faces = bvh->faces + node->offs;
+			hit = 0;
+			for(i = first & ~3; i<pk->num_rays; i+=4) {
+				mask = ray_box4(pk, i, &node->aabb);
+				if(i < first) mask &= ~0u << (first - i);
+
+				while(mask) {
+					r = i + __builtin_ctz(mask);
+					mask &= mask - 1;
+					STAT_ADD(leaves, 1);
+					STAT_ADD(tri_tests, node->count);
+
+					if(ray_trigroups(pk->ray + r, groups, faces, node->count, pk->tmax[r],
+								pk->th + r)) {
+						pk->tmax[r] = pk->th[r].t;
+						hit = 1;
+					}
+				}
+			}
+			if(hit) {
+				update_tmax_max(pk);
+				found = 1;
+			}
+		}
+
+		if(!top) break;
+		top--;
+		idx = stack[top].idx;
+		first = stack[top].first;
+	}
+	return found;
+}
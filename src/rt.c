@@ -1,48 +1,111 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <float.h>
 #include <assert.h>
 #include "rt.h"
 #include "game.h"
 #include "tinymt32.h"
+#include "stats.h"
 
 struct tile {
 	int x, y, width, height;
-	int sample;
+	int sample;			/* samples accumulated so far, 0 restarts accumulation */
 	cgm_vec4 *fbptr;
+	float *lumsq;		/* sums of squared luminance of the samples, per pixel */
+
+	/* adaptive sampling, see update_tile */
+	float err;			/* estimated relative error of the tile */
+	int passes;			/* samples per pixel in the next frame */
+	int done;			/* converged, skipped until accumulation restarts */
 
 	tinymt32_t rndstate;
+	struct raystats stats;
+};
+
+/* how a path reached a hit: the probability density of the direction picked
+ * at the previous hit, or 0 if light sampling couldn't have picked it, and the
+ * normal there, for weighting emission against light sampling, see scatter
+ */
+struct bounce {
+	float pdf;
+	cgm_vec3 norm;
 };
 
+/* adaptive sampling: tiles are never deemed converged before ADAPT_MIN_SAMPLES,
+ * and take at most ADAPT_MAX_PASSES samples per pixel in one frame
+ */
+#define ADAPT_MIN_SAMPLES	16
+#define ADAPT_MAX_PASSES	8
+/* added to the mean luminance when computing relative errors, so that the
+ * noise of near-black pixels doesn't keep their tiles going forever
+ */
+#define ADAPT_LUM_BIAS		0.05f
+
+/* Russian roulette termination of paths, see roulette */
+#define RR_MIN_BOUNCES	3
+#define RR_MAX_PROB		0.95f
+
 float vfov = M_PI / 4;
 
 static float aspect;
 static struct tile *tiles;
 static int num_tiles;
+static float *lumsq;
+static struct tiletime *tile_times;
+static unsigned long frame_start, frame_end;
 
+static void render_tiles(void *cls, int start, int end);
 static void render_tile(struct tile *tile);
-static void ray_trace(cgm_vec3 *color, cgm_ray *ray, float energy, int max_iter);
+static void render_tile_pass(struct tile *tile);
+static void reset_tiles(void);
+static void collect_ray_stats(void);
+static void update_tile(struct tile *tile);
+static void trace_path(cgm_vec3 *color, cgm_ray *ray, struct rayhit *first, int max_iter);
 static void bgcolor(cgm_vec3 *color, cgm_ray *ray);
-static void shade(cgm_vec3 *color, struct rayhit *hit, float energy, int max_iter);
+static int scatter(struct rayhit *hit, struct bounce *in, cgm_vec3 *light, cgm_ray *ray,
+		cgm_vec3 *weight, struct bounce *out);
+static void direct_light(struct rayhit *hit, cgm_vec3 *n, cgm_vec3 *mcol, float mrough,
+		cgm_vec3 *res);
+static int roulette(cgm_vec3 *throughput, int bounces);
 static void primary_ray(cgm_ray *ray, int x, int y, int sample);
 static float fresnel(float costheta, float ior);
 static float mtlattr_num(struct material *mtl, int attr, cgm_vec2 *uv);
 static void mtlattr_vec(cgm_vec3 *res, struct material *mtl, int attr, cgm_vec2 *uv);
 
-static __thread struct tile *curtile;
+/* random number generator state and ray counters of the tile or batch of the
+ * current thread
+ */
+static __thread tinymt32_t *currnd;
+static __thread struct raystats *curstats;
+static struct raystats total_rays;
 
 int fbsize(int width, int height)
 {
 	int i, j, x, y, xtiles, ytiles;
 	cgm_vec4 *fbptr;
+	float *sqptr;
 	struct tile *tileptr;
+	struct tiletime *ttptr;
 
 	if(!(fbptr = malloc(width * height * sizeof *fb.pixels))) {
 		return -1;
 	}
+	if(!(sqptr = malloc(width * height * sizeof *lumsq))) {
+		free(fbptr);
+		return -1;
+	}
 	xtiles = (width + opt.tilesz - 1) / opt.tilesz;
 	ytiles = (height + opt.tilesz - 1) / opt.tilesz;
 	if(!(tileptr = malloc(xtiles * ytiles * sizeof *tiles))) {
 		free(fbptr);
+		free(sqptr);
+		return -1;
+	}
+	if(!(ttptr = calloc(xtiles * ytiles, sizeof *tile_times))) {
+		free(fbptr);
+		free(sqptr);
+		free(tileptr);
 		return -1;
 	}
 
@@ -51,10 +114,16 @@ int fbsize(int width, int height)
 	fb.width = width;
 	fb.height = height;
 
+	free(lumsq);
+	lumsq = sqptr;
+
 	free(tiles);
 	tiles = tileptr;
 	num_tiles = xtiles * ytiles;
 
+	free(tile_times);
+	tile_times = ttptr;
+
 	aspect = (float)fb.width / (float)fb.height;
 
 	y = 0;
@@ -66,66 +135,713 @@ int fbsize(int width, int height)
 			tileptr->width = width - x < opt.tilesz ? width - x : opt.tilesz;
 			tileptr->height = height - y < opt.tilesz ? height - y : opt.tilesz;
 			tileptr->fbptr = fbptr + x;
+			tileptr->lumsq = sqptr + x;
 			tileptr->sample = 0;
+			tileptr->err = 0.0f;
+			tileptr->passes = 1;
+			tileptr->done = 0;
+			memset(&tileptr->stats, 0, sizeof tileptr->stats);
 			tinymt32_init(&tileptr->rndstate, (i << 16) | j);
+
+			ttptr->x = x;
+			ttptr->y = y;
+			ttptr->width = tileptr->width;
+			ttptr->height = tileptr->height;
+			ttptr->thread = -1;
+			ttptr++;
 			tileptr++;
 
 			x += opt.tilesz;
 		}
 		fbptr += width * opt.tilesz;
+		sqptr += width * opt.tilesz;
 		y += opt.tilesz;
 	}
 
 	return 0;
 }
 
+/* samplenum 0 restarts accumulation in every tile. Otherwise, with adaptive
+ * sampling enabled, converged tiles are skipped, and the samples they would
+ * have taken are handed out to the rest, in proportion to their error, so that
+ * a frame costs about the same no matter how many tiles are left.
+ */
 void render(int samplenum)
+{
+	int i, active, extra;
+	float errsum;
+
+	frame_start = get_usec();
+
+	if(!samplenum) {
+		reset_tiles();
+	}
+
+	active = 0;
+	errsum = 0.0f;
+	for(i=0; i<num_tiles; i++) {
+		if(!tiles[i].done) {
+			active++;
+			errsum += tiles[i].err;
+		}
+	}
+	extra = num_tiles - active;
+
+	for(i=0; i<num_tiles; i++) {
+		if(tiles[i].done) {
+			tile_times[i].thread = -1;
+			continue;
+		}
+
+		tiles[i].passes = 1;
+		if(extra > 0 && errsum > 0.0f) {
+			tiles[i].passes += (int)(extra * tiles[i].err / errsum);
+			if(tiles[i].passes > ADAPT_MAX_PASSES) {
+				tiles[i].passes = ADAPT_MAX_PASSES;
+			}
+		}
+	}
+	tpool_parallel_for(tpool, num_tiles, 1, render_tiles, 0);
+	collect_ray_stats();
+
+	frame_end = get_usec();
+}
+
+void get_frame_times(struct frametime *ft)
+{
+	ft->start = frame_start;
+	ft->end = frame_end;
+	ft->tiles = tile_times;
+	ft->num_tiles = num_tiles;
+}
+
+static void reset_tiles(void)
 {
 	int i;
 
 	for(i=0; i<num_tiles; i++) {
-		tiles[i].sample = samplenum;
-		tpool_enqueue(tpool, tiles + i, (tpool_callback)render_tile, 0);
+		tiles[i].sample = 0;
+		tiles[i].err = 0.0f;
+		tiles[i].passes = 1;
+		tiles[i].done = 0;
 	}
-	tpool_wait(tpool);
 }
 
-static void render_tile(struct tile *tile)
+static inline float luminance(cgm_vec3 *col)
+{
+	return col->x * 0.2126f + col->y * 0.7152f + col->z * 0.0722f;
+}
+
+static inline void add_sample(cgm_vec4 *pix, float *sq, cgm_vec3 *col, int sample)
+{
+	float lum = luminance(col);
+
+	if(sample) {
+		pix->x += col->x;
+		pix->y += col->y;
+		pix->z += col->z;
+		pix->w++;
+		*sq += lum * lum;
+	} else {
+		pix->x = col->x;
+		pix->y = col->y;
+		pix->z = col->z;
+		pix->w = 1;
+		*sq = lum * lum;
+	}
+}
+
+/* estimates the error of the tile after its latest samples: the root mean
+ * square over its pixels, of the standard error of the mean luminance of each
+ * pixel relative to the mean itself. Tiles below opt.adapt_thresh are marked
+ * as converged.
+ */
+static void update_tile(struct tile *tile)
 {
 	int i, j;
+	float n, mean, var, rel, sum = 0.0f;
+	cgm_vec4 *pix = tile->fbptr;
+	float *sq = tile->lumsq;
+
+	if(opt.adapt_thresh <= 0.0f || tile->sample < 2) {
+		return;
+	}
+
+	for(i=0; i<tile->height; i++) {
+		for(j=0; j<tile->width; j++) {
+			n = pix[j].w;
+			mean = luminance((cgm_vec3*)(pix + j)) / n;
+			var = (sq[j] / n - mean * mean) * n / (n - 1.0f);
+			if(var > 0.0f) {
+				rel = var / (n * (mean + ADAPT_LUM_BIAS) * (mean + ADAPT_LUM_BIAS));
+				sum += rel;
+			}
+		}
+		pix += fb.width;
+		sq += fb.width;
+	}
+
+	tile->err = sqrt(sum / (tile->width * tile->height));
+	if(tile->sample >= ADAPT_MIN_SAMPLES && tile->err < opt.adapt_thresh) {
+		tile->done = 1;
+	}
+}
+
+/* tiles vary a lot in cost, so they're handed out one at a time */
+static void render_tiles(void *cls, int start, int end)
+{
+	for(; start<end; start++) {
+		if(!tiles[start].done) {
+			render_tile(tiles + start);
+		}
+	}
+}
+
+static void render_tile(struct tile *tile)
+{
+	int pass;
+	struct tiletime *tt = tile_times + (tile - tiles);
+
+	tt->thread = tpool_thread_id(tpool);
+	tt->start = get_usec();
+
+	currnd = &tile->rndstate;
+	curstats = &tile->stats;
+
+	for(pass=0; pass<tile->passes; pass++) {
+		render_tile_pass(tile);
+		tile->sample++;
+	}
+	tile->stats.rays[0] += tile->passes * tile->width * tile->height;
+	update_tile(tile);
+
+	tt->end = get_usec();
+}
+
+static void render_tile_pass(struct tile *tile)
+{
+	int i, j, x, y, n, offs, pw, ph, psz;
 	cgm_ray ray;
 	cgm_vec3 col;
 	cgm_vec4 *fbptr = tile->fbptr;
+	float *sqptr = tile->lumsq;
+	struct raypacket pk;
+	cgm_ray rays[PACKET_MAX_RAYS];
+	struct rayhit hits[PACKET_MAX_RAYS];
+
+	if((psz = opt.packetsz) <= 1) {
+		for(i=0; i<tile->height; i++) {
+			for(j=0; j<tile->width; j++) {
+				primary_ray(&ray, tile->x + j, tile->y + i, tile->sample);
+				trace_path(&col, &ray, 0, opt.max_iter);
+				add_sample(fbptr + j, sqptr + j, &col, tile->sample);
+			}
+			fbptr += fb.width;
+			sqptr += fb.width;
+		}
+		return;
+	}
+
+	/* primary rays are traced in packets of psz x psz, and shaded one by one */
+	for(y=0; y<tile->height; y+=psz) {
+		ph = tile->height - y < psz ? tile->height - y : psz;
+		for(x=0; x<tile->width; x+=psz) {
+			pw = tile->width - x < psz ? tile->width - x : psz;
+
+			n = 0;
+			for(i=0; i<ph; i++) {
+				for(j=0; j<pw; j++) {
+					primary_ray(rays + n++, tile->x + x + j, tile->y + y + i, tile->sample);
+				}
+			}
+			init_packet(&pk, rays, n, FLT_MAX);
+			ray_level_packet(&pk, &lvl, hits);
+
+			n = 0;
+			for(i=0; i<ph; i++) {
+				for(j=0; j<pw; j++) {
+					trace_path(&col, rays + n, hits + n, opt.max_iter);
+					offs = (y + i) * fb.width + x + j;
+					add_sample(fbptr + offs, sqptr + offs, &col, tile->sample);
+					n++;
+				}
+			}
+		}
+	}
+}
+
+/* ---- wavefront renderer ----
+ * Instead of following each path to the end before moving to the next pixel,
+ * all paths of a group of tiles (a wave) advance one bounce at a time. Each
+ * bounce is traced in chunks by the thread pool, the hits are sorted by
+ * material and shaded in chunks, and the rays which go on are sorted by
+ * direction octant and origin cell, so that each trace task gets rays which
+ * tend to visit the same parts of the trees.
+ */
+#define WAVE_PATHS		65536	/* paths in flight per wave */
+#define WAVE_CHUNK		1024	/* paths per trace/shade task */
+#define CELL_BITS		3		/* origins are sorted on an 8x8x8 grid */
+#define SORT_BINS		(8 << (3 * CELL_BITS))
+
+struct wpath {
+	cgm_ray ray;
+	cgm_vec3 weight;	/* path throughput, see trace_path */
+	struct bounce bounce;
+	int pix;			/* index of the pixel in wave.color */
+};
+
+struct wchunk {
+	int start, count;
+	int num_out;		/* continuing paths, written to wave.next + start */
+	int depth;
+	tinymt32_t rndstate;
+	struct raystats stats;
+};
+
+struct wave {
+	int max_paths, max_chunks, num_bins, max_tiles;
+	struct wpath *paths, *next;
+	struct rayhit *hits;
+	int *order;			/* indices of the paths which hit something */
+	unsigned int *keys;
+	int *hist;
+	cgm_vec3 *color;
+	int *pixel;			/* framebuffer offset of each pixel of the wave */
+	struct wchunk *chunks;
+
+	int num_paths, num_pix;
+	int *tile_offs;		/* offset of the first pixel of each tile in the wave */
+	struct aabox bounds;
+	float cell_scale[3];
+};
+
+static struct wave wave;
+
+static int init_wave(int max_paths)
+{
+	int i, nbins;
+
+	nbins = lvl.num_mtl > SORT_BINS ? lvl.num_mtl : SORT_BINS;
+	if(wave.max_paths >= max_paths && wave.num_bins >= nbins && wave.max_tiles >= num_tiles) {
+		return 0;
+	}
+
+	free(wave.paths);
+	free(wave.next);
+	free(wave.hits);
+	free(wave.order);
+	free(wave.keys);
+	free(wave.hist);
+	free(wave.color);
+	free(wave.pixel);
+	free(wave.chunks);
+	free(wave.tile_offs);
+	memset(&wave, 0, sizeof wave);
+
+	wave.max_chunks = (max_paths + WAVE_CHUNK - 1) / WAVE_CHUNK;
+	if(!(wave.paths = malloc(max_paths * sizeof *wave.paths)) ||
+			!(wave.next = malloc(max_paths * sizeof *wave.next)) ||
+			!(wave.hits = malloc(max_paths * sizeof *wave.hits)) ||
+			!(wave.order = malloc(max_paths * sizeof *wave.order)) ||
+			!(wave.keys = malloc(max_paths * sizeof *wave.keys)) ||
+			!(wave.hist = malloc(nbins * sizeof *wave.hist)) ||
+			!(wave.color = malloc(max_paths * sizeof *wave.color)) ||
+			!(wave.pixel = malloc(max_paths * sizeof *wave.pixel)) ||
+			!(wave.chunks = malloc(wave.max_chunks * sizeof *wave.chunks)) ||
+			!(wave.tile_offs = malloc(num_tiles * sizeof *wave.tile_offs))) {
+		fprintf(stderr, "render_wavefront: failed to allocate buffers for %d paths\n", max_paths);
+		return -1;
+	}
+	wave.max_paths = max_paths;
+	wave.num_bins = nbins;
+	wave.max_tiles = num_tiles;
+
+	for(i=0; i<wave.max_chunks; i++) {
+		tinymt32_init(&wave.chunks[i].rndstate, 0x80000000 | i);
+		memset(&wave.chunks[i].stats, 0, sizeof wave.chunks[i].stats);
+	}
+	return 0;
+}
+
+/* primary rays of a tile, straight into the path array, in tile order */
+static void wave_gen_task(void *cls)
+{
+	int i, j, idx;
+	struct tile *tile = cls;
+	struct wpath *path;
 
-	curtile = tile;
+	currnd = &tile->rndstate;
+	tile->stats.rays[0] += tile->width * tile->height;
 
+	idx = wave.tile_offs[tile - tiles];
 	for(i=0; i<tile->height; i++) {
 		for(j=0; j<tile->width; j++) {
-			primary_ray(&ray, tile->x + j, tile->y + i, tile->sample);
-			if(tile->sample) {
-				ray_trace(&col, &ray, 1.0f, opt.max_iter);
-				fbptr[j].x += col.x;
-				fbptr[j].y += col.y;
-				fbptr[j].z += col.z;
-				fbptr[j].w++;
-			} else {
-				ray_trace((cgm_vec3*)(fbptr + j), &ray, 1.0f, opt.max_iter);
-				fbptr[j].w = 1;
+			path = wave.paths + idx;
+			primary_ray(&path->ray, tile->x + j, tile->y + i, tile->sample);
+			cgm_vcons(&path->weight, 1.0f, 1.0f, 1.0f);
+			path->bounce.pdf = 0.0f;
+			path->pix = idx;
+			wave.pixel[idx] = (tile->y + i) * fb.width + tile->x + j;
+			cgm_vcons(wave.color + idx, 0.0f, 0.0f, 0.0f);
+			idx++;
+		}
+	}
+}
+
+/* cls points to the first tile of the wave */
+static void wave_gen_tiles(void *cls, int start, int end)
+{
+	struct tile *tile = (struct tile*)cls + start;
+
+	for(; start<end; start++) {
+		if(!tile->done) {
+			wave_gen_task(tile);
+		}
+		tile++;
+	}
+}
+
+/* closest hits of a chunk of paths. Paths leaving the scene, or reaching the
+ * iteration limit, pick up the background color and end here.
+ */
+static void wave_trace_task(void *cls)
+{
+	int i;
+	struct wchunk *chunk = cls;
+	struct wpath *path = wave.paths + chunk->start;
+	struct rayhit *hit = wave.hits + chunk->start;
+	cgm_vec3 bg, *col;
+
+	if(chunk->depth > 0 && chunk->depth < opt.max_iter) {
+		COUNT_RAYS(&chunk->stats, chunk->depth, chunk->count);
+	}
+
+	for(i=0; i<chunk->count; i++) {
+		if(chunk->depth >= opt.max_iter || !ray_level(&path->ray, &lvl, FLT_MAX, hit)) {
+			hit->mtl = 0;
+			bgcolor(&bg, &path->ray);
+			col = wave.color + path->pix;
+			col->x += bg.x * path->weight.x;
+			col->y += bg.y * path->weight.y;
+			col->z += bg.z * path->weight.z;
+		}
+		path++;
+		hit++;
+	}
+}
+
+/* shades a chunk of the hits, in material order */
+static void wave_shade_task(void *cls)
+{
+	int i, idx;
+	struct wchunk *chunk = cls;
+	struct wpath *path, *next;
+	struct rayhit *hit;
+	cgm_vec3 emit, weight, *col;
+
+	currnd = &chunk->rndstate;
+	curstats = &chunk->stats;
+
+	next = wave.next + chunk->start;
+	chunk->num_out = 0;
+	for(i=0; i<chunk->count; i++) {
+		idx = wave.order[chunk->start + i];
+		path = wave.paths + idx;
+		hit = wave.hits + idx;
+
+		col = wave.color + path->pix;
+		if(scatter(hit, &path->bounce, &emit, &next->ray, &weight, &next->bounce)) {
+			next->weight.x = path->weight.x * weight.x;
+			next->weight.y = path->weight.y * weight.y;
+			next->weight.z = path->weight.z * weight.z;
+			if(roulette(&next->weight, chunk->depth + 1)) {
+				next->pix = path->pix;
+				next++;
+				chunk->num_out++;
 			}
 		}
-		fbptr += fb.width;
+		col->x += emit.x * path->weight.x;
+		col->y += emit.y * path->weight.y;
+		col->z += emit.z * path->weight.z;
 	}
 }
 
-static void ray_trace(cgm_vec3 *color, cgm_ray *ray, float energy, int max_iter)
+/* cls points to the task to run on each chunk */
+static void chunk_range(void *cls, int start, int end)
 {
-	struct rayhit hit;
+	tpool_callback func = *(tpool_callback*)cls;
 
-	if(max_iter && ray_level(ray, &lvl, FLT_MAX, &hit)) {
-		shade(color, &hit, energy, max_iter);
-	} else {
-		bgcolor(color, ray);
+	for(; start<end; start++) {
+		func(wave.chunks + start);
+	}
+}
+
+static void run_chunks(int count, int depth, tpool_callback func)
+{
+	int i, nchunks;
+
+	nchunks = (count + WAVE_CHUNK - 1) / WAVE_CHUNK;
+	for(i=0; i<nchunks; i++) {
+		wave.chunks[i].start = i * WAVE_CHUNK;
+		wave.chunks[i].count = count - i * WAVE_CHUNK < WAVE_CHUNK ? count - i * WAVE_CHUNK : WAVE_CHUNK;
+		wave.chunks[i].depth = depth;
+	}
+	tpool_parallel_for(tpool, nchunks, 1, chunk_range, &func);
+}
+
+/* direction octant in the top bits, and the morton code of the origin cell */
+static inline unsigned int ray_sort_key(cgm_ray *ray)
+{
+	int i, c;
+	unsigned int key;
+
+	key = (ray->dir.x < 0.0f ? 4 : 0) | (ray->dir.y < 0.0f ? 2 : 0) | (ray->dir.z < 0.0f ? 1 : 0);
+	key <<= 3 * CELL_BITS;
+	for(i=0; i<3; i++) {
+		c = (int)((cgm_velem(&ray->origin, i) - cgm_velem(&wave.bounds.vmin, i)) * wave.cell_scale[i]);
+		if(c < 0) c = 0;
+		if(c >= (1 << CELL_BITS)) c = (1 << CELL_BITS) - 1;
+		/* interleave the bits of the cell coordinates */
+		key |= (((c & 1) << 2) | ((c & 2) << 4) | ((c & 4) << 6)) >> i;
+	}
+	return key;
+}
+
+/* counting sort of the hits by material into wave.order. Returns the number
+ * of hits.
+ */
+static int sort_hits(void)
+{
+	int i, n, sum, tmp;
+	int *hist = wave.hist;
+
+	memset(hist, 0, lvl.num_mtl * sizeof *hist);
+	n = 0;
+	for(i=0; i<wave.num_paths; i++) {
+		if(wave.hits[i].mtl) {
+			hist[wave.hits[i].mtl->id]++;
+			n++;
+		}
+	}
+	sum = 0;
+	for(i=0; i<lvl.num_mtl; i++) {
+		tmp = hist[i];
+		hist[i] = sum;
+		sum += tmp;
+	}
+	for(i=0; i<wave.num_paths; i++) {
+		if(wave.hits[i].mtl) {
+			wave.order[hist[wave.hits[i].mtl->id]++] = i;
+		}
+	}
+	return n;
+}
+
+/* gathers the continuing paths of all shading chunks back into wave.paths,
+ * sorted by ray_sort_key
+ */
+static void sort_paths(int nchunks)
+{
+	int i, j, sum, tmp;
+	int *hist = wave.hist;
+	struct wpath *src;
+	unsigned int *keys;
+
+	memset(hist, 0, SORT_BINS * sizeof *hist);
+	for(i=0; i<nchunks; i++) {
+		src = wave.next + wave.chunks[i].start;
+		keys = wave.keys + wave.chunks[i].start;
+		for(j=0; j<wave.chunks[i].num_out; j++) {
+			keys[j] = ray_sort_key(&src[j].ray);
+			hist[keys[j]]++;
+		}
+	}
+	sum = 0;
+	for(i=0; i<SORT_BINS; i++) {
+		tmp = hist[i];
+		hist[i] = sum;
+		sum += tmp;
+	}
+	for(i=0; i<nchunks; i++) {
+		src = wave.next + wave.chunks[i].start;
+		keys = wave.keys + wave.chunks[i].start;
+		for(j=0; j<wave.chunks[i].num_out; j++) {
+			wave.paths[hist[keys[j]]++] = src[j];
+		}
+	}
+	wave.num_paths = sum;
+}
+
+static void scene_bounds(struct aabox *box)
+{
+	aabox_init(box);
+	if(lvl.st_bvh.num_nodes) {
+		aabox_union(box, box, &lvl.st_bvh.nodes[0].aabb);
+	}
+	if(lvl.dyn_bvh.num_nodes) {
+		aabox_union(box, box, &lvl.dyn_bvh.nodes[0].aabb);
+	}
+	if(lvl.inst_bvh.num_nodes) {
+		aabox_union(box, box, &lvl.inst_bvh.nodes[0].aabb);
+	}
+}
+
+void render_wavefront(int samplenum)
+{
+	int i, j, first, last, depth, nhits, nchunks, max_tile, offs, pix;
+	float ext;
+	struct tile *tile;
+
+	max_tile = opt.tilesz * opt.tilesz;
+	if(init_wave(max_tile > WAVE_PATHS ? max_tile : WAVE_PATHS) == -1) {
+		return;
+	}
+
+	scene_bounds(&wave.bounds);
+	for(i=0; i<3; i++) {
+		ext = cgm_velem(&wave.bounds.vmax, i) - cgm_velem(&wave.bounds.vmin, i);
+		wave.cell_scale[i] = ext > 0.0f ? (float)(1 << CELL_BITS) / ext : 0.0f;
+	}
+
+	frame_start = get_usec();
+	for(i=0; i<num_tiles; i++) {
+		tile_times[i].thread = -1;
+	}
+
+	if(!samplenum) {
+		reset_tiles();
+	}
+
+	first = 0;
+	while(first < num_tiles) {
+		/* as many whole tiles as fit in a wave, skipping converged tiles. Each
+		 * tile takes a single sample per frame, the wave has no room for more.
+		 */
+		wave.num_pix = 0;
+		for(i=first; i<num_tiles; i++) {
+			if(tiles[i].done) continue;
+			if(wave.num_pix > 0 && wave.num_pix + tiles[i].width * tiles[i].height > wave.max_paths) {
+				break;
+			}
+			wave.tile_offs[i] = wave.num_pix;
+			wave.num_pix += tiles[i].width * tiles[i].height;
+		}
+		last = i;
+		tpool_parallel_for(tpool, last - first, 1, wave_gen_tiles, tiles + first);
+		wave.num_paths = wave.num_pix;
+
+		for(depth=0; wave.num_paths > 0; depth++) {
+			run_chunks(wave.num_paths, depth, wave_trace_task);
+
+			if(!(nhits = sort_hits())) break;
+			run_chunks(nhits, depth, wave_shade_task);
+
+			nchunks = (nhits + WAVE_CHUNK - 1) / WAVE_CHUNK;
+			sort_paths(nchunks);
+		}
+
+		for(i=first; i<last; i++) {
+			if(tiles[i].done) continue;
+			tile = tiles + i;
+			offs = wave.tile_offs[i];
+			for(j=0; j<tile->width * tile->height; j++) {
+				pix = wave.pixel[offs + j];
+				add_sample(fb.pixels + pix, lumsq + pix, wave.color + offs + j, tile->sample);
+			}
+			tile->sample++;
+			update_tile(tile);
+		}
+		first = last;
+	}
+	collect_ray_stats();
+
+	frame_end = get_usec();
+}
+
+void get_ray_stats(struct raystats *rs)
+{
+	*rs = total_rays;
+	memset(&total_rays, 0, sizeof total_rays);
+}
+
+static void add_ray_stats(struct raystats *dest, struct raystats *src)
+{
+	int i;
+
+	for(i=0; i<RAYSTATS_DEPTH; i++) {
+		dest->rays[i] += src->rays[i];
+	}
+	dest->shadow += src->shadow;
+}
+
+/* end of frame: adds up the rays of every tile and batch, and hands them to
+ * merge_stats along with the rest of the counters
+ */
+static void collect_ray_stats(void)
+{
+	int i;
+	struct raystats *src, frame;
+
+	memset(&frame, 0, sizeof frame);
+	for(i=0; i<num_tiles + wave.max_chunks; i++) {
+		src = i < num_tiles ? &tiles[i].stats : &wave.chunks[i - num_tiles].stats;
+		add_ray_stats(&frame, src);
+		memset(src, 0, sizeof *src);
+	}
+	add_ray_stats(&total_rays, &frame);
+	merge_stats(&frame);
+}
+
+/* follows a path for up to max_iter bounces, accumulating the light picked up
+ * along the way, weighted by the throughput: the product of the scatter weights
+ * of all previous bounces. If first is not null, it's the hit of the primary
+ * ray, already traced, with a null mtl if it missed.
+ */
+static void trace_path(cgm_vec3 *color, cgm_ray *ray, struct rayhit *first, int max_iter)
+{
+	int depth, cont;
+	struct bounce bounce;
+	cgm_vec3 tp, emit, weight;
+	struct rayhit hitbuf, *hit = first;
+	cgm_ray path_ray = *ray;
+
+	cgm_vcons(color, 0.0f, 0.0f, 0.0f);
+	cgm_vcons(&tp, 1.0f, 1.0f, 1.0f);
+	bounce.pdf = 0.0f;
+
+	for(depth=0; depth<max_iter; depth++) {
+		if(!hit) {
+			hit = &hitbuf;
+			if(depth > 0) COUNT_RAYS(curstats, depth, 1);
+			if(!ray_level(&path_ray, &lvl, FLT_MAX, hit)) {
+				hit->mtl = 0;
+			}
+		}
+		if(!hit->mtl) break;
+
+		cont = scatter(hit, &bounce, &emit, &path_ray, &weight, &bounce);
+		color->x += emit.x * tp.x;
+		color->y += emit.y * tp.y;
+		color->z += emit.z * tp.z;
+		if(!cont) return;
+
+		tp.x *= weight.x;
+		tp.y *= weight.y;
+		tp.z *= weight.z;
+		if(!roulette(&tp, depth + 1)) return;
+		hit = 0;
 	}
+
+	/* escaped, or ran out of iterations */
+	bgcolor(&emit, &path_ray);
+	color->x += emit.x * tp.x;
+	color->y += emit.y * tp.y;
+	color->z += emit.z * tp.z;
+}
+
+int occluded(cgm_ray *ray, float tmax)
+{
+	return occluded_level(ray, &lvl, tmax);
 }
 
 static void bgcolor(cgm_vec3 *color, cgm_ray *ray)
@@ -135,7 +851,7 @@ static void bgcolor(cgm_vec3 *color, cgm_ray *ray)
 
 static inline float frand(void)
 {
-	return tinymt32_generate_float(&curtile->rndstate);
+	return tinymt32_generate_float(currnd);
 }
 
 static inline void sphrand(cgm_vec3 *pt, float rad)
@@ -153,59 +869,110 @@ static inline void sphrand(cgm_vec3 *pt, float rad)
 	pt->z = cos(phi) * rad;
 }
 
-static void shade(cgm_vec3 *color, struct rayhit *hit, float energy, int max_iter)
+/* Russian roulette: after RR_MIN_BOUNCES bounces, paths survive with a
+ * probability equal to their throughput (up to RR_MAX_PROB), and those which
+ * survive have their throughput scaled up to make up for the ones which didn't.
+ * Returns 0 if the path should end.
+ */
+static int roulette(cgm_vec3 *throughput, int bounces)
+{
+	float p;
+
+	if(bounces < RR_MIN_BOUNCES) return 1;
+
+	p = throughput->x > throughput->y ? throughput->x : throughput->y;
+	if(throughput->z > p) p = throughput->z;
+	if(p > RR_MAX_PROB) p = RR_MAX_PROB;
+
+	if(frand() >= p) {
+		STAT_ADD(roulette, 1);
+		return 0;
+	}
+	p = 1.0f / p;
+	throughput->x *= p;
+	throughput->y *= p;
+	throughput->z *= p;
+	return 1;
+}
+
+/* power heuristic weight of a sample taken with probability density pa,
+ * against another strategy which could have produced it with density pb
+ */
+static inline float mis_weight(float pa, float pb)
+{
+	pa *= pa;
+	pb *= pb;
+	return pa / (pa + pb);
+}
+
+/* samples the continuation of a path at a hit, reached as described by in.
+ * The light leaving the surface towards the incoming ray is returned in light:
+ * its emission, and the direct light from the light tree reflected by the
+ * diffuse lobe. Returns 1 with the next ray, the factor to apply to the light
+ * it brings back (weight), and the bounce to it (out, which may alias in), or
+ * 0 if the path ends.
+ */
+static int scatter(struct rayhit *hit, struct bounce *in, cgm_vec3 *light, cgm_ray *ray,
+		cgm_vec3 *weight, struct bounce *out)
 {
 	int transmit;
-	cgm_vec3 v, n, out_n;
+	cgm_vec3 v, n, out_n, direct;
 	float mrough, mtrans;
-	float pdiff, pspec, rval;
+	float rval, lpdf, costheta;
 	float fres;
-	cgm_vec3 mcol, rcol;
-	cgm_ray ray;
+	cgm_vec3 mcol;
 	struct material *mtl = hit->mtl;
 
-	if(cgm_vdot(&hit->ray.dir, &hit->v.norm) > 0.0f) {
-		cgm_vcons(&n, -hit->v.norm.x, -hit->v.norm.y, -hit->v.norm.z);
-	} else {
-		n = hit->v.norm;
+	n = hit->v.norm;
+	cgm_vnormalize(&n);
+	costheta = cgm_vdot(&hit->ray.dir, &n);
+	if(costheta > 0.0f) {
+		cgm_vcons(&n, -n.x, -n.y, -n.z);
 	}
 
 	mtlattr_vec(&mcol, hit->mtl, MATTR_COLOR, &hit->v.tex);
 	mrough = mtlattr_num(hit->mtl, MATTR_ROUGHNESS, &hit->v.tex);
 	mtrans = mtlattr_num(hit->mtl, MATTR_TRANSMIT, &hit->v.tex);
 
-	mtlattr_vec(color, hit->mtl, MATTR_EMIT, &hit->v.tex);
-
-	rval = frand();
+	/* emission found by a diffuse bounce could also have been found by light
+	 * sampling at the previous hit, and is weighted accordingly
+	 */
+	mtlattr_vec(light, hit->mtl, MATTR_EMIT, &hit->v.tex);
+	if(in->pdf > 0.0f && fabs(costheta) > 1e-6f && (lpdf = light_bvh_pdf(&lvl.light_bvh,
+					&hit->ray.origin, &in->norm, hit->tri, hit->inst)) > 0.0f) {
+		lpdf *= hit->t * hit->t / fabs(costheta);
+		cgm_vscale(light, mis_weight(in->pdf, lpdf));
+	}
 
-	pdiff = energy * mrough;
-	pspec = energy * (1.0f - mrough);
-	assert(pdiff + pspec <= 1.0f);
+	if(mrough > 0.0f) {
+		direct_light(hit, &n, &mcol, mrough, &direct);
+		cgm_vadd(light, &direct);
+	}
+	out->pdf = 0.0f;
 
-	if(rval <= pdiff) {
-		cgm_vnormalize(&n);
+	rval = frand();
 
+	/* pick the diffuse or specular lobe by roughness */
+	if(rval < mrough) {
 		/* pick diffuse direction with a cosine-weighted probability */
-		sphrand(&ray.dir, 0.98f);
-		cgm_vadd(&ray.dir, &n);
-		cgm_vnormalize(&ray.dir);
-
-		if(cgm_vdot(&ray.dir, &n) < 0.0f) {
-			ray.dir.x = -ray.dir.x;
-			ray.dir.y = -ray.dir.y;
-			ray.dir.z = -ray.dir.z;
-		}
+		sphrand(&ray->dir, 0.98f);
+		cgm_vadd(&ray->dir, &n);
+		cgm_vnormalize(&ray->dir);
 
-		ray.origin = hit->v.pos;
-		ray_trace(&rcol, &ray, pdiff, max_iter - 1);
+		if(cgm_vdot(&ray->dir, &n) < 0.0f) {
+			ray->dir.x = -ray->dir.x;
+			ray->dir.y = -ray->dir.y;
+			ray->dir.z = -ray->dir.z;
+		}
 
-		color->x += rcol.x * mcol.x;
-		color->y += rcol.y * mcol.y;
-		color->z += rcol.z * mcol.z;
+		ray->origin = hit->v.pos;
+		*weight = mcol;
+		out->pdf = mrough * cgm_vdot(&ray->dir, &n) / M_PI;
+		out->norm = n;
+		return 1;
 
-	} else if(rval <= pdiff + pspec) {
-		cgm_vnormalize(&n);
-		ray.dir = hit->ray.dir;
+	} else {
+		ray->dir = hit->ray.dir;
 
 		if(!mtl->metal && (transmit = mtrans > 0.0f)) {
 			/* calculate fresnel factor */
@@ -215,41 +982,83 @@ static void shade(cgm_vec3 *color, struct rayhit *hit, float energy, int max_ite
 			}
 
 			/* calculate refraction direction */
-			if(cgm_vrefract(&ray.dir, &n, mtl->ior) == -1) {
+			if(cgm_vrefract(&ray->dir, &n, mtl->ior) == -1) {
 				transmit = 0;
 			}
 		} else {
 reflect:	transmit = 0;
 			/* calculate reflection direction */
-			cgm_vreflect(&ray.dir, &n);
+			cgm_vreflect(&ray->dir, &n);
 		}
 
 		/* pick specular direction */
 		if(mrough > 0.0f) {
 			sphrand(&v, mrough);
-			cgm_vadd(&ray.dir, &v);
+			cgm_vadd(&ray->dir, &v);
 		}
-		cgm_vnormalize(&ray.dir);
+		cgm_vnormalize(&ray->dir);
 
 		if(transmit) {
 			cgm_vcons(&out_n, -n.x, -n.y, -n.z);
 		} else {
 			out_n = n;
 		}
-		if(cgm_vdot(&ray.dir, &out_n) > 0.0f) {
+		if(cgm_vdot(&ray->dir, &out_n) > 0.0f) {
 			/* only sample rays not crashing back into the surface */
-			ray.origin = hit->v.pos;
-			ray_trace(&rcol, &ray, pspec, max_iter - 1);
-
+			ray->origin = hit->v.pos;
 			if(mtl->metal) {
-				color->x += rcol.x * mcol.x;
-				color->y += rcol.y * mcol.y;
-				color->z += rcol.z * mcol.z;
+				*weight = mcol;
 			} else {
-				cgm_vadd(color, &rcol);
+				cgm_vcons(weight, 1.0f, 1.0f, 1.0f);
 			}
+			return 1;
 		}
 	}
+	return 0;
+}
+
+/* next event estimation: the light arriving from a point picked on the light
+ * tree, reflected by the diffuse lobe (mcol / pi, picked with probability
+ * mrough), and weighted against finding the same light by sampling the lobe
+ */
+static void direct_light(struct rayhit *hit, cgm_vec3 *n, cgm_vec3 *mcol, float mrough,
+		cgm_vec3 *res)
+{
+	struct lightsample ls;
+	cgm_ray ray;
+	cgm_vec3 emit;
+	float dist, dsq, cos_s, cos_l, pdf, s;
+
+	cgm_vcons(res, 0.0f, 0.0f, 0.0f);
+
+	if(!sample_light_bvh(&lvl.light_bvh, &hit->v.pos, n, frand(), frand(), frand(), &ls)) {
+		return;
+	}
+
+	ray.origin = hit->v.pos;
+	ray.dir = ls.v.pos;
+	cgm_vsub(&ray.dir, &hit->v.pos);
+	if((dsq = cgm_vdot(&ray.dir, &ray.dir)) <= 1e-12f) {
+		return;
+	}
+	dist = sqrt(dsq);
+	cgm_vscale(&ray.dir, 1.0f / dist);
+
+	if((cos_s = cgm_vdot(&ray.dir, n)) <= 0.0f) return;
+	if((cos_l = fabs(cgm_vdot(&ray.dir, &ls.v.norm))) <= 1e-6f) return;
+
+	/* stop short of the light, so that it doesn't occlude itself */
+	curstats->shadow++;
+	if(occluded(&ray, dist * 0.999f)) return;
+
+	pdf = ls.pdf * dsq / cos_l;
+	mtlattr_vec(&emit, ls.mtl, MATTR_EMIT, &ls.v.tex);
+
+	s = mrough * cos_s / M_PI;
+	s *= mis_weight(pdf, s) / pdf;
+	res->x = emit.x * mcol->x * s;
+	res->y = emit.y * mcol->y * s;
+	res->z = emit.z * mcol->z * s;
 }
 
 static void primary_ray(cgm_ray *ray, int x, int y, int sample)
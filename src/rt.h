@@ -25,6 +25,8 @@ struct material {
 	float ior;
 	int metal;
 	struct image *mask;
+
+	int id;		/* index in [0, lvl.num_mtl), for binning hits by material */
 };
 
 struct framebuffer {
@@ -36,9 +38,50 @@ struct framebuffer fb;
 struct thread_pool *tpool;
 float view_xform[16];
 
+#define RAYSTATS_DEPTH	16
+
+/* rays traced by the renderers, see get_ray_stats */
+struct raystats {
+	unsigned long rays[RAYSTATS_DEPTH];	/* by bounce, 0: primary, deepest in the last */
+	unsigned long shadow;
+};
+
+#define COUNT_RAYS(st, depth, n) \
+	((st)->rays[(depth) < RAYSTATS_DEPTH ? (depth) : RAYSTATS_DEPTH - 1] += (n))
+
+/* where and when each tile of the last frame was rendered, see get_frame_times */
+struct tiletime {
+	int x, y, width, height;
+	int thread;			/* worker thread, -1 if the tile was skipped */
+	unsigned long start, end;	/* microseconds, see get_usec */
+};
+
+struct frametime {
+	unsigned long start, end;
+	struct tiletime *tiles;
+	int num_tiles;
+};
+
 int fbsize(int width, int height);
 
 void render(int samplenum);
+/* alternative renderer, tracing and shading the paths of groups of tiles in
+ * breadth-first batches, see the wavefront section in rt.c
+ */
+void render_wavefront(int samplenum);
+
+/* timing of the last frame. The wavefront renderer doesn't render tiles as
+ * separate tasks, and marks all of them as skipped.
+ */
+void get_frame_times(struct frametime *ft);
+
+/* rays traced in all frames since the last call */
+void get_ray_stats(struct raystats *rs);
+
+/* shadow/visibility query against the current level: returns 1 if anything
+ * blocks the ray before tmax
+ */
+int occluded(cgm_ray *ray, float tmax);
 
 void tex_lookup(cgm_vec3 *res, struct image *img, float u, float v);
 
@@ -0,0 +1,542 @@
+/* spatial split BVH builder
+ * Based on: "Spatial Splits in Bounding Volume Hierarchies", M. Stich,
+ * H. Friedrich, A. Dietrich, HPG 2009.
+ *
+ * The builder works on references to triangles, each with its own bounding
+ * box, which might cover only part of the triangle. At each node, in addition
+ * to binned SAH object splits, it considers splitting the node space itself,
+ * clipping any references straddling the split plane into two, one for each
+ * side. Since this duplicates references, each leaf of the resulting tree
+ * owns its own faces array.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <assert.h>
+#include "bvh.h"
+
+#define OBJ_BUCKETS		16
+#define SPATIAL_BINS	32
+#define MAX_DEPTH		64
+
+/* spatial splits are only attempted when the children of the best object
+ * split overlap by more than this fraction of the root surface area
+ */
+#define MIN_OVERLAP		1e-5f
+
+struct bvhref {
+	struct triangle *tri;
+	struct aabox box;
+};
+
+struct objbin {
+	struct aabox aabb;
+	int count;
+};
+
+struct spatbin {
+	struct aabox aabb;
+	int enter, exit;
+};
+
+struct sbvh_state {
+	float root_area;
+	int num_refs, max_refs;
+};
+
+struct sbvh_split {
+	int axis;
+	int bucket;		/* object splits */
+	float pos;		/* spatial splits */
+	float cost;
+	struct aabox bbleft, bbright;
+};
+
+static int build_node(struct sbvh_state *st, struct bvhnode *node, struct bvhref *refs,
+		int num, int depth);
+static int make_leaf(struct bvhnode *node, struct bvhref *refs, int num);
+static int make_children(struct bvhnode *node, struct aabox *bbleft, struct aabox *bbright);
+static int find_object_split(struct bvhref *refs, int num, float area,
+		struct sbvh_split *split, struct aabox *cbox);
+static int partition_object(struct bvhref *refs, int num, struct sbvh_split *split,
+		struct aabox *cbox);
+static int find_spatial_split(struct bvhnode *node, struct bvhref *refs, int num, float area,
+		struct sbvh_split *split);
+static int partition_spatial(struct bvhref *refs, int num, struct sbvh_split *split,
+		struct bvhref **lrefs, int *nleft, struct bvhref **rrefs, int *nright);
+static void split_ref(struct bvhref *ref, int axis, float pos, struct aabox *lbox,
+		struct aabox *rbox);
+
+static inline int aabox_valid(struct aabox *box)
+{
+	return box->vmin.x <= box->vmax.x && box->vmin.y <= box->vmax.y &&
+		box->vmin.z <= box->vmax.z;
+}
+
+static inline void aabox_addpoint(struct aabox *box, cgm_vec3 *p)
+{
+	if(p->x < box->vmin.x) box->vmin.x = p->x;
+	if(p->x > box->vmax.x) box->vmax.x = p->x;
+	if(p->y < box->vmin.y) box->vmin.y = p->y;
+	if(p->y > box->vmax.y) box->vmax.y = p->y;
+	if(p->z < box->vmin.z) box->vmin.z = p->z;
+	if(p->z > box->vmax.z) box->vmax.z = p->z;
+}
+
+static inline void aabox_isect(struct aabox *res, struct aabox *a, struct aabox *b)
+{
+	res->vmin.x = a->vmin.x > b->vmin.x ? a->vmin.x : b->vmin.x;
+	res->vmax.x = a->vmax.x < b->vmax.x ? a->vmax.x : b->vmax.x;
+	res->vmin.y = a->vmin.y > b->vmin.y ? a->vmin.y : b->vmin.y;
+	res->vmax.y = a->vmax.y < b->vmax.y ? a->vmax.y : b->vmax.y;
+	res->vmin.z = a->vmin.z > b->vmin.z ? a->vmin.z : b->vmin.z;
+	res->vmax.z = a->vmax.z < b->vmax.z ? a->vmax.z : b->vmax.z;
+}
+
+static inline float ref_centroid(struct bvhref *ref, int axis)
+{
+	return (cgm_velem(&ref->box.vmin, axis) + cgm_velem(&ref->box.vmax, axis)) * 0.5f;
+}
+
+
+int build_bvh_sbvh(struct bvhnode *tree, float dup_budget)
+{
+	int i, res, nfaces;
+	struct bvhref *refs;
+	struct sbvh_state st;
+
+	assert(tree->num_faces > 0);
+
+	if(tree->left || tree->right) return 0;
+
+	if(!(refs = malloc(tree->num_faces * sizeof *refs))) {
+		fprintf(stderr, "build_bvh_sbvh: failed to allocate %d references\n", tree->num_faces);
+		return -1;
+	}
+
+	aabox_init(&tree->aabb);
+	for(i=0; i<tree->num_faces; i++) {
+		refs[i].tri = tree->faces[i];
+		aabox_init(&refs[i].box);
+		aabox_addface(&refs[i].box, refs[i].tri);
+		aabox_union(&tree->aabb, &tree->aabb, &refs[i].box);
+	}
+
+	if(dup_budget < 0.0f) dup_budget = 0.0f;
+	st.root_area = aabox_surf_area(&tree->aabb);
+	st.num_refs = tree->num_faces;
+	st.max_refs = tree->num_faces + (int)(tree->num_faces * dup_budget);
+
+	/* every leaf gets its own faces array, drop the original */
+	if(tree->max_faces) {
+		free(tree->faces);
+	}
+	tree->faces = 0;
+	tree->max_faces = 0;
+
+	nfaces = tree->num_faces;
+	res = build_node(&st, tree, refs, nfaces, 0);
+	free(refs);
+
+	printf("SBVH: %d references to %d faces (%.1f%% duplicates)\n", st.num_refs, nfaces,
+			100.0f * (st.num_refs - nfaces) / nfaces);
+	return res;
+}
+
+static int build_node(struct sbvh_state *st, struct bvhnode *node, struct bvhref *refs,
+		int num, int depth)
+{
+	int i, nleft, nright, res;
+	float area;
+	struct aabox cbox, overlap;
+	struct sbvh_split osplit, ssplit;
+	struct bvhref *lrefs, *rrefs;
+	int have_obj, have_spat = 0;
+
+	node->num_faces = num;
+
+	if(num <= 1 || depth >= MAX_DEPTH || (area = aabox_surf_area(&node->aabb)) <= 0.0f) {
+		return make_leaf(node, refs, num);
+	}
+
+	have_obj = find_object_split(refs, num, area, &osplit, &cbox);
+
+	/* consider spatial splits if the object split children overlap
+	 * significantly, and we haven't exhausted the duplication budget
+	 */
+	if(st->num_refs < st->max_refs) {
+		if(have_obj) {
+			aabox_isect(&overlap, &osplit.bbleft, &osplit.bbright);
+		}
+		if(!have_obj || (aabox_valid(&overlap) &&
+					aabox_surf_area(&overlap) / st->root_area > MIN_OVERLAP)) {
+			have_spat = find_spatial_split(node, refs, num, area, &ssplit);
+		}
+	}
+
+	if(have_spat && (!have_obj || ssplit.cost < osplit.cost) &&
+			ssplit.cost < COST_LEAF(num)) {
+		if(partition_spatial(refs, num, &ssplit, &lrefs, &nleft, &rrefs, &nright) == -1) {
+			return -1;
+		}
+		if(nleft && nright && nleft < num && nright < num &&
+				st->num_refs + nleft + nright - num <= st->max_refs) {
+			st->num_refs += nleft + nright - num;
+			node->axis = ssplit.axis;
+
+			/* tighten the child bounds to the clipped references */
+			aabox_init(&ssplit.bbleft);
+			for(i=0; i<nleft; i++) {
+				aabox_union(&ssplit.bbleft, &ssplit.bbleft, &lrefs[i].box);
+			}
+			aabox_init(&ssplit.bbright);
+			for(i=0; i<nright; i++) {
+				aabox_union(&ssplit.bbright, &ssplit.bbright, &rrefs[i].box);
+			}
+
+			if(make_children(node, &ssplit.bbleft, &ssplit.bbright) == -1) {
+				free(lrefs);
+				return -1;
+			}
+			res = build_node(st, node->left, lrefs, nleft, depth + 1);
+			if(res != -1) {
+				res = build_node(st, node->right, rrefs, nright, depth + 1);
+			}
+			free(lrefs);	/* rrefs is part of the same allocation */
+			return res;
+		}
+		/* spatial split didn't make progress, fall back to the object split */
+		free(lrefs);
+	}
+
+	if(!have_obj || osplit.cost >= COST_LEAF(num)) {
+		return make_leaf(node, refs, num);
+	}
+
+	nleft = partition_object(refs, num, &osplit, &cbox);
+	if(!nleft || nleft >= num) {
+		return make_leaf(node, refs, num);
+	}
+	node->axis = osplit.axis;
+
+	aabox_init(&osplit.bbleft);
+	for(i=0; i<nleft; i++) {
+		aabox_union(&osplit.bbleft, &osplit.bbleft, &refs[i].box);
+	}
+	aabox_init(&osplit.bbright);
+	for(i=nleft; i<num; i++) {
+		aabox_union(&osplit.bbright, &osplit.bbright, &refs[i].box);
+	}
+
+	if(make_children(node, &osplit.bbleft, &osplit.bbright) == -1) {
+		return -1;
+	}
+	if(build_node(st, node->left, refs, nleft, depth + 1) == -1) {
+		return -1;
+	}
+	return build_node(st, node->right, refs + nleft, num - nleft, depth + 1);
+}
+
+static int make_leaf(struct bvhnode *node, struct bvhref *refs, int num)
+{
+	int i;
+
+	if(!(node->faces = malloc(num * sizeof *node->faces))) {
+		fprintf(stderr, "build_bvh_sbvh: failed to allocate leaf faces (%d)\n", num);
+		return -1;
+	}
+	for(i=0; i<num; i++) {
+		node->faces[i] = refs[i].tri;
+	}
+	node->num_faces = node->max_faces = num;
+	return 0;
+}
+
+static int make_children(struct bvhnode *node, struct aabox *bbleft, struct aabox *bbright)
+{
+	if(!(node->left = calloc(1, sizeof *node->left))) {
+		fprintf(stderr, "failed to allocate tree nodes during BVH construction\n");
+		return -1;
+	}
+	if(!(node->right = calloc(1, sizeof *node->right))) {
+		fprintf(stderr, "failed to allocate tree nodes during BVH construction\n");
+		free(node->left);
+		node->left = 0;
+		return -1;
+	}
+	node->left->aabb = *bbleft;
+	node->right->aabb = *bbright;
+	node->num_faces = 0;
+	return 0;
+}
+
+static inline int obj_bucket(float c, float cmin, float scale)
+{
+	int b = (int)((c - cmin) * scale);
+	if(b < 0) return 0;
+	return b >= OBJ_BUCKETS ? OBJ_BUCKETS - 1 : b;
+}
+
+/* binned SAH object split over the centroids of the reference boxes. Same as
+ * the one in bvh.c, but working on references instead of faces.
+ */
+static int find_object_split(struct bvhref *refs, int num, float area,
+		struct sbvh_split *split, struct aabox *cbox)
+{
+	int i, j, b, n, axis;
+	float cost, ext, scale[3], cmin[3];
+	struct aabox box;
+	struct objbin bins[3][OBJ_BUCKETS];
+	struct aabox right_box[OBJ_BUCKETS];
+	int right_count[OBJ_BUCKETS];
+	cgm_vec3 c;
+
+	aabox_init(cbox);
+	for(i=0; i<num; i++) {
+		cgm_vcons(&c, ref_centroid(refs + i, 0), ref_centroid(refs + i, 1), ref_centroid(refs + i, 2));
+		aabox_addpoint(cbox, &c);
+	}
+
+	for(i=0; i<3; i++) {
+		ext = cgm_velem(&cbox->vmax, i) - cgm_velem(&cbox->vmin, i);
+		scale[i] = ext > 0.0f ? OBJ_BUCKETS / ext : 0.0f;
+		cmin[i] = cgm_velem(&cbox->vmin, i);
+		for(j=0; j<OBJ_BUCKETS; j++) {
+			aabox_init(&bins[i][j].aabb);
+			bins[i][j].count = 0;
+		}
+	}
+
+	for(i=0; i<num; i++) {
+		for(j=0; j<3; j++) {
+			b = obj_bucket(ref_centroid(refs + i, j), cmin[j], scale[j]);
+			aabox_union(&bins[j][b].aabb, &bins[j][b].aabb, &refs[i].box);
+			bins[j][b].count++;
+		}
+	}
+
+	split->axis = -1;
+	split->cost = FLT_MAX;
+
+	for(axis=0; axis<3; axis++) {
+		aabox_init(&box);
+		n = 0;
+		for(i=OBJ_BUCKETS-1; i>0; i--) {
+			aabox_union(&box, &box, &bins[axis][i].aabb);
+			n += bins[axis][i].count;
+			right_box[i] = box;
+			right_count[i] = n;
+		}
+
+		aabox_init(&box);
+		n = 0;
+		for(i=1; i<OBJ_BUCKETS; i++) {
+			aabox_union(&box, &box, &bins[axis][i - 1].aabb);
+			n += bins[axis][i - 1].count;
+			if(!n || !right_count[i]) continue;
+
+			cost = COST_TRAV + (aabox_surf_area(&box) * COST_LEAF(n) +
+					aabox_surf_area(right_box + i) * COST_LEAF(right_count[i])) / area;
+			if(cost < split->cost) {
+				split->cost = cost;
+				split->axis = axis;
+				split->bucket = i;
+				split->bbleft = box;
+				split->bbright = right_box[i];
+			}
+		}
+	}
+	return split->axis >= 0;
+}
+
+static int partition_object(struct bvhref *refs, int num, struct sbvh_split *split,
+		struct aabox *cbox)
+{
+	int i, j;
+	float ext, scale, cmin;
+	struct bvhref tmp;
+
+	cmin = cgm_velem(&cbox->vmin, split->axis);
+	ext = cgm_velem(&cbox->vmax, split->axis) - cmin;
+	scale = ext > 0.0f ? OBJ_BUCKETS / ext : 0.0f;
+
+	i = 0;
+	j = num - 1;
+	for(;;) {
+		while(i <= j && obj_bucket(ref_centroid(refs + i, split->axis), cmin, scale) < split->bucket) {
+			i++;
+		}
+		while(i <= j && obj_bucket(ref_centroid(refs + j, split->axis), cmin, scale) >= split->bucket) {
+			j--;
+		}
+		if(i >= j) break;
+
+		tmp = refs[i];
+		refs[i++] = refs[j];
+		refs[j--] = tmp;
+	}
+	return i;
+}
+
+/* bin references spatially into evenly spaced slabs along each axis of the
+ * node bounds, clipping each reference into every slab it overlaps. Entry and
+ * exit counts give the number of references on each side of every plane.
+ */
+static int find_spatial_split(struct bvhnode *node, struct bvhref *refs, int num, float area,
+		struct sbvh_split *split)
+{
+	int i, j, b0, b1, axis, nleft, nright;
+	float origin, ext, binsz, pos, cost;
+	struct spatbin bins[SPATIAL_BINS];
+	struct aabox box, lbox, rbox;
+	struct aabox right_box[SPATIAL_BINS];
+	int right_count[SPATIAL_BINS];
+	struct bvhref cur;
+
+	split->axis = -1;
+	split->cost = FLT_MAX;
+
+	for(axis=0; axis<3; axis++) {
+		origin = cgm_velem(&node->aabb.vmin, axis);
+		ext = cgm_velem(&node->aabb.vmax, axis) - origin;
+		if(ext <= 0.0f) continue;
+		binsz = ext / SPATIAL_BINS;
+
+		for(i=0; i<SPATIAL_BINS; i++) {
+			aabox_init(&bins[i].aabb);
+			bins[i].enter = bins[i].exit = 0;
+		}
+
+		for(i=0; i<num; i++) {
+			b0 = (int)((cgm_velem(&refs[i].box.vmin, axis) - origin) / binsz);
+			b1 = (int)((cgm_velem(&refs[i].box.vmax, axis) - origin) / binsz);
+			if(b0 < 0) b0 = 0;
+			if(b1 >= SPATIAL_BINS) b1 = SPATIAL_BINS - 1;
+			if(b1 < b0) b1 = b0;
+
+			cur = refs[i];
+			for(j=b0; j<b1; j++) {
+				split_ref(&cur, axis, origin + (j + 1) * binsz, &lbox, &rbox);
+				if(aabox_valid(&lbox)) {
+					aabox_union(&bins[j].aabb, &bins[j].aabb, &lbox);
+				}
+				cur.box = rbox;
+			}
+			if(aabox_valid(&cur.box)) {
+				aabox_union(&bins[b1].aabb, &bins[b1].aabb, &cur.box);
+			}
+			bins[b0].enter++;
+			bins[b1].exit++;
+		}
+
+		aabox_init(&box);
+		nright = 0;
+		for(i=SPATIAL_BINS-1; i>0; i--) {
+			aabox_union(&box, &box, &bins[i].aabb);
+			nright += bins[i].exit;
+			right_box[i] = box;
+			right_count[i] = nright;
+		}
+
+		aabox_init(&box);
+		nleft = 0;
+		for(i=1; i<SPATIAL_BINS; i++) {
+			aabox_union(&box, &box, &bins[i - 1].aabb);
+			nleft += bins[i - 1].enter;
+			if(!nleft || !right_count[i]) continue;
+
+			cost = COST_TRAV + (aabox_surf_area(&box) * COST_LEAF(nleft) +
+					aabox_surf_area(right_box + i) * COST_LEAF(right_count[i])) / area;
+			if(cost < split->cost) {
+				pos = origin + i * binsz;
+				split->cost = cost;
+				split->axis = axis;
+				split->pos = pos;
+				split->bbleft = box;
+				split->bbright = right_box[i];
+			}
+		}
+	}
+	return split->axis >= 0;
+}
+
+/* distribute references to two new arrays (allocated as a single block, with
+ * *lrefs at the start), clipping any straddling the split plane
+ */
+static int partition_spatial(struct bvhref *refs, int num, struct sbvh_split *split,
+		struct bvhref **lrefs, int *nleft, struct bvhref **rrefs, int *nright)
+{
+	int i, nl = 0, nr = 0;
+	float rmin, rmax;
+	struct bvhref *left, *right;
+	struct aabox lbox, rbox;
+
+	if(!(left = malloc(num * 2 * sizeof *left))) {
+		fprintf(stderr, "build_bvh_sbvh: failed to allocate references\n");
+		return -1;
+	}
+	right = left + num;
+
+	for(i=0; i<num; i++) {
+		rmin = cgm_velem(&refs[i].box.vmin, split->axis);
+		rmax = cgm_velem(&refs[i].box.vmax, split->axis);
+
+		if(rmax <= split->pos) {
+			left[nl++] = refs[i];
+		} else if(rmin >= split->pos) {
+			right[nr++] = refs[i];
+		} else {
+			split_ref(refs + i, split->axis, split->pos, &lbox, &rbox);
+			if(aabox_valid(&lbox)) {
+				left[nl].tri = refs[i].tri;
+				left[nl++].box = lbox;
+			}
+			if(aabox_valid(&rbox)) {
+				right[nr].tri = refs[i].tri;
+				right[nr++].box = rbox;
+			}
+		}
+	}
+
+	*lrefs = left;
+	*rrefs = right;
+	*nleft = nl;
+	*nright = nr;
+	return 0;
+}
+
+/* split a reference by an axis-aligned plane, computing the bounds of the
+ * part of the triangle on each side, clipped to the current reference bounds
+ */
+static void split_ref(struct bvhref *ref, int axis, float pos, struct aabox *lbox,
+		struct aabox *rbox)
+{
+	int i;
+	float p0, p1, t;
+	cgm_vec3 *v0, *v1, pt;
+
+	aabox_init(lbox);
+	aabox_init(rbox);
+
+	for(i=0; i<3; i++) {
+		v0 = &ref->tri->v[i].pos;
+		v1 = &ref->tri->v[i == 2 ? 0 : i + 1].pos;
+		p0 = cgm_velem(v0, axis);
+		p1 = cgm_velem(v1, axis);
+
+		if(p0 <= pos) aabox_addpoint(lbox, v0);
+		if(p0 >= pos) aabox_addpoint(rbox, v0);
+
+		if((p0 < pos && p1 > pos) || (p0 > pos && p1 < pos)) {
+			t = (pos - p0) / (p1 - p0);
+			cgm_vlerp(&pt, v0, v1, t);
+			cgm_velem(&pt, axis) = pos;
+			aabox_addpoint(lbox, &pt);
+			aabox_addpoint(rbox, &pt);
+		}
+	}
+
+	aabox_isect(lbox, lbox, &ref->box);
+	aabox_isect(rbox, rbox, &ref->box);
+}
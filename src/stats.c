@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "stats.h"
+
+#ifdef RT_STATS
+
+#define MAX_STAT_THREADS	256
+
+__thread struct rtstats *thr_stats;
+
+/* blocks are never freed, so that merge_stats can't outlive a thread's */
+static struct rtstats *blocks[MAX_STAT_THREADS];
+static int num_blocks;
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct rtstats overflow;
+
+struct rtstats *add_thread_stats(void)
+{
+	pthread_mutex_lock(&blocks_lock);
+	if(num_blocks >= MAX_STAT_THREADS || !(thr_stats = calloc(1, sizeof *thr_stats))) {
+		/* counts from here on are lost, but shouldn't crash */
+		thr_stats = &overflow;
+	} else {
+		blocks[num_blocks++] = thr_stats;
+	}
+	pthread_mutex_unlock(&blocks_lock);
+	return thr_stats;
+}
+
+static void add_stats(struct rtstats *dest, struct rtstats *src)
+{
+	int i;
+
+	for(i=0; i<RAYSTATS_DEPTH; i++) {
+		dest->rays.rays[i] += src->rays.rays[i];
+	}
+	dest->rays.shadow += src->rays.shadow;
+	dest->nodes += src->nodes;
+	dest->leaves += src->leaves;
+	dest->tri_tests += src->tri_tests;
+	dest->early_out += src->early_out;
+	dest->roulette += src->roulette;
+}
+
+void merge_stats(struct raystats *rays)
+{
+	int i;
+
+	memset(&stats_frame, 0, sizeof stats_frame);
+	stats_frame.rays = *rays;
+
+	pthread_mutex_lock(&blocks_lock);
+	for(i=0; i<num_blocks; i++) {
+		add_stats(&stats_frame, blocks[i]);
+		memset(blocks[i], 0, sizeof *blocks[i]);
+	}
+	pthread_mutex_unlock(&blocks_lock);
+
+	add_stats(&stats_total, &stats_frame);
+	stats_num_frames++;
+}
+
+void print_stats(FILE *fp)
+{
+	int i, last;
+	unsigned long nrays;
+	struct rtstats *st = &stats_total;
+
+	nrays = st->rays.shadow;
+	last = 0;
+	for(i=0; i<RAYSTATS_DEPTH; i++) {
+		nrays += st->rays.rays[i];
+		if(st->rays.rays[i]) last = i;
+	}
+	if(!nrays) return;
+
+	fprintf(fp, "ray statistics over %d frames:\n", stats_num_frames);
+	fprintf(fp, "  primary: %lu rays\n", st->rays.rays[0]);
+	for(i=1; i<=last; i++) {
+		fprintf(fp, "  bounce %d: %lu rays\n", i, st->rays.rays[i]);
+	}
+	fprintf(fp, "  shadow: %lu rays (%lu stopped at the first hit)\n", st->rays.shadow,
+			st->early_out);
+	fprintf(fp, "  paths ended by russian roulette: %lu\n", st->roulette);
+	fprintf(fp, "  per ray: %.2f nodes, %.2f leaves, %.2f triangles\n",
+			(double)st->nodes / nrays, (double)st->leaves / nrays,
+			(double)st->tri_tests / nrays);
+}
+
+#else	/* !RT_STATS */
+
+void merge_stats(struct raystats *rays)
+{
+}
+
+void print_stats(FILE *fp)
+{
+}
+#endif	/* RT_STATS */
@@ -0,0 +1,48 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdio.h>
+#include "rt.h"
+
+/* traversal counters, compiled in with -DRT_STATS (make stats=1), on top of
+ * the ray counts the renderers always keep (struct raystats). Each thread
+ * counts into its own block, and merge_stats adds them all up at the end of
+ * every frame. Without RT_STATS, the counting macro expands to nothing, and
+ * merge_stats and print_stats do nothing.
+ */
+#ifdef RT_STATS
+struct rtstats {
+	struct raystats rays;		/* from the renderer, see merge_stats */
+	unsigned long nodes;		/* BVH nodes visited, including instance trees */
+	unsigned long leaves;		/* leaves reached */
+	unsigned long tri_tests;	/* triangles in the leaves reached */
+	unsigned long early_out;	/* occlusion queries ended at the first hit */
+	unsigned long roulette;		/* paths ended by Russian roulette */
+};
+
+/* counters of the last frame, and of every frame so far */
+struct rtstats stats_frame, stats_total;
+int stats_num_frames;
+
+extern __thread struct rtstats *thr_stats;
+
+struct rtstats *add_thread_stats(void);
+
+#define STAT_ADD(field, n) \
+	do { \
+		if(!thr_stats) add_thread_stats(); \
+		thr_stats->field += (n); \
+	} while(0)
+
+#else	/* !RT_STATS */
+#define STAT_ADD(field, n)
+#endif	/* RT_STATS */
+
+/* called between frames, while no other thread is counting, with the rays
+ * traced in the frame
+ */
+void merge_stats(struct raystats *rays);
+/* totals of all frames, and averages per ray */
+void print_stats(FILE *fp);
+
+#endif	/* STATS_H_ */
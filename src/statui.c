@@ -8,6 +8,7 @@
 #include "tpool.h"
 #include "drawtext.h"
 #include "game.h"
+#include "stats.h"
 
 #define VSCR_HEIGHT		600
 #define VSCR_WIDTH		(VSCR_HEIGHT * win_aspect)
@@ -20,6 +21,9 @@ static int quit, enabled;
 static float font_height, label_width;
 
 static void *update_stat(void *cls);
+#ifdef RT_STATS
+static void draw_rtstats(float x, float y);
+#endif
 
 int init_statui(void)
 {
@@ -105,6 +109,9 @@ void draw_statui(void)
 			y -= font_height * 2;
 		}
 	}
+#ifdef RT_STATS
+	draw_rtstats(10, y - font_height * 2);
+#endif
 	dtx_flush();
 
 	glMatrixMode(GL_TEXTURE);
@@ -117,6 +124,41 @@ void draw_statui(void)
 	glLoadIdentity();
 }
 
+#ifdef RT_STATS
+/* counters of the last frame, see stats.h */
+static void draw_rtstats(float x, float y)
+{
+	int i, len;
+	char buf[256];
+	unsigned long nrays;
+	struct rtstats *st = &stats_frame;
+
+	nrays = st->rays.shadow;
+	for(i=0; i<RAYSTATS_DEPTH; i++) {
+		nrays += st->rays.rays[i];
+	}
+	if(!nrays) return;
+
+	len = sprintf(buf, "rays: %lu primary", st->rays.rays[0]);
+	for(i=1; i<4 && st->rays.rays[i]; i++) {
+		len += sprintf(buf + len, ", %lu bounce %d", st->rays.rays[i], i);
+	}
+	sprintf(buf + len, ", %lu shadow", st->rays.shadow);
+	dtx_position(x, y);
+	dtx_string(buf);
+	y -= font_height;
+
+	dtx_position(x, y);
+	dtx_printf("per ray: %.1f nodes, %.2f leaves, %.1f triangles", (double)st->nodes / nrays,
+			(double)st->leaves / nrays, (double)st->tri_tests / nrays);
+	y -= font_height;
+
+	dtx_position(x, y);
+	dtx_printf("shadow rays stopped at the first hit: %lu, paths ended by roulette: %lu",
+			st->early_out, st->roulette);
+}
+#endif
+
 enum { USER, NICE, SYS, IDLE, IOWAIT, IRQ, SOFTIRQ, MAX_STATS };
 
 struct cpustat {
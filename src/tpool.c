@@ -1,11 +1,24 @@
 /* worker thread pool based on POSIX threads
  * author: John Tsiombikas <nuclear@member.fsf.org>
  * This code is public domain.
+ *
+ * Work stealing scheduler: every thread which enqueues work pushes it to a
+ * deque of its own (Chase & Lev 2005, with the memory orderings of Le et al.
+ * 2013), which only it pushes to, so submitting never takes a lock. Workers
+ * take their own work from the bottom of their deque, newest first, and when
+ * that runs out they steal the oldest item from the top of a random victim's
+ * deque, or from the deques of the threads outside the pool. Idle workers
+ * spin for a while before going to sleep, and enqueue wakes up at most one
+ * sleeper per item. tpool_parallel_for queues at most one helper job per
+ * worker for a whole range, and the helpers claim chunks of it from a shared
+ * counter.
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include "tpool.h"
 
 #if defined(__APPLE__) && defined(__MACH__)
@@ -31,15 +44,42 @@
 #endif
 
 
+/* the fields of items in a deque are read by stealing threads while the owner
+ * may be writing other slots, so they're accessed atomically, see deque_push
+ */
 struct work_item {
 	void *data;
 	tpool_callback work, done;
-	struct work_item *next;
+};
+
+struct ring {
+	long size;			/* power of two */
+	struct work_item *items;
+	struct ring *prev;	/* smaller rings this one replaced, see deque_grow */
+};
+
+struct deque {
+	long top, bottom;
+	struct ring *ring;
+	struct deque *next;	/* next deque of a thread outside the pool */
 };
 
 struct thread_data {
 	int id;
 	struct thread_pool *pool;
+	struct deque deq;
+	unsigned int rnd;	/* victim selection state */
+};
+
+/* a tpool_parallel_for range, on the stack of its caller. Helper jobs claim
+ * chunks of it, and the caller returns when none of them is using it anymore.
+ */
+struct range_job {
+	tpool_range_func func;
+	void *cls;
+	int count, grain;
+	int next;		/* first unclaimed index */
+	int nbusy;		/* helpers which haven't finished yet */
 };
 
 struct thread_pool {
@@ -47,14 +87,20 @@ struct thread_pool {
 	struct thread_data *tdata;
 	int num_threads;
 	pthread_key_t idkey;
+	pthread_key_t deqkey;	/* deque of the calling thread */
+
+	struct deque *extdeq;	/* deques of the threads outside the pool */
 
-	int qsize;
-	struct work_item *workq, *workq_tail;
-	pthread_mutex_t workq_mutex;
-	pthread_cond_t workq_condvar;
+	/* counters, updated atomically */
+	int qsize;		/* items in the deques */
+	int nactive;	/* items being worked on */
+	int nsleeping;	/* workers waiting for work_condvar */
+	int nwaiting;	/* threads waiting for done_condvar */
 
-	int nactive;	/* number of active workers (not sleeping) */
+	pthread_mutex_t sleep_mutex;
+	pthread_cond_t work_condvar;
 
+	pthread_mutex_t done_mutex;
 	pthread_cond_t done_condvar;
 
 	int should_quit;
@@ -69,25 +115,50 @@ struct thread_pool {
 #endif
 };
 
+#define DEQUE_INIT_SIZE	256
+/* failed steal rounds before an idle worker goes to sleep */
+#define IDLE_SPINS		64
+
+#define LOAD(x, ord)		__atomic_load_n(&(x), __ATOMIC_##ord)
+#define STORE(x, v, ord)	__atomic_store_n(&(x), v, __ATOMIC_##ord)
+#define ADD(x, v)			__atomic_add_fetch(&(x), v, __ATOMIC_SEQ_CST)
+#define FENCE(ord)			__atomic_thread_fence(__ATOMIC_##ord)
+
 static void *thread_func(void *args);
 static void send_done_event(struct thread_pool *tpool);
 
-static struct work_item *alloc_work_item(void);
-static void free_work_item(struct work_item *w);
+static int deque_init(struct deque *deq);
+static void deque_destroy(struct deque *deq);
+static int deque_push(struct deque *deq, struct work_item *item);
+static int deque_take(struct deque *deq, struct work_item *item);
+static int deque_steal(struct deque *deq, struct work_item *item);
+static int deque_empty(struct deque *deq);
+static struct deque *caller_deque(struct thread_pool *tpool);
+
+static int find_work(struct thread_pool *tpool, struct thread_data *tdata,
+		struct work_item *item);
+static int have_work(struct thread_pool *tpool);
+static void wake_workers(struct thread_pool *tpool, int all);
+static void notify_waiters(struct thread_pool *tpool);
+static void run_job(struct thread_pool *tpool, struct work_item *job);
+static void range_task(void *cls);
+static void clear_deque(struct thread_pool *tpool, struct deque *deq);
 
 
 struct thread_pool *tpool_create(int num_threads)
 {
-	int i;
+	int i, j;
 	struct thread_pool *tpool;
 
 	if(!(tpool = calloc(1, sizeof *tpool))) {
 		return 0;
 	}
-	pthread_mutex_init(&tpool->workq_mutex, 0);
-	pthread_cond_init(&tpool->workq_condvar, 0);
+	pthread_mutex_init(&tpool->sleep_mutex, 0);
+	pthread_cond_init(&tpool->work_condvar, 0);
+	pthread_mutex_init(&tpool->done_mutex, 0);
 	pthread_cond_init(&tpool->done_condvar, 0);
 	pthread_key_create(&tpool->idkey, 0);
+	pthread_key_create(&tpool->deqkey, 0);
 
 	pthread_setspecific(tpool->idkey, (void*)0xffffffff);
 
@@ -98,24 +169,45 @@ struct thread_pool *tpool_create(int num_threads)
 	if(num_threads <= 0) {
 		num_threads = tpool_num_processors();
 	}
-	tpool->num_threads = num_threads;
 
 	if(!(tpool->threads = calloc(num_threads, sizeof *tpool->threads))) {
 		free(tpool);
 		return 0;
 	}
-	if(!(tpool->tdata = malloc(num_threads * sizeof *tpool->tdata))) {
+	if(!(tpool->tdata = calloc(num_threads, sizeof *tpool->tdata))) {
 		free(tpool->threads);
 		free(tpool);
 		return 0;
 	}
 
+	/* every deque exists before any thread can try to steal from it */
 	for(i=0; i<num_threads; i++) {
 		tpool->tdata[i].id = i;
 		tpool->tdata[i].pool = tpool;
+		tpool->tdata[i].rnd = 0x9e3779b9 * (i + 1);
+		if(deque_init(&tpool->tdata[i].deq) == -1) {
+			while(--i >= 0) {
+				deque_destroy(&tpool->tdata[i].deq);
+			}
+			free(tpool->tdata);
+			free(tpool->threads);
+			free(tpool);
+			return 0;
+		}
+	}
+	tpool->num_threads = num_threads;
 
-		if(pthread_create(tpool->threads + i, 0, thread_func, tpool->tdata + i) == -1) {
-			/*tpool->threads[i] = 0;*/
+	for(i=0; i<num_threads; i++) {
+		if(pthread_create(tpool->threads + i, 0, thread_func, tpool->tdata + i) != 0) {
+			/* destroy only joins the threads which were created, and frees
+			 * their deques, so the rest are freed here. Nothing has been
+			 * queued yet, and stealing from an empty deque never touches
+			 * its ring.
+			 */
+			for(j=i; j<num_threads; j++) {
+				deque_destroy(&tpool->tdata[j].deq);
+			}
+			tpool->num_threads = i;
 			tpool_destroy(tpool);
 			return 0;
 		}
@@ -126,12 +218,13 @@ struct thread_pool *tpool_create(int num_threads)
 void tpool_destroy(struct thread_pool *tpool)
 {
 	int i;
+	struct deque *deq;
+
 	if(!tpool) return;
 
 	tpool_clear(tpool);
-	tpool->should_quit = 1;
-
-	pthread_cond_broadcast(&tpool->workq_condvar);
+	STORE(tpool->should_quit, 1, SEQ_CST);
+	wake_workers(tpool, 1);
 
 	if(tpool->threads) {
 		for(i=0; i<tpool->num_threads; i++) {
@@ -140,17 +233,30 @@ void tpool_destroy(struct thread_pool *tpool)
 		putchar('\n');
 		free(tpool->threads);
 	}
-	free(tpool->tdata);
+	if(tpool->tdata) {
+		for(i=0; i<tpool->num_threads; i++) {
+			deque_destroy(&tpool->tdata[i].deq);
+		}
+		free(tpool->tdata);
+	}
+	while(tpool->extdeq) {
+		deq = tpool->extdeq;
+		tpool->extdeq = deq->next;
+		deque_destroy(deq);
+		free(deq);
+	}
 
 	/* also wake up anyone waiting on the wait* calls */
-	tpool->nactive = 0;
-	pthread_cond_broadcast(&tpool->done_condvar);
+	STORE(tpool->nactive, 0, SEQ_CST);
+	notify_waiters(tpool);
 	send_done_event(tpool);
 
-	pthread_mutex_destroy(&tpool->workq_mutex);
-	pthread_cond_destroy(&tpool->workq_condvar);
+	pthread_mutex_destroy(&tpool->sleep_mutex);
+	pthread_cond_destroy(&tpool->work_condvar);
+	pthread_mutex_destroy(&tpool->done_mutex);
 	pthread_cond_destroy(&tpool->done_condvar);
 	pthread_key_delete(tpool->idkey);
+	pthread_key_delete(tpool->deqkey);
 
 #if defined(WIN32) || defined(__WIN32__)
 	if(tpool->wait_event) {
@@ -162,6 +268,7 @@ void tpool_destroy(struct thread_pool *tpool)
 		close(tpool->wait_pipe[1]);
 	}
 #endif
+	free(tpool);
 }
 
 int tpool_addref(struct thread_pool *tpool)
@@ -180,100 +287,478 @@ int tpool_release(struct thread_pool *tpool)
 
 void tpool_begin_batch(struct thread_pool *tpool)
 {
-	tpool->in_batch = 1;
+	STORE(tpool->in_batch, 1, SEQ_CST);
 }
 
 void tpool_end_batch(struct thread_pool *tpool)
 {
-	tpool->in_batch = 0;
-	pthread_cond_broadcast(&tpool->workq_condvar);
+	STORE(tpool->in_batch, 0, SEQ_CST);
+	wake_workers(tpool, 1);
 }
 
 int tpool_enqueue(struct thread_pool *tpool, void *data,
 		tpool_callback work_func, tpool_callback done_func)
 {
-	struct work_item *job;
+	struct deque *deq;
+	struct work_item item;
 
-	if(!(job = alloc_work_item())) {
+	if(!(deq = caller_deque(tpool))) {
 		return -1;
 	}
-	job->work = work_func;
-	job->done = done_func;
-	job->data = data;
-	job->next = 0;
-
-	pthread_mutex_lock(&tpool->workq_mutex);
-	if(tpool->workq) {
-		tpool->workq_tail->next = job;
-		tpool->workq_tail = job;
-	} else {
-		tpool->workq = tpool->workq_tail = job;
+	item.data = data;
+	item.work = work_func;
+	item.done = done_func;
+
+	/* counted before it can be stolen, so that qsize never goes negative */
+	ADD(tpool->qsize, 1);
+	if(deque_push(deq, &item) == -1) {
+		ADD(tpool->qsize, -1);
+		return -1;
 	}
-	++tpool->qsize;
-	pthread_mutex_unlock(&tpool->workq_mutex);
 
-	if(!tpool->in_batch) {
-		pthread_cond_broadcast(&tpool->workq_condvar);
+	if(!LOAD(tpool->in_batch, SEQ_CST)) {
+		wake_workers(tpool, 0);
 	}
 	return 0;
 }
 
 void tpool_clear(struct thread_pool *tpool)
 {
-	pthread_mutex_lock(&tpool->workq_mutex);
-	while(tpool->workq) {
-		void *tmp = tpool->workq;
-		tpool->workq = tpool->workq->next;
-		free(tmp);
+	int i;
+	struct deque *deq;
+
+	for(i=0; i<tpool->num_threads; i++) {
+		clear_deque(tpool, &tpool->tdata[i].deq);
+	}
+	for(deq=LOAD(tpool->extdeq, ACQUIRE); deq; deq=deq->next) {
+		clear_deque(tpool, deq);
 	}
-	tpool->workq = tpool->workq_tail = 0;
-	tpool->qsize = 0;
-	pthread_mutex_unlock(&tpool->workq_mutex);
+	notify_waiters(tpool);
 }
 
-int tpool_queued_jobs(struct thread_pool *tpool)
+/* tpool_parallel_for callers wait for their helpers, and expect the whole
+ * range to be done when they return, so helpers are run instead of dropped
+ */
+static void clear_deque(struct thread_pool *tpool, struct deque *deq)
 {
 	int res;
-	pthread_mutex_lock(&tpool->workq_mutex);
-	res = tpool->qsize;
-	pthread_mutex_unlock(&tpool->workq_mutex);
-	return res;
+	struct work_item item;
+
+	while((res = deque_steal(deq, &item)) != 0) {
+		if(res == -1) continue;
+
+		if(item.work == range_task) {
+			ADD(tpool->nactive, 1);
+			ADD(tpool->qsize, -1);
+			run_job(tpool, &item);
+		} else {
+			ADD(tpool->qsize, -1);
+		}
+	}
+}
+
+int tpool_queued_jobs(struct thread_pool *tpool)
+{
+	return LOAD(tpool->qsize, SEQ_CST);
 }
 
 int tpool_active_jobs(struct thread_pool *tpool)
 {
-	int res;
-	pthread_mutex_lock(&tpool->workq_mutex);
-	res = tpool->nactive;
-	pthread_mutex_unlock(&tpool->workq_mutex);
-	return res;
+	return LOAD(tpool->nactive, SEQ_CST);
 }
 
 int tpool_pending_jobs(struct thread_pool *tpool)
 {
-	int res;
-	pthread_mutex_lock(&tpool->workq_mutex);
-	res = tpool->qsize + tpool->nactive;
-	pthread_mutex_unlock(&tpool->workq_mutex);
-	return res;
+	return LOAD(tpool->qsize, SEQ_CST) + LOAD(tpool->nactive, SEQ_CST);
 }
 
+/* workers check nwaiting after every job, see notify_waiters. Waiters register
+ * before checking the counts, and hold done_mutex until they sleep, so they
+ * can't miss the last job finishing.
+ */
 void tpool_wait(struct thread_pool *tpool)
 {
-	pthread_mutex_lock(&tpool->workq_mutex);
-	while(tpool->nactive || tpool->qsize) {
-		pthread_cond_wait(&tpool->done_condvar, &tpool->workq_mutex);
-	}
-	pthread_mutex_unlock(&tpool->workq_mutex);
+	tpool_wait_pending(tpool, 0);
 }
 
 void tpool_wait_pending(struct thread_pool *tpool, int pending_target)
 {
-	pthread_mutex_lock(&tpool->workq_mutex);
-	while(tpool->qsize + tpool->nactive > pending_target) {
-		pthread_cond_wait(&tpool->done_condvar, &tpool->workq_mutex);
+	pthread_mutex_lock(&tpool->done_mutex);
+	ADD(tpool->nwaiting, 1);
+	while(tpool_pending_jobs(tpool) > pending_target) {
+		pthread_cond_wait(&tpool->done_condvar, &tpool->done_mutex);
+	}
+	ADD(tpool->nwaiting, -1);
+	pthread_mutex_unlock(&tpool->done_mutex);
+}
+
+void tpool_parallel_for(struct thread_pool *tpool, int count, int grain,
+		tpool_range_func func, void *cls)
+{
+	int i, nchunks, nhelpers, id;
+	struct range_job range;
+	struct deque *deq;
+	struct work_item item;
+	struct thread_data *tdata;
+
+	if(count <= 0) return;
+
+	if(grain <= 0) {
+		if((grain = count / (tpool->num_threads * 4)) < 1) {
+			grain = 1;
+		}
+	}
+	nchunks = (count + grain - 1) / grain;
+
+	range.func = func;
+	range.cls = cls;
+	range.count = count;
+	range.grain = grain;
+	range.next = 0;
+	range.nbusy = 0;
+
+	/* a worker calling this takes part, so it needs one helper less */
+	id = tpool_thread_id(tpool);
+	nhelpers = id >= 0 ? nchunks - 1 : nchunks;
+	if(nhelpers > tpool->num_threads) {
+		nhelpers = tpool->num_threads;
+	}
+
+	/* one helper per worker at most, however large the range is */
+	item.data = &range;
+	item.work = range_task;
+	item.done = 0;
+	if(nhelpers > 0 && (deq = caller_deque(tpool))) {
+		for(i=0; i<nhelpers; i++) {
+			ADD(range.nbusy, 1);
+			ADD(tpool->qsize, 1);
+			if(deque_push(deq, &item) == -1) {
+				ADD(tpool->qsize, -1);
+				ADD(range.nbusy, -1);
+				break;
+			}
+		}
+		wake_workers(tpool, i > 1);
+	}
+
+	if(id >= 0 || !LOAD(range.nbusy, SEQ_CST)) {
+		/* take part, or do it all if no helpers could be queued */
+		ADD(range.nbusy, 1);
+		range_task(&range);
+	}
+
+	if(id >= 0) {
+		/* the helpers may be stuck behind other jobs, so help out until
+		 * they're done, instead of holding a worker up
+		 */
+		tdata = tpool->tdata + id;
+		while(LOAD(range.nbusy, SEQ_CST)) {
+			if(find_work(tpool, tdata, &item)) {
+				ADD(tpool->nactive, 1);
+				ADD(tpool->qsize, -1);
+				run_job(tpool, &item);
+			} else {
+				sched_yield();
+			}
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&tpool->done_mutex);
+	ADD(tpool->nwaiting, 1);
+	while(LOAD(range.nbusy, SEQ_CST)) {
+		pthread_cond_wait(&tpool->done_condvar, &tpool->done_mutex);
+	}
+	ADD(tpool->nwaiting, -1);
+	pthread_mutex_unlock(&tpool->done_mutex);
+}
+
+/* claims chunks of a range until there are none left */
+static void range_task(void *cls)
+{
+	int start, end;
+	struct range_job *range = cls;
+
+	for(;;) {
+		start = __atomic_fetch_add(&range->next, range->grain, __ATOMIC_RELAXED);
+		if(start >= range->count) break;
+
+		if((end = start + range->grain) > range->count) {
+			end = range->count;
+		}
+		range->func(range->cls, start, end);
+	}
+
+	/* the range is gone as soon as the caller sees nbusy reach 0 */
+	ADD(range->nbusy, -1);
+}
+
+static struct ring *ring_alloc(long size)
+{
+	struct ring *ring;
+
+	if(!(ring = malloc(sizeof *ring + size * sizeof *ring->items))) {
+		return 0;
+	}
+	ring->size = size;
+	ring->items = (struct work_item*)(ring + 1);
+	ring->prev = 0;
+	return ring;
+}
+
+static int deque_init(struct deque *deq)
+{
+	memset(deq, 0, sizeof *deq);
+	if(!(deq->ring = ring_alloc(DEQUE_INIT_SIZE))) {
+		return -1;
+	}
+	return 0;
+}
+
+static void deque_destroy(struct deque *deq)
+{
+	struct ring *ring;
+
+	while(deq->ring) {
+		ring = deq->ring;
+		deq->ring = ring->prev;
+		free(ring);
+	}
+}
+
+static inline void read_item(struct ring *ring, long idx, struct work_item *item)
+{
+	struct work_item *slot = ring->items + (idx & (ring->size - 1));
+
+	item->data = LOAD(slot->data, RELAXED);
+	item->work = LOAD(slot->work, RELAXED);
+	item->done = LOAD(slot->done, RELAXED);
+}
+
+static inline void write_item(struct ring *ring, long idx, struct work_item *item)
+{
+	struct work_item *slot = ring->items + (idx & (ring->size - 1));
+
+	STORE(slot->data, item->data, RELAXED);
+	STORE(slot->work, item->work, RELAXED);
+	STORE(slot->done, item->done, RELAXED);
+}
+
+/* called by the owner when the ring is full. Thieves may still be reading
+ * from the old ring, so it's kept around until the deque is destroyed.
+ */
+static struct ring *deque_grow(struct deque *deq, struct ring *ring, long t, long b)
+{
+	long i;
+	struct ring *nring;
+	struct work_item item;
+
+	if(!(nring = ring_alloc(ring->size * 2))) {
+		return 0;
+	}
+	for(i=t; i<b; i++) {
+		read_item(ring, i, &item);
+		write_item(nring, i, &item);
+	}
+	nring->prev = ring;
+	STORE(deq->ring, nring, RELEASE);
+	return nring;
+}
+
+/* owner only: adds an item to the bottom */
+static int deque_push(struct deque *deq, struct work_item *item)
+{
+	long b, t;
+	struct ring *ring;
+
+	b = LOAD(deq->bottom, RELAXED);
+	t = LOAD(deq->top, ACQUIRE);
+	ring = LOAD(deq->ring, RELAXED);
+	if(b - t > ring->size - 1) {
+		if(!(ring = deque_grow(deq, ring, t, b))) {
+			return -1;
+		}
+	}
+	write_item(ring, b, item);
+	FENCE(RELEASE);
+	STORE(deq->bottom, b + 1, RELAXED);
+	return 0;
+}
+
+/* owner only: removes the item at the bottom, the newest one. Returns 0 if
+ * the deque is empty, or a thief got the last item first.
+ */
+static int deque_take(struct deque *deq, struct work_item *item)
+{
+	long b, t;
+	int res = 1;
+	struct ring *ring;
+
+	b = LOAD(deq->bottom, RELAXED) - 1;
+	ring = LOAD(deq->ring, RELAXED);
+	STORE(deq->bottom, b, RELAXED);
+	FENCE(SEQ_CST);
+	t = LOAD(deq->top, RELAXED);
+
+	if(t > b) {
+		STORE(deq->bottom, b + 1, RELAXED);
+		return 0;
+	}
+
+	read_item(ring, b, item);
+	if(t == b) {
+		/* the last item: whoever moves top past it gets it */
+		if(!__atomic_compare_exchange_n(&deq->top, &t, t + 1, 0, __ATOMIC_SEQ_CST,
+					__ATOMIC_RELAXED)) {
+			res = 0;
+		}
+		STORE(deq->bottom, b + 1, RELAXED);
+	}
+	return res;
+}
+
+/* any thread: removes the item at the top, the oldest one. Returns 1 on
+ * success, 0 if the deque is empty, or -1 if another thread got it first.
+ */
+static int deque_steal(struct deque *deq, struct work_item *item)
+{
+	long t, b;
+	struct ring *ring;
+
+	t = LOAD(deq->top, ACQUIRE);
+	FENCE(SEQ_CST);
+	b = LOAD(deq->bottom, ACQUIRE);
+	if(t >= b) return 0;
+
+	ring = LOAD(deq->ring, ACQUIRE);
+	read_item(ring, t, item);
+	if(!__atomic_compare_exchange_n(&deq->top, &t, t + 1, 0, __ATOMIC_SEQ_CST,
+				__ATOMIC_RELAXED)) {
+		return -1;
+	}
+	return 1;
+}
+
+static int deque_empty(struct deque *deq)
+{
+	return LOAD(deq->top, ACQUIRE) >= LOAD(deq->bottom, ACQUIRE);
+}
+
+/* workers push to their own deque. Other threads get one on their first
+ * enqueue, added to the list of external deques, which is never shortened
+ * before tpool_destroy.
+ */
+static struct deque *caller_deque(struct thread_pool *tpool)
+{
+	struct deque *deq;
+
+	if((deq = pthread_getspecific(tpool->deqkey))) {
+		return deq;
+	}
+
+	if(!(deq = malloc(sizeof *deq)) || deque_init(deq) == -1) {
+		free(deq);
+		return 0;
+	}
+	deq->next = LOAD(tpool->extdeq, RELAXED);
+	while(!__atomic_compare_exchange_n(&tpool->extdeq, &deq->next, deq, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	pthread_setspecific(tpool->deqkey, deq);
+	return deq;
+}
+
+/* own deque first, then steal, starting from a random worker. Steals which
+ * lose a race mean the victim had more, so a full round without finding
+ * anything is repeated until every deque was seen empty.
+ */
+static int find_work(struct thread_pool *tpool, struct thread_data *tdata,
+		struct work_item *item)
+{
+	int i, victim, res, retry;
+	struct deque *deq;
+
+	if(deque_take(&tdata->deq, item)) {
+		return 1;
+	}
+
+	do {
+		retry = 0;
+
+		tdata->rnd ^= tdata->rnd << 13;
+		tdata->rnd ^= tdata->rnd >> 17;
+		tdata->rnd ^= tdata->rnd << 5;
+		victim = tdata->rnd % tpool->num_threads;
+
+		for(i=0; i<tpool->num_threads; i++) {
+			if(victim != tdata->id) {
+				if((res = deque_steal(&tpool->tdata[victim].deq, item)) == 1) {
+					return 1;
+				}
+				if(res == -1) retry = 1;
+			}
+			if(++victim >= tpool->num_threads) victim = 0;
+		}
+
+		for(deq=LOAD(tpool->extdeq, ACQUIRE); deq; deq=deq->next) {
+			if((res = deque_steal(deq, item)) == 1) {
+				return 1;
+			}
+			if(res == -1) retry = 1;
+		}
+	} while(retry);
+
+	return 0;
+}
+
+static int have_work(struct thread_pool *tpool)
+{
+	int i;
+	struct deque *deq;
+
+	FENCE(SEQ_CST);
+	for(i=0; i<tpool->num_threads; i++) {
+		if(!deque_empty(&tpool->tdata[i].deq)) {
+			return 1;
+		}
 	}
-	pthread_mutex_unlock(&tpool->workq_mutex);
+	for(deq=LOAD(tpool->extdeq, ACQUIRE); deq; deq=deq->next) {
+		if(!deque_empty(deq)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* sleeping workers count themselves before checking for work one last time,
+ * so checking nsleeping after making work available can't miss them
+ */
+static void wake_workers(struct thread_pool *tpool, int all)
+{
+	FENCE(SEQ_CST);
+	if(!LOAD(tpool->nsleeping, RELAXED)) {
+		return;
+	}
+
+	pthread_mutex_lock(&tpool->sleep_mutex);
+	if(all) {
+		pthread_cond_broadcast(&tpool->work_condvar);
+	} else {
+		pthread_cond_signal(&tpool->work_condvar);
+	}
+	pthread_mutex_unlock(&tpool->sleep_mutex);
+}
+
+static void notify_waiters(struct thread_pool *tpool)
+{
+	FENCE(SEQ_CST);
+	if(!LOAD(tpool->nwaiting, RELAXED)) {
+		return;
+	}
+
+	pthread_mutex_lock(&tpool->done_mutex);
+	pthread_cond_broadcast(&tpool->done_condvar);
+	pthread_mutex_unlock(&tpool->done_mutex);
 }
 
 #if defined(WIN32) || defined(__WIN32__)
@@ -324,14 +809,16 @@ long tpool_timedwait(struct thread_pool *tpool, long timeout)
 	tout_ts.tv_nsec = tv0.tv_usec * 1000 + (timeout % 1000) * 1000000;
 	tout_ts.tv_sec = tv0.tv_sec + sec;
 
-	pthread_mutex_lock(&tpool->workq_mutex);
-	while(tpool->nactive || tpool->qsize) {
+	pthread_mutex_lock(&tpool->done_mutex);
+	ADD(tpool->nwaiting, 1);
+	while(tpool_pending_jobs(tpool)) {
 		if(pthread_cond_timedwait(&tpool->done_condvar,
-					&tpool->workq_mutex, &tout_ts) == ETIMEDOUT) {
+					&tpool->done_mutex, &tout_ts) == ETIMEDOUT) {
 			break;
 		}
 	}
-	pthread_mutex_unlock(&tpool->workq_mutex);
+	ADD(tpool->nwaiting, -1);
+	pthread_mutex_unlock(&tpool->done_mutex);
 
 	gettimeofday(&tv, 0);
 	return (tv.tv_sec - tv0.tv_sec) * 1000 + (tv.tv_usec - tv0.tv_usec) / 1000;
@@ -367,48 +854,55 @@ static void send_done_event(struct thread_pool *tpool)
 
 static void *thread_func(void *args)
 {
+	int spins = 0;
 	struct thread_data *tdata = args;
 	struct thread_pool *tpool = tdata->pool;
+	struct work_item job;
 
 	pthread_setspecific(tpool->idkey, (void*)(intptr_t)tdata->id);
-
-	pthread_mutex_lock(&tpool->workq_mutex);
-	while(!tpool->should_quit) {
-		if(!tpool->workq) {
-			pthread_cond_wait(&tpool->workq_condvar, &tpool->workq_mutex);
-			if(tpool->should_quit) break;
+	pthread_setspecific(tpool->deqkey, &tdata->deq);
+
+	while(!LOAD(tpool->should_quit, ACQUIRE)) {
+		if(find_work(tpool, tdata, &job)) {
+			/* active before dequeued, so that it's always pending */
+			ADD(tpool->nactive, 1);
+			ADD(tpool->qsize, -1);
+			run_job(tpool, &job);
+			spins = 0;
+			continue;
 		}
 
-		while(!tpool->should_quit && tpool->workq) {
-			/* grab the first job */
-			struct work_item *job = tpool->workq;
-			tpool->workq = tpool->workq->next;
-			if(!tpool->workq)
-				tpool->workq_tail = 0;
-			++tpool->nactive;
-			--tpool->qsize;
-			pthread_mutex_unlock(&tpool->workq_mutex);
-
-			/* do the job */
-			job->work(job->data);
-			if(job->done) {
-				job->done(job->data);
-			}
-			free_work_item(job);
+		if(++spins < IDLE_SPINS) {
+			sched_yield();
+			continue;
+		}
+		spins = 0;
 
-			pthread_mutex_lock(&tpool->workq_mutex);
-			/* notify everyone interested that we're done with this job */
-			pthread_cond_broadcast(&tpool->done_condvar);
-			send_done_event(tpool);
-			--tpool->nactive;
+		pthread_mutex_lock(&tpool->sleep_mutex);
+		ADD(tpool->nsleeping, 1);
+		while(!LOAD(tpool->should_quit, SEQ_CST) && !have_work(tpool)) {
+			pthread_cond_wait(&tpool->work_condvar, &tpool->sleep_mutex);
 		}
+		ADD(tpool->nsleeping, -1);
+		pthread_mutex_unlock(&tpool->sleep_mutex);
 	}
-	pthread_mutex_unlock(&tpool->workq_mutex);
-
 	return 0;
 }
 
 
+/* the job is counted as active by the caller */
+static void run_job(struct thread_pool *tpool, struct work_item *job)
+{
+	job->work(job->data);
+	if(job->done) {
+		job->done(job->data);
+	}
+
+	ADD(tpool->nactive, -1);
+	send_done_event(tpool);
+	notify_waiters(tpool);
+}
+
 int tpool_thread_id(struct thread_pool *tpool)
 {
 	int id = (intptr_t)pthread_getspecific(tpool->idkey);
@@ -450,39 +944,3 @@ int tpool_num_processors(void)
 	return info.dwNumberOfProcessors;
 #endif
 }
-
-#define MAX_WPOOL_SIZE	64
-static pthread_mutex_t wpool_lock = PTHREAD_MUTEX_INITIALIZER;
-static struct work_item *wpool;
-static int wpool_size;
-
-/* work item allocator */
-static struct work_item *alloc_work_item(void)
-{
-	struct work_item *w;
-
-	pthread_mutex_lock(&wpool_lock);
-	if(!wpool) {
-		pthread_mutex_unlock(&wpool_lock);
-		return malloc(sizeof(struct work_item));
-	}
-
-	w = wpool;
-	wpool = wpool->next;
-	--wpool_size;
-	pthread_mutex_unlock(&wpool_lock);
-	return w;
-}
-
-static void free_work_item(struct work_item *w)
-{
-	pthread_mutex_lock(&wpool_lock);
-	if(wpool_size >= MAX_WPOOL_SIZE) {
-		free(w);
-	} else {
-		w->next = wpool;
-		wpool = w;
-		++wpool_size;
-	}
-	pthread_mutex_unlock(&wpool_lock);
-}
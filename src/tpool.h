@@ -9,6 +9,8 @@ struct thread_pool;
 
 /* type of the function accepted as work or completion callback */
 typedef void (*tpool_callback)(void*);
+/* type of the function called by tpool_parallel_for for a range of indices */
+typedef void (*tpool_range_func)(void *cls, int start, int end);
 
 #ifdef __cplusplus
 extern "C" {
@@ -33,6 +35,15 @@ void tpool_end_batch(struct thread_pool *tpool);
  */
 int tpool_enqueue(struct thread_pool *tpool, void *data,
 		tpool_callback work_func, tpool_callback done_func);
+/* calls func for consecutive ranges of at most "grain" indices, covering
+ * [0, count), in parallel, and returns when all of them are done. It only
+ * waits for its own range, not for other pending jobs. A grain of 0 picks one
+ * which gives each worker a few ranges. When called by a work callback, the
+ * calling thread works on the range too.
+ */
+void tpool_parallel_for(struct thread_pool *tpool, int count, int grain,
+		tpool_range_func func, void *cls);
+
 /* clear the work queue. does not cancel any currently running jobs */
 void tpool_clear(struct thread_pool *tpool);
 
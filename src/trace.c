@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+#include "rt.h"
+
+static FILE *fp;
+static char *trace_fname;
+static int num_events, num_frames;
+static int max_named;	/* highest track which got a thread_name record */
+
+static void begin_event(void);
+static void name_track(int tid, const char *name, int idx);
+
+int trace_start(const char *fname)
+{
+	if(fp) trace_stop();
+
+	if(!(trace_fname = strdup(fname))) {
+		fprintf(stderr, "trace_start: failed to allocate file name\n");
+		return -1;
+	}
+	if(!(fp = fopen(fname, "wb"))) {
+		fprintf(stderr, "trace_start: failed to open %s for writing\n", fname);
+		free(trace_fname);
+		trace_fname = 0;
+		return -1;
+	}
+	num_events = num_frames = 0;
+
+	fprintf(fp, "{\"traceEvents\": [\n");
+	name_track(0, "frames", -1);
+	max_named = 0;
+
+	printf("tracing tile timeline to %s\n", fname);
+	return 0;
+}
+
+void trace_stop(void)
+{
+	if(!fp) return;
+
+	fprintf(fp, "\n],\n\"displayTimeUnit\": \"ms\"}\n");
+	fclose(fp);
+	fp = 0;
+
+	printf("wrote %d frames to %s\n", num_frames, trace_fname);
+	free(trace_fname);
+	trace_fname = 0;
+}
+
+int trace_active(void)
+{
+	return fp != 0;
+}
+
+/* worker threads go on tracks 1 and up, and the frames on track 0. The frame
+ * event records how busy the workers were during the frame: the time spent
+ * on tiles, over the time all of them were available, with the tail of the
+ * frame waiting for the last tiles showing as lost time.
+ */
+void trace_frame(int frame)
+{
+	int i, nthr = 0;
+	unsigned long busy = 0;
+	struct frametime ft;
+	struct tiletime *tt;
+
+	if(!fp) return;
+
+	get_frame_times(&ft);
+
+	for(i=0; i<ft.num_tiles; i++) {
+		tt = ft.tiles + i;
+		if(tt->thread < 0) continue;
+
+		while(max_named <= tt->thread) {
+			max_named++;
+			name_track(max_named, "worker", max_named - 1);
+		}
+		if(tt->thread >= nthr) nthr = tt->thread + 1;
+		busy += tt->end - tt->start;
+
+		begin_event();
+		fprintf(fp, "{\"name\": \"tile %d,%d\", \"cat\": \"tile\", \"ph\": \"X\", \"ts\": %lu, "
+				"\"dur\": %lu, \"pid\": 0, \"tid\": %d, \"args\": {\"frame\": %d}}",
+				tt->x, tt->y, tt->start, tt->end - tt->start, tt->thread + 1, frame);
+	}
+
+	begin_event();
+	fprintf(fp, "{\"name\": \"frame %d\", \"cat\": \"frame\", \"ph\": \"X\", \"ts\": %lu, "
+			"\"dur\": %lu, \"pid\": 0, \"tid\": 0, \"args\": {\"busy\": %.3f}}",
+			frame, ft.start, ft.end - ft.start,
+			nthr && ft.end > ft.start ? (double)busy / (nthr * (ft.end - ft.start)) : 0.0);
+	num_frames++;
+}
+
+static void begin_event(void)
+{
+	if(num_events++) {
+		fputs(",\n", fp);
+	}
+}
+
+static void name_track(int tid, const char *name, int idx)
+{
+	begin_event();
+	fprintf(fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %d, "
+			"\"args\": {\"name\": \"%s", tid, name);
+	if(idx >= 0) {
+		fprintf(fp, " %d", idx);
+	}
+	fputs("\"}}", fp);
+	/* keep the tracks in thread order */
+	begin_event();
+	fprintf(fp, "{\"name\": \"thread_sort_index\", \"ph\": \"M\", \"pid\": 0, \"tid\": %d, "
+			"\"args\": {\"sort_index\": %d}}", tid, tid);
+}
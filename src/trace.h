@@ -0,0 +1,15 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+/* timeline of the tiles of every frame, written in the Chrome trace event
+ * format, for chrome://tracing or ui.perfetto.dev. Each worker thread gets a
+ * track of its tiles, and the frames themselves go on a track of their own.
+ */
+int trace_start(const char *fname);
+void trace_stop(void);
+int trace_active(void);
+
+/* appends the tiles of the last frame, see get_frame_times */
+void trace_frame(int frame);
+
+#endif	/* TRACE_H_ */